@@ -1,5 +1,5 @@
 @echo off
 del mp3.exe
-cl mp3.c
+cl /O2 mp3.c
 echo.
 mp3.exe
\ No newline at end of file
@@ -2,6 +2,6 @@
 set -euo pipefail
 
 rm -f mp3.out
-cc -o mp3.out -Wall mp3.c
+cc -O2 -o mp3.out -Wall mp3.c -lm
 echo
 ./mp3.out
@@ -1,13 +1,40 @@
+// Needed for copy_file_range().
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <utime.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 // MPEG audio header, 32 bits:
 // - 11-bit syncword (all bits must be set)
 // -  2-bit MPEG version (00 MPEG2.5, 10 MPEG2, 11 MPEG1)
 // -  2-bit MPEG layer (01 Layer3, 10 Layer2, 11 Layer1)
-// -  1-bit error checking flag (if 1, 16-bit CRC follows header)
+// -  1-bit error checking flag (if 0, 16-bit CRC follows header)
 // -  4-bit bitrate index
 // -  2-bit sampling rate index
 // -  1-bit padding flag (is MP3 frame padded to fit the bitrate?)
@@ -40,8 +67,67 @@ typedef struct mpa_header_s {
     uint8_t  emphasisMode;              // one of the EMPHASIS_* constants
 } mpa_header;
 
+// Xing/Info header, stored by most encoders in place of the audio data of a stream's first frame.
+// "Xing" marks a VBR stream and "Info" a CBR one; the layout is identical:
+// - the 4-byte "Xing" or "Info" ID
+// - a 4-byte flags field saying which of the following fields are present
+// - a 4-byte frame count (flag 0x1)
+// - a 4-byte byte count (flag 0x2)
+// - a 100-byte seek table, or TOC (flag 0x4)
+// - a 4-byte quality indicator (flag 0x8)
+typedef struct xing_header_s {
+    bool     valid;                     // whether the header is valid or not
+    uint8_t* location;                  // the "Xing"/"Info" ID's location in memory
+    bool     isInfo;                    // whether this is an "Info" (CBR) header
+    uint32_t flags;                     // which of the fields below are present
+    uint32_t frameCount;                // number of frames in the stream, excluding this one
+    uint32_t byteCount;                 // number of bytes in the stream, including this frame
+    uint8_t  toc[100];                  // byte position of each percent of playback, out of 256
+    uint32_t quality;                   // encoder quality indicator, 0 (best) to 100 (worst)
+    size_t   size;                      // total size in bytes of the fields present
+} xing_header;
+
+// LAME extension of the Xing/Info header, found right after its last field. 36 bytes:
+// -  9-byte encoder version string
+// -  4-bit tag revision, 4-bit VBR method
+// -  1-byte lowpass filter frequency, in units of 100 Hz
+// -  4-byte peak signal amplitude, as a 9.23 fixed point value
+// -  2-byte radio ReplayGain and 2-byte audiophile ReplayGain fields
+// -  4-bit encoding flags, 4-bit ATH type
+// -  1-byte ABR bitrate, or minimal bitrate for VBR
+// - 12-bit encoder delay, 12-bit encoder padding, both in samples
+// -  1-byte misc field, 1-byte MP3Gain value, 2-byte preset and surround info
+// -  4-byte music length (bytes from the Xing frame up to the end of the audio)
+// -  2-byte music CRC (CRC-16 of the audio following the Xing frame)
+// -  2-byte tag CRC (CRC-16 of the Xing frame up to this field, normally its first 190 bytes)
+typedef struct lame_tag_s {
+    bool     valid;                     // whether the tag is valid or not
+    uint8_t* location;                  // the tag's location in memory
+    char     encoder[10];               // encoder version string, null-terminated
+    uint8_t  revision;                  // tag revision
+    uint8_t  vbrMethod;                 // VBR method (1 CBR, 2 ABR, 3-5 VBR, ...)
+    uint16_t lowpass;                   // lowpass filter frequency in Hz, 0 if unknown
+    float    peak;                      // peak signal amplitude, 1.0 being full scale
+    bool     radioGainSet;              // whether radioGain holds a value
+    float    radioGain;                 // radio (track) ReplayGain adjustment in dB
+    bool     audiophileGainSet;         // whether audiophileGain holds a value
+    float    audiophileGain;            // audiophile (album) ReplayGain adjustment in dB
+    uint8_t  encodingFlags;             // LAME encoding flags
+    uint8_t  athType;                   // ATH type
+    uint8_t  abrBitrate;                // ABR bitrate, or minimal bitrate for VBR, in kbps
+    uint16_t encoderDelay;              // samples added by the encoder at the start
+    uint16_t encoderPadding;            // samples added by the encoder at the end
+    int8_t   mp3Gain;                   // MP3Gain adjustment applied, in 1.5 dB steps
+    uint32_t musicLength;               // bytes from the Xing frame up to the end of the audio
+    uint16_t musicCRC;                  // CRC-16 of the audio following the Xing frame
+    uint16_t tagCRC;                    // CRC-16 of the Xing frame up to the tag CRC field
+    bool     tagCRCValid;               // whether tagCRC matches the frame's contents
+} lame_tag;
+
 // Relevant constants:
 #define INVALID_HEADER ((mpa_header) {0})
+#define INVALID_XING_HEADER ((xing_header) {0})
+#define INVALID_LAME_TAG ((lame_tag) {0})
 
 const uint8_t MPEG_V1  = 1;
 const uint8_t MPEG_V2  = 2;
@@ -56,6 +142,13 @@ const uint8_t EMPHASIS_NONE      = 1;
 const uint8_t EMPHASIS_50_15_MS  = 2;
 const uint8_t EMPHASIS_CCITT_J17 = 3;
 
+const uint32_t XING_FLAG_FRAMES  = 0x1;
+const uint32_t XING_FLAG_BYTES   = 0x2;
+const uint32_t XING_FLAG_TOC     = 0x4;
+const uint32_t XING_FLAG_QUALITY = 0x8;
+
+#define LAME_TAG_SIZE 36
+
 // Try to read an MPEG audio header from the given memory location. Returns an mpa_header object.
 mpa_header ReadMPAHeader (uint8_t* headerLoc) {
     mpa_header hdr = { 0 };
@@ -94,8 +187,8 @@ mpa_header ReadMPAHeader (uint8_t* headerLoc) {
     else if (mpegLayerBits == 0b11) hdr.mpegLayer = 1;
     else    return INVALID_HEADER;
 
-    // Store the CRC flag.
-    hdr.crcEnabled = (bool) crcEnabledBits;
+    // Store the CRC flag. The bit is a "protection absent" flag, so a CRC follows when it's clear.
+    hdr.crcEnabled = !crcEnabledBits;
 
     // Store the bitrate, which varies depending on bitrateBits, the MPEG version and the layer.
     //     bits     V1,L1   V1,L2   V1,L3   V2,L1   V2, L2 & L3
@@ -198,7 +291,7 @@ mpa_header ReadMPAHeader (uint8_t* headerLoc) {
     // Layer 3 uses them to enable or disable the intensity stereo and MS stereo features.
     // Layers 1 and 2 use them to mark which bands intensity stereo is applied to.
     if (hdr.mpegLayer == 3) {
-        if (cmeBits == 0b01 || cmeBits == 0b10) hdr.cmLayer3IntensityStereo = true;
+        if (cmeBits == 0b01 || cmeBits == 0b11) hdr.cmLayer3IntensityStereo = true;
         if (cmeBits == 0b10 || cmeBits == 0b11) hdr.cmLayer3MSStereo = true;
     } else {
         hdr.cmLayer2BandUpper = 31;
@@ -218,13 +311,23 @@ mpa_header ReadMPAHeader (uint8_t* headerLoc) {
     else if (emphasisBits == 0b10) hdr.emphasisMode = EMPHASIS_CCITT_J17;
     
     // Now that we've extracted everything out of the header, calculate the frame's size.
-    // The formula is 144 * bitrate (bits/sec) / samplerate (Hz)
-    // Add 1 if the padding bit is set, apparently.
+    // A frame holds a fixed number of samples: 384 for Layer1, 1152 for Layer2 and MPEG1 Layer3,
+    // and 576 for MPEG2/2.5 Layer3. Its size is therefore samples / 8 * bitrate / samplerate,
+    // which is 12, 144 or 72 * bitrate (bits/sec) / samplerate (Hz).
+    // Layer1 frames are made of 4-byte slots rather than bytes, and the padding bit adds one slot.
     // NOTE: hdr.bitrate is in kilobits per second and has to be converted.
     // NOTE: the obtained frame size includes the header.
-    // TODO: is this a Layer3-only thing? Do other MPEG audio frames behave the same?
-    hdr.frameSize = 144 * (hdr.bitrate * 1000) / hdr.samplerate;
-    if (hdr.framePadded) hdr.frameSize += 1;
+    if (hdr.mpegLayer == 1) {
+        hdr.frameSize = 12 * (hdr.bitrate * 1000) / hdr.samplerate;
+        if (hdr.framePadded) hdr.frameSize += 1;
+        hdr.frameSize *= 4;
+    } else if (hdr.mpegLayer == 3 && hdr.mpegVersion != MPEG_V1) {
+        hdr.frameSize = 72 * (hdr.bitrate * 1000) / hdr.samplerate;
+        if (hdr.framePadded) hdr.frameSize += 1;
+    } else {
+        hdr.frameSize = 144 * (hdr.bitrate * 1000) / hdr.samplerate;
+        if (hdr.framePadded) hdr.frameSize += 1;
+    }
 
     // Return the filled-out header.
     return hdr;
@@ -247,6 +350,173 @@ mpa_header GetNextHeader (mpa_header* lastHdr, uint8_t* lastLoc) {
     return GetFirstHeader(lastHdr->location + lastHdr->frameSize, lastLoc);
 }
 
+// Packed header, holding nothing but the raw 32-bit header word. It's a tenth of the size of an
+// mpa_header, and two headers can be compared with a single integer comparison. Where a location
+// is needed, pair it with a file offset (as frame_index does).
+// The Packed* accessors below decode its fields without branching, using lookup tables generated
+// from the same X_BITRATES list as ReadMPAHeader. They assume the header is valid, which can be
+// checked with PackedHeaderValid.
+typedef struct mpa_packed_header_s {
+    uint32_t word;                      // the raw header word, 0 if invalid
+} mpa_packed_header;
+
+// Bitrates in kbps, indexed by bitrate bits and by MPA_BITRATE_COLUMNS.
+#define X(MATCH, BITRATE_V1L1, BITRATE_V1L2, BITRATE_V1L3, BITRATE_V2L1, BITRATE_V2LX) \
+    [MATCH] = {BITRATE_V1L1, BITRATE_V1L2, BITRATE_V1L3, BITRATE_V2L1, BITRATE_V2LX},
+const uint16_t MPA_BITRATES[16][5] = {
+    X_BITRATES
+};
+#undef X
+
+// Column of MPA_BITRATES to use, indexed by version bits and layer bits.
+const uint8_t MPA_BITRATE_COLUMNS[4][4] = {
+    {0, 4, 4, 3},                       // MPEG2.5: reserved, Layer3, Layer2, Layer1
+    {0, 0, 0, 0},                       // reserved
+    {0, 4, 4, 3},                       // MPEG2
+    {0, 2, 1, 0},                       // MPEG1
+};
+
+// Sample rates in Hz, indexed by version bits and sample rate bits.
+const uint16_t MPA_SAMPLERATES[4][4] = {
+    {11025, 12000, 8000,  0},
+    {0,     0,     0,     0},
+    {22050, 24000, 16000, 0},
+    {44100, 48000, 32000, 0},
+};
+
+// Samples per frame, indexed by version bits and layer bits.
+const uint16_t MPA_SAMPLES_PER_FRAME[4][4] = {
+    {0, 576,  1152, 384},
+    {0, 0,    0,    0},
+    {0, 576,  1152, 384},
+    {0, 1152, 1152, 384},
+};
+
+const uint8_t MPA_VERSIONS[4]      = {MPEG_V25, 0, MPEG_V2, MPEG_V1};
+const uint8_t MPA_LAYERS[4]        = {0, 3, 2, 1};
+const uint8_t MPA_CHANNEL_MODES[4] = {
+    CHANNEL_MODE_STEREO, CHANNEL_MODE_JOINT_STEREO, CHANNEL_MODE_DUAL, CHANNEL_MODE_MONO
+};
+
+// Bits that stay the same for every frame of a well-formed stream: sync, version, layer, sample
+// rate and channel mode.
+const uint32_t MPA_STREAM_BITS_MASK = 0b11111111111111100000110011000000;
+
+#define MPA_VERSION_BITS(WORD)    (((WORD) >> 19) & 0b11)
+#define MPA_LAYER_BITS(WORD)      (((WORD) >> 17) & 0b11)
+#define MPA_BITRATE_BITS(WORD)    (((WORD) >> 12) & 0b1111)
+#define MPA_SAMPLERATE_BITS(WORD) (((WORD) >> 10) & 0b11)
+
+// Check whether a packed header is a valid, non-free-format header. This is the one accessor that
+// has to branch.
+bool PackedHeaderValid (mpa_packed_header hdr) {
+    return (hdr.word & 0b11111111111000000000000000000000) == 0b11111111111000000000000000000000 &&
+           MPA_VERSION_BITS(hdr.word) != 0b01 &&
+           MPA_LAYER_BITS(hdr.word) != 0b00 &&
+           MPA_BITRATE_BITS(hdr.word) != 0b0000 && MPA_BITRATE_BITS(hdr.word) != 0b1111 &&
+           MPA_SAMPLERATE_BITS(hdr.word) != 0b11;
+}
+
+uint8_t PackedMPEGVersion (mpa_packed_header hdr) {
+    return MPA_VERSIONS[MPA_VERSION_BITS(hdr.word)];
+}
+
+uint8_t PackedMPEGLayer (mpa_packed_header hdr) {
+    return MPA_LAYERS[MPA_LAYER_BITS(hdr.word)];
+}
+
+bool PackedCRCEnabled (mpa_packed_header hdr) {
+    return !((hdr.word >> 16) & 1);
+}
+
+uint16_t PackedBitrate (mpa_packed_header hdr) {
+    uint8_t column = MPA_BITRATE_COLUMNS[MPA_VERSION_BITS(hdr.word)][MPA_LAYER_BITS(hdr.word)];
+    return MPA_BITRATES[MPA_BITRATE_BITS(hdr.word)][column];
+}
+
+uint16_t PackedSamplerate (mpa_packed_header hdr) {
+    return MPA_SAMPLERATES[MPA_VERSION_BITS(hdr.word)][MPA_SAMPLERATE_BITS(hdr.word)];
+}
+
+uint16_t PackedSamplesPerFrame (mpa_packed_header hdr) {
+    return MPA_SAMPLES_PER_FRAME[MPA_VERSION_BITS(hdr.word)][MPA_LAYER_BITS(hdr.word)];
+}
+
+bool PackedFramePadded (mpa_packed_header hdr) {
+    return (hdr.word >> 9) & 1;
+}
+
+uint8_t PackedChannelMode (mpa_packed_header hdr) {
+    return MPA_CHANNEL_MODES[(hdr.word >> 6) & 0b11];
+}
+
+uint8_t PackedChannelModeExtension (mpa_packed_header hdr) {
+    return (hdr.word >> 4) & 0b11;
+}
+
+// Get the frame's size in bytes, using the same formula as ReadMPAHeader: Layer1 counts 4-byte
+// slots, the other layers count bytes.
+size_t PackedFrameSize (mpa_packed_header hdr) {
+    size_t slotSize = (MPA_LAYER_BITS(hdr.word) == 0b11)? 4 : 1;
+    size_t slots    = PackedSamplesPerFrame(hdr) / 8 / slotSize * (PackedBitrate(hdr) * 1000) /
+                      PackedSamplerate(hdr);
+    return (slots + PackedFramePadded(hdr)) * slotSize;
+}
+
+// Check whether two packed headers could belong to the same stream.
+bool PackedSameStream (mpa_packed_header a, mpa_packed_header b) {
+    return ((a.word ^ b.word) & MPA_STREAM_BITS_MASK) == 0;
+}
+
+// Pack a header read by ReadMPAHeader, rebuilding the header word from its fields. mpa_header
+// doesn't keep the unused bit, so it comes back cleared. Returns a header with a word of 0 if the
+// header isn't valid.
+mpa_packed_header PackMPAHeader (mpa_header* hdr) {
+    mpa_packed_header packed = { 0 };
+    if (!hdr->valid) return packed;
+
+    uint32_t versionBits = (hdr->mpegVersion == MPEG_V1)? 0b11 : (hdr->mpegVersion == MPEG_V2)? 0b10 : 0b00;
+    uint32_t layerBits   = 4 - hdr->mpegLayer;
+    uint32_t column      = MPA_BITRATE_COLUMNS[versionBits][layerBits];
+
+    uint32_t bitrateBits = 0;
+    for (uint32_t i = 1; i < 15; i++) {
+        if (MPA_BITRATES[i][column] == hdr->bitrate) bitrateBits = i;
+    }
+    uint32_t samplerateBits = 0;
+    for (uint32_t i = 0; i < 3; i++) {
+        if (MPA_SAMPLERATES[versionBits][i] == hdr->samplerate) samplerateBits = i;
+    }
+    uint32_t cmBits = 0;
+    for (uint32_t i = 0; i < 4; i++) {
+        if (MPA_CHANNEL_MODES[i] == hdr->channelMode) cmBits = i;
+    }
+    uint32_t cmeBits;
+    if (hdr->mpegLayer == 3) cmeBits = (hdr->cmLayer3IntensityStereo? 0b01 : 0) | (hdr->cmLayer3MSStereo? 0b10 : 0);
+    else                     cmeBits = hdr->cmLayer2BandLower / 4 - 1;
+    uint32_t emphasisBits = (hdr->emphasisMode == EMPHASIS_NONE)?     0b00 :
+                            (hdr->emphasisMode == EMPHASIS_50_15_MS)? 0b01 :
+                            (hdr->emphasisMode == EMPHASIS_CCITT_J17)? 0b10 : 0b11;
+
+    packed.word = 0b11111111111000000000000000000000 |
+        (versionBits << 19) | (layerBits << 17) | ((uint32_t) !hdr->crcEnabled << 16) |
+        (bitrateBits << 12) | (samplerateBits << 10) | ((uint32_t) hdr->framePadded << 9) |
+        (cmBits << 6) | (cmeBits << 4) | ((uint32_t) hdr->copyrightFlag << 3) |
+        ((uint32_t) hdr->originalFlag << 2) | emphasisBits;
+    return packed;
+}
+
+// Unpack a packed header into an mpa_header, as ReadMPAHeader would have read it from the given
+// location. The location is only recorded, not read from.
+mpa_header UnpackMPAHeader (mpa_packed_header packed, uint8_t* location) {
+    uint8_t bytes[4] = {
+        packed.word >> 24, (packed.word >> 16) & 0xFF, (packed.word >> 8) & 0xFF, packed.word & 0xFF
+    };
+    mpa_header hdr = ReadMPAHeader(bytes);
+    if (hdr.valid) hdr.location = location;
+    return hdr;
+}
+
 // Attempt to read an ID3v2 header and return the total size in bytes of the entire ID3 tag.
 // Returns 0 if the given location does not point to a valid ID3v2 tag.
 size_t GetID3v2TagSize (uint8_t* loc) {
@@ -277,124 +547,6369 @@ size_t GetID3v2TagSize (uint8_t* loc) {
     }
 }
 
-// Struct for an in-memory file.
-typedef struct mem_file_s {
-    size_t   size;
-    uint8_t* mem;
-} mem_file;
+// Read a big-endian 32-bit integer from the given memory location.
+uint32_t ReadBE32 (uint8_t* loc) {
+    return ((uint32_t) loc[0] << 24) | ((uint32_t) loc[1] << 16) | ((uint32_t) loc[2] << 8) | loc[3];
+}
 
-// Load an entire file into memory as a null-terminated string. Returns a mem_file object.
-mem_file ReadFileIntoMemory (char* filename) {
-    // Open the file:
-    FILE* stream = fopen(filename, "r");
-    if (stream == NULL) {
-        fprintf(stderr, "ReadFile: failed to open %s\n", filename);
-        exit(1);
+// Get the size in bytes of the Layer 3 side information that follows a header (and its CRC, if
+// any). Returns 0 for other layers, which have no side information.
+size_t GetSideInfoSize (mpa_header* hdr) {
+    if (hdr->mpegLayer != 3) return 0;
+    if (hdr->mpegVersion == MPEG_V1) return (hdr->channelMode == CHANNEL_MODE_MONO)? 17 : 32;
+    else                             return (hdr->channelMode == CHANNEL_MODE_MONO)?  9 : 17;
+}
+
+// Get the main_data_begin field of a Layer 3 frame: the number of bytes before the frame's own main
+// data at which its main data really starts, in the main data of earlier frames (the so-called bit
+// reservoir). It's the first 9 (MPEG1) or 8 (MPEG2/2.5) bits of the side information.
+uint16_t GetMainDataBegin (mpa_header* hdr) {
+    if (hdr->mpegLayer != 3) return 0;
+    uint8_t* sideInfo = hdr->location + 4 + (hdr->crcEnabled? 2 : 0);
+    if (hdr->mpegVersion == MPEG_V1) return (sideInfo[0] << 1) | (sideInfo[1] >> 7);
+    else                             return sideInfo[0];
+}
+
+// Get the number of bytes of main data a frame holds, which is whatever follows its header, CRC and
+// side information.
+size_t GetMainDataSize (mpa_header* hdr) {
+    size_t overhead = 4 + (hdr->crcEnabled? 2 : 0) + GetSideInfoSize(hdr);
+    return (hdr->frameSize > overhead)? hdr->frameSize - overhead : 0;
+}
+
+// Read a 64-bit big-endian value from loc.
+uint64_t ReadBE64 (uint8_t* loc) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // A single unaligned load and byte swap.
+    uint64_t value;
+    memcpy(&value, loc, 8);
+    return __builtin_bswap64(value);
+#else
+    return ((uint64_t) ReadBE32(loc) << 32) | ReadBE32(loc + 4);
+#endif
+}
+
+// Reader of a big-endian bit stream, such as the side information or main data of a frame.
+typedef struct bit_reader_s {
+    uint8_t* loc;                       // start of the stream
+    size_t   pos;                       // position of the next bit to read, in bits from loc
+    size_t   end;                       // size of the stream in bits
+} bit_reader;
+
+// Create a bit reader over size bytes at loc. ReadBits loads 8 bytes at a time, so there must be
+// at least 8 readable bytes after the stream: copy it to a padded buffer if there might not be.
+bit_reader CreateBitReader (uint8_t* loc, size_t size) {
+    return (bit_reader) { loc, 0, size * 8 };
+}
+
+// Read count bits (at most 32) from a bit reader, as an unsigned number. Reading past the end of
+// the stream reads the padding after it, but the reader's position still advances, so it's enough
+// to check for pos > end once done.
+uint32_t ReadBits (bit_reader* br, int count) {
+    if (count == 0) return 0;
+    // The 64 bits starting at the byte holding the next bit always contain the count bits wanted,
+    // as at most 7 of them are before the next bit.
+    size_t   pos    = (br->pos < br->end)? br->pos : br->end;
+    uint64_t window = ReadBE64(br->loc + (pos >> 3));
+    uint32_t value  = (uint32_t) ((window << (pos & 7)) >> (64 - count));
+    br->pos += count;
+    return value;
+}
+
+// Write count bits (at most 32) of value at bit position pos from loc, big-endian, leaving the
+// bits around them untouched. Only bytes whose value changes are written to, so that pages of
+// mapped files aren't dirtied for nothing.
+void WriteBits (uint8_t* loc, size_t pos, int count, uint32_t value) {
+    for (size_t byte = pos >> 3; byte <= (pos + count - 1) >> 3; byte++) {
+        uint8_t old = loc[byte], updated = old;
+        for (int bit = 0; bit < 8; bit++) {
+            size_t at = (byte << 3) + bit;
+            if (at < pos || at >= pos + count) continue;
+            uint8_t mask = 0x80 >> bit;
+            if ((value >> (pos + count - 1 - at)) & 1) updated |= mask;
+            else                                       updated &= ~mask;
+        }
+        if (updated != old) loc[byte] = updated;
     }
+}
 
-    // Get the file's size and allocate a suitably-sized buffer:
-    fseek(stream, 0, SEEK_END);
-    size_t   size = ftell(stream);
-    uint8_t* mem  = (uint8_t*) malloc(size + 1);
-    if (mem == NULL) {
-        fprintf(stderr, "ReadFile: %lld byte allocation failed\n", (uint64_t) size);
-        exit(1);
+// Layer 3 side information of one channel in one granule.
+typedef struct granule_info_s {
+    uint16_t part23Length;              // bits of main data used by the scale factors and Huffman data
+    uint16_t bigValues;                 // number of pairs of spectral values in the big values region
+    uint8_t  globalGain;                // quantizer step size
+    uint16_t globalGainPos;             // bit position of global_gain in the side information
+    uint16_t scalefacCompress;          // scale factor bit lengths (4 bits in MPEG1, 9 in MPEG2/2.5)
+    bool     windowSwitching;           // whether blockType and mixedBlock apply
+    uint8_t  blockType;                 // 0 normal, 1 start, 2 short (3 windows), 3 stop
+    bool     mixedBlock;                // whether the lowest bands use long blocks in a short block
+    uint8_t  tableSelect[3];            // Huffman table of each big values region
+    uint8_t  subblockGain[3];           // gain offset of each short window
+    uint8_t  region0Count;              // scale factor bands in region 0, minus 1
+    uint8_t  region1Count;              // scale factor bands in region 1, minus 1
+    bool     preflag;                   // whether the pretab scale factor boost applies (MPEG1)
+    bool     scalefacScale;             // whether scale factors use a coarser step
+    bool     count1TableSelect;         // Huffman table of the count1 region (0 A, 1 B)
+} granule_info;
+
+// Layer 3 side information of a frame. MPEG1 frames hold two granules, MPEG2/2.5 ones just one.
+typedef struct side_info_s {
+    bool     valid;                     // whether the side information was read
+    uint16_t mainDataBegin;             // bytes back into the bit reservoir where the main data starts
+    uint8_t  privateBits;               // bits for private use
+    uint8_t  scfsi[2];                  // scale factor reuse flags for 4 band groups, per channel (MPEG1)
+    uint8_t  channels;                  // 1 or 2
+    uint8_t  granules;                  // 2 (MPEG1) or 1 (MPEG2/2.5)
+    granule_info gr[2][2];              // side information by granule, then by channel
+} side_info;
+
+#define INVALID_SIDE_INFO ((side_info) {0})
+
+// Read the side information of a Layer 3 frame, which must lie entirely in memory. The layout
+// depends on the MPEG version (MPEG1 has two granules, scfsi, and wider fields) and on the number
+// of channels. Returns INVALID_SIDE_INFO for other layers.
+side_info ReadSideInfo (mpa_header* hdr) {
+    if (hdr->mpegLayer != 3 || GetMainDataSize(hdr) == 0) return INVALID_SIDE_INFO;
+
+    // The side information is normally followed by enough main data for ReadBits to read past
+    // it. If it isn't, copy it to a padded buffer.
+    uint8_t  buffer[32 + 8] = { 0 };
+    size_t   size = GetSideInfoSize(hdr);
+    uint8_t* loc  = hdr->location + 4 + (hdr->crcEnabled? 2 : 0);
+    if (GetMainDataSize(hdr) < 8) loc = memcpy(buffer, loc, size);
+
+    bool       mpeg1 = hdr->mpegVersion == MPEG_V1;
+    side_info  si    = { true };
+    bit_reader br    = CreateBitReader(loc, size);
+    si.channels      = (hdr->channelMode == CHANNEL_MODE_MONO)? 1 : 2;
+    si.granules      = mpeg1? 2 : 1;
+
+    if (mpeg1) {
+        si.mainDataBegin = ReadBits(&br, 9);
+        si.privateBits   = ReadBits(&br, (si.channels == 1)? 5 : 3);
+        for (int ch = 0; ch < si.channels; ch++) si.scfsi[ch] = ReadBits(&br, 4);
+    } else {
+        si.mainDataBegin = ReadBits(&br, 8);
+        si.privateBits   = ReadBits(&br, si.channels);
     }
-    
-    // Rewind, read the file and close it.
-    rewind(stream);
-    fread(mem, 1, size, stream);
-    fclose(stream);
 
-    // Add the null terminator and build up the mem_file object to return.
-    mem[size] = '\0';
-    mem_file mf = {size, mem};
-    return mf;
+    for (int gr = 0; gr < si.granules; gr++) {
+        for (int ch = 0; ch < si.channels; ch++) {
+            granule_info* g = &si.gr[gr][ch];
+            g->part23Length     = ReadBits(&br, 12);
+            g->bigValues        = ReadBits(&br, 9);
+            g->globalGainPos    = (uint16_t) br.pos;
+            g->globalGain       = ReadBits(&br, 8);
+            g->scalefacCompress = ReadBits(&br, mpeg1? 4 : 9);
+            g->windowSwitching  = ReadBits(&br, 1);
+            if (g->windowSwitching) {
+                g->blockType  = ReadBits(&br, 2);
+                g->mixedBlock = ReadBits(&br, 1);
+                for (int i = 0; i < 2; i++) g->tableSelect[i]  = ReadBits(&br, 5);
+                for (int i = 0; i < 3; i++) g->subblockGain[i] = ReadBits(&br, 3);
+                // The regions are implicit: region 0 ends after 8 long bands, or the first 3 short
+                // bands of short and mixed blocks (see DecodeHuffman), and region 1 takes up the
+                // rest of the big values.
+                g->region0Count = (g->blockType == 2 && !g->mixedBlock)? 8 : 7;
+                g->region1Count = 36;
+            } else {
+                for (int i = 0; i < 3; i++) g->tableSelect[i] = ReadBits(&br, 5);
+                g->region0Count = ReadBits(&br, 4);
+                g->region1Count = ReadBits(&br, 3);
+            }
+            if (mpeg1) g->preflag = ReadBits(&br, 1);
+            g->scalefacScale     = ReadBits(&br, 1);
+            g->count1TableSelect = ReadBits(&br, 1);
+        }
+    }
+    return si;
 }
 
+// Number of extra bits ("linbits") each Huffman table of the big values region adds to values of
+// 15, for larger ones.
+const uint8_t HUFFMAN_LINBITS[32] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 2, 3, 4, 6, 8, 10, 13, 4, 5, 6, 7, 8, 9, 11, 13
+};
 
-int main() {
-    // Read the test file into memory and get a pointer to its contents:
-    mem_file testFileObj = ReadFileIntoMemory("test.mp3");
-    size_t fileStart  = (size_t) testFileObj.mem;
-    
-    // Get pointers to the first and last memory locations of the actual MPEG data:
-    uint8_t* firstLoc = testFileObj.mem + GetID3v2TagSize(testFileObj.mem);
-    uint8_t* lastLoc  = testFileObj.mem + testFileObj.size;
+// Largest value each Huffman table of the big values region codes, linbits aside. Tables 4 and 14
+// don't exist.
+const uint8_t HUFFMAN_MAX_VALUES[32] = {
+    0, 1, 2, 2, 0, 3, 3, 5, 5, 5, 7, 7, 7, 15, 0, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15
+};
 
-    
-    // Locate and print the first MPEG header's details:
-    printf("Starting MPEG header search at %08llx...\n", (uint64_t) (firstLoc - fileStart));
-    
-    mpa_header firstHeader = GetFirstHeader(firstLoc, lastLoc);
-    if (firstHeader.valid) {
-        printf("First valid header at %08llx:\n", (uint64_t) (firstHeader.location - fileStart));
-        printf("  MPEG%s Layer %d\n",
-            ((firstHeader.mpegVersion == MPEG_V1)? "1" :
-                (firstHeader.mpegVersion == MPEG_V2)? "2": "2.5"),
-            firstHeader.mpegLayer);
-        printf("  Bit rate:    %d kbps\n", firstHeader.bitrate);
-        printf("  Sample rate: %d Hz\n", firstHeader.samplerate);
-        printf("  Copyright: %s\n", firstHeader.copyrightFlag? "yes" : "no");
-        printf("  Original:  %s\n", firstHeader.originalFlag?  "yes" : "no");
-    } else {
-        printf("No valid MPEG audio headers found.\n");
+// Get an upper bound of the amplitude (1.0 being full scale) of the spectral values of one channel
+// of a granule, from its side information alone. Huffman tables bound the quantized values of the
+// big values region, the count1 region holds values of at most 1, and a part2_3_length of 0 means
+// all values are 0. Values are scaled by |value|^(4/3) * 2^((global_gain - 210) / 4) and then
+// attenuated by the scale factors and subblock gains, which are left out.
+double GetGranulePeakBound (granule_info* g) {
+    if (g->part23Length == 0) return 0.0;
+    int maxValue = 1;
+    if (g->bigValues > 0) {
+        for (int i = 0; i < (g->windowSwitching? 2 : 3); i++) {
+            int table = g->tableSelect[i];
+            int value = HUFFMAN_MAX_VALUES[table] + ((1 << HUFFMAN_LINBITS[table]) - 1);
+            if (value > maxValue) maxValue = value;
+        }
     }
-    printf("\n");
+    return pow(maxValue, 4.0 / 3.0) * pow(2.0, (g->globalGain - 210) / 4.0);
+}
 
-    
-    // Print a table containing details for the first n MPEG headers:
-    int nHeaders = 50;           // how many headers to process
-    bool printAllHeaders = true; // if false, skip headers with different MPEG versions or layers
+// Get an upper bound of the amplitude of the spectral values of a Layer 3 frame (see
+// GetGranulePeakBound), from its side information. MS stereo adds the mid and side channels, up
+// to sqrt(2) times either.
+double GetFramePeakBound (mpa_header* hdr, side_info* si) {
+    double peak = 0.0;
+    for (int gr = 0; gr < si->granules; gr++) {
+        for (int ch = 0; ch < si->channels; ch++) {
+            double bound = GetGranulePeakBound(&si->gr[gr][ch]);
+            if (bound > peak) peak = bound;
+        }
+    }
+    return hdr->cmLayer3MSStereo? peak * sqrt(2.0) : peak;
+}
 
-    if (printAllHeaders) {
-        printf("Printing first %d MPEG headers found.\n\n", nHeaders);
+// Get the index of a Layer 3 header's sample rate in tables given by sample rate: 0-2 for MPEG1
+// 44100, 48000 and 32000 Hz, 3-5 for MPEG2 22050, 24000 and 16000 Hz, and 6-8 for MPEG2.5 11025,
+// 12000 and 8000 Hz.
+int GetSamplerateIndex (mpa_header* hdr) {
+    return (hdr->mpegVersion - MPEG_V1) * 3 + ((hdr->location[2] >> 2) & 0b11);
+}
+
+// Boundaries of the scale factor bands of long blocks, in spectral values, by sample rate index.
+const uint16_t SFB_LONG_BOUNDS[9][23] = {
+    { 0, 4, 8, 12, 16, 20, 24, 30, 36, 44, 52, 62, 74, 90, 110, 134, 162, 196, 238, 288, 342, 418, 576 },
+    { 0, 4, 8, 12, 16, 20, 24, 30, 36, 42, 50, 60, 72, 88, 106, 128, 156, 190, 230, 276, 330, 384, 576 },
+    { 0, 4, 8, 12, 16, 20, 24, 30, 36, 44, 54, 66, 82, 102, 126, 156, 194, 240, 296, 364, 448, 550, 576 },
+    { 0, 6, 12, 18, 24, 30, 36, 44, 54, 66, 80, 96, 116, 140, 168, 200, 238, 284, 336, 396, 464, 522, 576 },
+    { 0, 6, 12, 18, 24, 30, 36, 44, 54, 66, 80, 96, 114, 136, 162, 194, 232, 278, 332, 394, 464, 540, 576 },
+    { 0, 6, 12, 18, 24, 30, 36, 44, 54, 66, 80, 96, 116, 140, 168, 200, 238, 284, 336, 396, 464, 522, 576 },
+    { 0, 6, 12, 18, 24, 30, 36, 44, 54, 66, 80, 96, 116, 140, 168, 200, 238, 284, 336, 396, 464, 522, 576 },
+    { 0, 6, 12, 18, 24, 30, 36, 44, 54, 66, 80, 96, 116, 140, 168, 200, 238, 284, 336, 396, 464, 522, 576 },
+    { 0, 12, 24, 36, 48, 60, 72, 88, 108, 132, 160, 192, 232, 280, 336, 400, 476, 566, 568, 570, 572, 574, 576 }
+};
+
+// Boundaries of the scale factor bands of short blocks, in spectral values of one of their 3
+// windows, by sample rate index. The values of a short block are stored band by band, and window
+// by window within each band.
+const uint8_t SFB_SHORT_BOUNDS[9][14] = {
+    { 0, 4, 8, 12, 16, 22, 30, 40, 52, 66, 84, 106, 136, 192 },
+    { 0, 4, 8, 12, 16, 22, 28, 38, 50, 64, 80, 100, 126, 192 },
+    { 0, 4, 8, 12, 16, 22, 30, 42, 58, 78, 104, 138, 180, 192 },
+    { 0, 4, 8, 12, 18, 24, 32, 42, 56, 74, 100, 132, 174, 192 },
+    { 0, 4, 8, 12, 18, 26, 36, 48, 62, 80, 104, 136, 180, 192 },
+    { 0, 4, 8, 12, 18, 26, 36, 48, 62, 80, 104, 134, 174, 192 },
+    { 0, 4, 8, 12, 18, 26, 36, 48, 62, 80, 104, 134, 174, 192 },
+    { 0, 4, 8, 12, 18, 26, 36, 48, 62, 80, 104, 134, 174, 192 },
+    { 0, 8, 16, 24, 36, 52, 72, 96, 124, 160, 162, 164, 166, 192 }
+};
+
+// Get the number of spectral values the long block bands of a mixed block cover, up to the start
+// of its short block bands at the third: 36, its 2 lowest subbands, but 72 for MPEG2.5 8000 Hz,
+// whose 6 long bands reach that far. The standard leaves that case open; it's taken here as 4
+// long subbands, so that the bands, the antialiasing and the filterbank all agree on it.
+int GetMixedBlockLongEnd (mpa_header* hdr) {
+    return 3 * SFB_SHORT_BOUNDS[GetSamplerateIndex(hdr)][3];
+}
+
+// Scale factor boost of each long block band when a granule's preflag is set.
+const uint8_t SFB_PRETAB[22] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 3, 3, 2, 0 };
+
+// Size in bytes of the largest bit reservoir main_data_begin can reach back into (MPEG1; MPEG2/2.5
+// reach back 255 bytes at most).
+#define MAIN_DATA_RESERVOIR_SIZE 511
+
+// Size in bytes of the largest main data a frame can hold.
+#define MAIN_DATA_MAX_FRAME_SIZE 2048
+
+// Size in bytes of the zeros after the main data, enough for ReadBits and RefillBitCache to read
+// past its end, even once a broken granule has overrun it.
+#define MAIN_DATA_PADDING 16
+
+// Main data of the granules of a Layer 3 frame, gathered from the bit reservoir and the frame.
+// The tail of the main data of earlier frames is kept in front of it, for the next frames to
+// reach back into.
+typedef struct main_data_s {
+    uint8_t data[MAIN_DATA_RESERVOIR_SIZE + MAIN_DATA_MAX_FRAME_SIZE + MAIN_DATA_PADDING];
+    size_t  size;                       // bytes of main data in data, the last frame's included
+} main_data;
+
+// Add the main data of a Layer 3 frame to md, and create a bit reader over the main data of its
+// granules, which starts mainDataBegin bytes back into the main data of earlier frames. Frames
+// must be added in stream order. Returns false if those bytes aren't there, as happens after
+// seeking or a broken frame, and the frame's granules can't be decoded.
+bool LoadMainData (main_data* md, mpa_header* hdr, side_info* si, bit_reader* br) {
+    size_t size = GetMainDataSize(hdr);
+    if (size > MAIN_DATA_MAX_FRAME_SIZE) {
+        md->size = 0;
+        return false;
+    }
+    size_t keep = (md->size < MAIN_DATA_RESERVOIR_SIZE)? md->size : MAIN_DATA_RESERVOIR_SIZE;
+    memmove(md->data, md->data + md->size - keep, keep);
+    memcpy(md->data + keep, hdr->location + hdr->frameSize - size, size);
+    memset(md->data + keep + size, 0, MAIN_DATA_PADDING);
+    md->size = keep + size;
+
+    if (si->mainDataBegin > keep) return false;
+    *br = CreateBitReader(md->data + keep - si->mainDataBegin, si->mainDataBegin + size);
+    return true;
+}
+
+// Scale factors of one channel of a granule, which attenuate its scale factor bands.
+typedef struct scalefactors_s {
+    uint8_t l[22];                      // scale factor of each long block band
+    uint8_t s[13][3];                   // scale factor of each short block band, by window
+    uint8_t lBits[22];                  // bit length of each long block band's (MPEG2/2.5)
+    uint8_t sBits[13];                  // bit length of each short block band's (MPEG2/2.5)
+} scalefactors;
+
+// Bit lengths of the MPEG1 scale factors of bands 0-10 and 11-20 (long blocks) or 0-5 and 6-11
+// (short blocks), by scalefac_compress.
+const uint8_t SCALEFACTOR_SLEN[16][2] = {
+    { 0, 0 }, { 0, 1 }, { 0, 2 }, { 0, 3 }, { 3, 0 }, { 1, 1 }, { 1, 2 }, { 1, 3 },
+    { 2, 1 }, { 2, 2 }, { 2, 3 }, { 3, 1 }, { 3, 2 }, { 3, 3 }, { 4, 2 }, { 4, 3 }
+};
+
+// Number of MPEG2/2.5 scale factors in each of the 4 groups that share a bit length, by how
+// scalefac_compress is coded (see ReadScalefactors), then by block kind: long, short or mixed.
+const uint8_t LSF_SCALEFACTOR_COUNTS[6][3][4] = {
+    { { 6, 5, 5, 5 },   { 9, 9, 9, 9 },    { 6, 9, 9, 9 }   },
+    { { 6, 5, 7, 3 },   { 9, 9, 12, 6 },   { 6, 9, 12, 6 }  },
+    { { 11, 10, 0, 0 }, { 18, 18, 0, 0 },  { 15, 18, 0, 0 } },
+    { { 7, 7, 7, 0 },   { 12, 12, 12, 0 }, { 6, 15, 12, 0 } },
+    { { 6, 6, 6, 3 },   { 12, 9, 9, 6 },   { 6, 12, 9, 6 }  },
+    { { 8, 8, 5, 0 },   { 15, 12, 9, 0 },  { 6, 18, 9, 0 }  }
+};
+
+// Read the scale factors ("part 2") of one channel of a granule from its main data, which br must
+// be at the start of. sf must hold the scale factors of the same channel in the previous granule,
+// which MPEG1 granules can reuse (scfsi). MPEG2/2.5 scale factors set the granule's preflag, which
+// their side information lacks.
+void ReadScalefactors (bit_reader* br, mpa_header* hdr, side_info* si, int gr, int ch, scalefactors* sf) {
+    granule_info* g = &si->gr[gr][ch];
+    bool shortBlock = g->windowSwitching && g->blockType == 2;
+
+    if (hdr->mpegVersion == MPEG_V1) {
+        int slen1 = SCALEFACTOR_SLEN[g->scalefacCompress][0];
+        int slen2 = SCALEFACTOR_SLEN[g->scalefacCompress][1];
+        if (shortBlock) {
+            int firstShort = 0;
+            if (g->mixedBlock) {
+                for (int sfb = 0; sfb < 8; sfb++) sf->l[sfb] = ReadBits(br, slen1);
+                firstShort = 3;
+            }
+            for (int sfb = firstShort; sfb < 12; sfb++) {
+                for (int w = 0; w < 3; w++) sf->s[sfb][w] = ReadBits(br, (sfb < 6)? slen1 : slen2);
+            }
+            for (int w = 0; w < 3; w++) sf->s[12][w] = 0;
+        } else {
+            // Bands come in 4 groups, which the second granule can each take from the first.
+            const int groups[5] = { 0, 6, 11, 16, 21 };
+            for (int i = 0; i < 4; i++) {
+                if (gr == 1 && (si->scfsi[ch] & (0b1000 >> i))) continue;
+                for (int sfb = groups[i]; sfb < groups[i + 1]; sfb++) {
+                    sf->l[sfb] = ReadBits(br, (i < 2)? slen1 : slen2);
+                }
+            }
+            sf->l[21] = 0;
+        }
+        return;
+    }
+
+    // MPEG2/2.5 scalefac_compress codes 4 bit lengths in one of 3 ways, or 3 others for the right
+    // channel of intensity stereo, which moves its lowest bit elsewhere.
+    int sfc = g->scalefacCompress, slen[4] = { 0 }, table;
+    g->preflag = false;
+    if (hdr->cmLayer3IntensityStereo && ch == 1) {
+        sfc >>= 1;
+        if (sfc < 180) {
+            slen[0] = sfc / 36;  slen[1] = (sfc % 36) / 6;  slen[2] = sfc % 6;  table = 3;
+        } else if (sfc < 244) {
+            sfc -= 180;
+            slen[0] = sfc >> 4;  slen[1] = (sfc >> 2) & 3;  slen[2] = sfc & 3;  table = 4;
+        } else {
+            sfc -= 244;
+            slen[0] = sfc / 3;   slen[1] = sfc % 3;                             table = 5;
+        }
+    } else if (sfc < 400) {
+        slen[0] = (sfc >> 4) / 5;  slen[1] = (sfc >> 4) % 5;  slen[2] = (sfc & 15) >> 2;  slen[3] = sfc & 3;
+        table = 0;
+    } else if (sfc < 500) {
+        sfc -= 400;
+        slen[0] = (sfc >> 2) / 5;  slen[1] = (sfc >> 2) % 5;  slen[2] = sfc & 3;
+        table = 1;
     } else {
-        printf("Printing first %d MPEG%s Layer %d headers found.\n\n", nHeaders,
-            (firstHeader.mpegVersion == MPEG_V1)? "1" :
-                (firstHeader.mpegVersion == MPEG_V2)? "2" : "2.5",
-            firstHeader.mpegLayer);
+        sfc -= 500;
+        slen[0] = sfc / 3;  slen[1] = sfc % 3;
+        table = 2;
+        g->preflag = true;
     }
 
-    printf(" Location | MPEG | L | Kbps | Hz    | E | C | O | Frame \n");
-    printf("----------|------|---|------|-------|---|---|---|-------\n");
+    // Read them all in order, then spread them over the bands. Intensity stereo needs their bit
+    // lengths too, the largest value of each being no stereo position.
+    int     kind = shortBlock? (g->mixedBlock? 2 : 1) : 0;
+    uint8_t values[39] = { 0 }, bits[39] = { 0 };
+    int     count = 0;
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < LSF_SCALEFACTOR_COUNTS[table][kind][i]; j++) {
+            bits[count]     = slen[i];
+            values[count++] = ReadBits(br, slen[i]);
+        }
+    }
+    if (kind == 0) {
+        for (int sfb = 0; sfb < 21; sfb++) {
+            sf->l[sfb]     = values[sfb];
+            sf->lBits[sfb] = bits[sfb];
+        }
+        sf->l[21] = 0;
+    } else {
+        int next = 0, firstShort = 0;
+        if (kind == 2) {
+            for (int sfb = 0; sfb < 6; sfb++) {
+                sf->lBits[sfb] = bits[next];
+                sf->l[sfb]     = values[next++];
+            }
+            firstShort = 3;
+        }
+        for (int sfb = firstShort; sfb < 12; sfb++) {
+            sf->sBits[sfb] = bits[next];
+            for (int w = 0; w < 3; w++) sf->s[sfb][w] = values[next++];
+        }
+        for (int w = 0; w < 3; w++) sf->s[12][w] = 0;
+    }
+}
 
-    // Loop over each header starting with the previously obtained one.
-    mpa_header header = firstHeader;
-    while (header.valid && nHeaders > 0) {
-        // If printAllHeaders is false, check to see if this header's version and layer are correct:
-        if (printAllHeaders || (
-                header.mpegVersion == firstHeader.mpegVersion || 
-                header.mpegLayer   == firstHeader.mpegLayer))
-        {
-            // Print a row for the current header, containing:
-            // - location in memory
-            // - MPEG version
-            // - MPEG layer
-            // - bitrate (kbps)
-            // - sample rate (Hz)
-            // - whether error checking is enabled for this header
-            // - whether the "copyright" flag is set
-            // - whether the "original" flag is set
-            // - frame size
-            
-            printf(" %08llx | V%s | %d | %4d | %5d | %s | %s | %s | %5lld \n",
-                (uint64_t) (header.location - fileStart),
-                (header.mpegVersion == MPEG_V1)? "1  " :
-                    (header.mpegVersion == MPEG_V2)? "2  " : "2.5",
-                header.mpegLayer,
-                header.bitrate,
-                header.samplerate,
-                header.crcEnabled?    "Y" : " ",
-                header.copyrightFlag? "Y" : " ",
-                header.originalFlag?  "Y" : " ",
-                (uint64_t) header.frameSize);
-                
-            // Get the next header and decrement the nHeaders counter:
-            header = GetNextHeader(&header, lastLoc);
-            nHeaders--;
+// Huffman codes of the pairs of values (x, y) of each big values table, at index x * size + y,
+// and their lengths in bits, sign bits aside. Tables 17-23 use the codes of table 16 and tables
+// 25-31 those of table 24, with more linbits.
+const uint16_t HUFFMAN_CODES_1[4] = {
+    1, 1, 1, 0
+};
+
+const uint8_t HUFFMAN_LENGTHS_1[4] = {
+     1,  3,  2,  3
+};
+
+const uint16_t HUFFMAN_CODES_2[9] = {
+    1, 2, 1, 3, 1, 1, 3, 2, 0
+};
+
+const uint8_t HUFFMAN_LENGTHS_2[9] = {
+     1,  3,  6,  3,  3,  5,  5,  5,  6
+};
+
+const uint16_t HUFFMAN_CODES_3[9] = {
+    3, 2, 1, 1, 1, 1, 3, 2, 0
+};
+
+const uint8_t HUFFMAN_LENGTHS_3[9] = {
+     2,  2,  6,  3,  2,  5,  5,  5,  6
+};
+
+const uint16_t HUFFMAN_CODES_5[16] = {
+    1, 2, 6, 5,
+    3, 1, 4, 4,
+    7, 5, 7, 1,
+    6, 1, 1, 0
+};
+
+const uint8_t HUFFMAN_LENGTHS_5[16] = {
+     1,  3,  6,  7,
+     3,  3,  6,  7,
+     6,  6,  7,  8,
+     7,  6,  7,  8
+};
+
+const uint16_t HUFFMAN_CODES_6[16] = {
+    7, 3, 5, 1,
+    6, 2, 3, 2,
+    5, 4, 4, 1,
+    3, 3, 2, 0
+};
+
+const uint8_t HUFFMAN_LENGTHS_6[16] = {
+     3,  3,  5,  7,
+     3,  2,  4,  5,
+     4,  4,  5,  6,
+     6,  5,  6,  7
+};
+
+const uint16_t HUFFMAN_CODES_7[36] = {
+     1,  2, 10, 19, 16, 10,
+     3,  3,  7, 10,  5,  3,
+    11,  4, 13, 17,  8,  4,
+    12, 11, 18, 15, 11,  2,
+     7,  6,  9, 14,  3,  1,
+     6,  4,  5,  3,  2,  0
+};
+
+const uint8_t HUFFMAN_LENGTHS_7[36] = {
+     1,  3,  6,  8,  8,  9,
+     3,  4,  6,  7,  7,  8,
+     6,  5,  7,  8,  8,  9,
+     7,  7,  8,  9,  9,  9,
+     7,  7,  8,  9,  9, 10,
+     8,  8,  9, 10, 10, 10
+};
+
+const uint16_t HUFFMAN_CODES_8[36] = {
+     3,  4,  6, 18, 12,  5,
+     5,  1,  2, 16,  9,  3,
+     7,  3,  5, 14,  7,  3,
+    19, 17, 15, 13, 10,  4,
+    13,  5,  8, 11,  5,  1,
+    12,  4,  4,  1,  1,  0
+};
+
+const uint8_t HUFFMAN_LENGTHS_8[36] = {
+     2,  3,  6,  8,  8,  9,
+     3,  2,  4,  8,  8,  8,
+     6,  4,  6,  8,  8,  9,
+     8,  8,  8,  9,  9, 10,
+     8,  7,  8,  9, 10, 10,
+     9,  8,  9,  9, 11, 11
+};
+
+const uint16_t HUFFMAN_CODES_9[36] = {
+     7,  5,  9, 14, 15,  7,
+     6,  4,  5,  5,  6,  7,
+     7,  6,  8,  8,  8,  5,
+    15,  6,  9, 10,  5,  1,
+    11,  7,  9,  6,  4,  1,
+    14,  4,  6,  2,  6,  0
+};
+
+const uint8_t HUFFMAN_LENGTHS_9[36] = {
+     3,  3,  5,  6,  8,  9,
+     3,  3,  4,  5,  6,  8,
+     4,  4,  5,  6,  7,  8,
+     6,  5,  6,  7,  7,  8,
+     7,  6,  7,  7,  8,  9,
+     8,  7,  8,  8,  9,  9
+};
+
+const uint16_t HUFFMAN_CODES_10[64] = {
+     1,  2, 10, 23, 35, 30, 12, 17,
+     3,  3,  8, 12, 18, 21, 12,  7,
+    11,  9, 15, 21, 32, 40, 19,  6,
+    14, 13, 22, 34, 46, 23, 18,  7,
+    20, 19, 33, 47, 27, 22,  9,  3,
+    31, 22, 41, 26, 21, 20,  5,  3,
+    14, 13, 10, 11, 16,  6,  5,  1,
+     9,  8,  7,  8,  4,  4,  2,  0
+};
+
+const uint8_t HUFFMAN_LENGTHS_10[64] = {
+     1,  3,  6,  8,  9,  9,  9, 10,
+     3,  4,  6,  7,  8,  9,  8,  8,
+     6,  6,  7,  8,  9, 10,  9,  9,
+     7,  7,  8,  9, 10, 10,  9, 10,
+     8,  8,  9, 10, 10, 10, 10, 10,
+     9,  9, 10, 10, 11, 11, 10, 11,
+     8,  8,  9, 10, 10, 10, 11, 11,
+     9,  8,  9, 10, 10, 11, 11, 11
+};
+
+const uint16_t HUFFMAN_CODES_11[64] = {
+     3,  4, 10, 24, 34, 33, 21, 15,
+     5,  3,  4, 10, 32, 17, 11, 10,
+    11,  7, 13, 18, 30, 31, 20,  5,
+    25, 11, 19, 59, 27, 18, 12,  5,
+    35, 33, 31, 58, 30, 16,  7,  5,
+    28, 26, 32, 19, 17, 15,  8, 14,
+    14, 12,  9, 13, 14,  9,  4,  1,
+    11,  4,  6,  6,  6,  3,  2,  0
+};
+
+const uint8_t HUFFMAN_LENGTHS_11[64] = {
+     2,  3,  5,  7,  8,  9,  8,  9,
+     3,  3,  4,  6,  8,  8,  7,  8,
+     5,  5,  6,  7,  8,  9,  8,  8,
+     7,  6,  7,  9,  8, 10,  8,  9,
+     8,  8,  8,  9,  9, 10,  9, 10,
+     8,  8,  9, 10, 10, 11, 10, 11,
+     8,  7,  7,  8,  9, 10, 10, 10,
+     8,  7,  8,  9, 10, 10, 10, 10
+};
+
+const uint16_t HUFFMAN_CODES_12[64] = {
+     9,  6, 16, 33, 41, 39, 38, 26,
+     7,  5,  6,  9, 23, 16, 26, 11,
+    17,  7, 11, 14, 21, 30, 10,  7,
+    17, 10, 15, 12, 18, 28, 14,  5,
+    32, 13, 22, 19, 18, 16,  9,  5,
+    40, 17, 31, 29, 17, 13,  4,  2,
+    27, 12, 11, 15, 10,  7,  4,  1,
+    27, 12,  8, 12,  6,  3,  1,  0
+};
+
+const uint8_t HUFFMAN_LENGTHS_12[64] = {
+     4,  3,  5,  7,  8,  9,  9,  9,
+     3,  3,  4,  5,  7,  7,  8,  8,
+     5,  4,  5,  6,  7,  8,  7,  8,
+     6,  5,  6,  6,  7,  8,  8,  8,
+     7,  6,  7,  7,  8,  8,  8,  9,
+     8,  7,  8,  8,  8,  9,  8,  9,
+     8,  7,  7,  8,  8,  9,  9, 10,
+     9,  8,  8,  9,  9,  9,  9, 10
+};
+
+const uint16_t HUFFMAN_CODES_13[256] = {
+      1,   5,  14,  21,  34,  51,  46,  71,  42,  52,  68,  52,  67,  44,  43,  19,
+      3,   4,  12,  19,  31,  26,  44,  33,  31,  24,  32,  24,  31,  35,  22,  14,
+     15,  13,  23,  36,  59,  49,  77,  65,  29,  40,  30,  40,  27,  33,  42,  16,
+     22,  20,  37,  61,  56,  79,  73,  64,  43,  76,  56,  37,  26,  31,  25,  14,
+     35,  16,  60,  57,  97,  75, 114,  91,  54,  73,  55,  41,  48,  53,  23,  24,
+     58,  27,  50,  96,  76,  70,  93,  84,  77,  58,  79,  29,  74,  49,  41,  17,
+     47,  45,  78,  74, 115,  94,  90,  79,  69,  83,  71,  50,  59,  38,  36,  15,
+     72,  34,  56,  95,  92,  85,  91,  90,  86,  73,  77,  65,  51,  44,  43,  42,
+     43,  20,  30,  44,  55,  78,  72,  87,  78,  61,  46,  54,  37,  30,  20,  16,
+     53,  25,  41,  37,  44,  59,  54,  81,  66,  76,  57,  54,  37,  18,  39,  11,
+     35,  33,  31,  57,  42,  82,  72,  80,  47,  58,  55,  21,  22,  26,  38,  22,
+     53,  25,  23,  38,  70,  60,  51,  36,  55,  26,  34,  23,  27,  14,   9,   7,
+     34,  32,  28,  39,  49,  75,  30,  52,  48,  40,  52,  28,  18,  17,   9,   5,
+     45,  21,  34,  64,  56,  50,  49,  45,  31,  19,  12,  15,  10,   7,   6,   3,
+     48,  23,  20,  39,  36,  35,  53,  21,  16,  23,  13,  10,   6,   1,   4,   2,
+     16,  15,  17,  27,  25,  20,  29,  11,  17,  12,  16,   8,   1,   1,   0,   1
+};
+
+const uint8_t HUFFMAN_LENGTHS_13[256] = {
+     1,  4,  6,  7,  8,  9,  9, 10,  9, 10, 11, 11, 12, 12, 13, 13,
+     3,  4,  6,  7,  8,  8,  9,  9,  9,  9, 10, 10, 11, 12, 12, 12,
+     6,  6,  7,  8,  9,  9, 10, 10,  9, 10, 10, 11, 11, 12, 13, 13,
+     7,  7,  8,  9,  9, 10, 10, 10, 10, 11, 11, 11, 11, 12, 13, 13,
+     8,  7,  9,  9, 10, 10, 11, 11, 10, 11, 11, 12, 12, 13, 13, 14,
+     9,  8,  9, 10, 10, 10, 11, 11, 11, 11, 12, 11, 13, 13, 14, 14,
+     9,  9, 10, 10, 11, 11, 11, 11, 11, 12, 12, 12, 13, 13, 14, 14,
+    10,  9, 10, 11, 11, 11, 12, 12, 12, 12, 13, 13, 13, 14, 16, 16,
+     9,  8,  9, 10, 10, 11, 11, 12, 12, 12, 12, 13, 13, 14, 15, 15,
+    10,  9, 10, 10, 11, 11, 11, 13, 12, 13, 13, 14, 14, 14, 16, 15,
+    10, 10, 10, 11, 11, 12, 12, 13, 12, 13, 14, 13, 14, 15, 16, 17,
+    11, 10, 10, 11, 12, 12, 12, 12, 13, 13, 13, 14, 15, 15, 15, 16,
+    11, 11, 11, 12, 12, 13, 12, 13, 14, 14, 15, 15, 15, 16, 16, 16,
+    12, 11, 12, 13, 13, 13, 14, 14, 14, 14, 14, 15, 16, 15, 16, 16,
+    13, 12, 12, 13, 13, 13, 15, 14, 14, 17, 15, 15, 15, 17, 16, 16,
+    12, 12, 13, 14, 14, 14, 15, 14, 15, 15, 16, 16, 19, 18, 19, 16
+};
+
+const uint16_t HUFFMAN_CODES_15[256] = {
+      7,  12,  18,  53,  47,  76, 124, 108,  89, 123, 108, 119, 107,  81, 122,  63,
+     13,   5,  16,  27,  46,  36,  61,  51,  42,  70,  52,  83,  65,  41,  59,  36,
+     19,  17,  15,  24,  41,  34,  59,  48,  40,  64,  50,  78,  62,  80,  56,  33,
+     29,  28,  25,  43,  39,  63,  55,  93,  76,  59,  93,  72,  54,  75,  50,  29,
+     52,  22,  42,  40,  67,  57,  95,  79,  72,  57,  89,  69,  49,  66,  46,  27,
+     77,  37,  35,  66,  58,  52,  91,  74,  62,  48,  79,  63,  90,  62,  40,  38,
+    125,  32,  60,  56,  50,  92,  78,  65,  55,  87,  71,  51,  73,  51,  70,  30,
+    109,  53,  49,  94,  88,  75,  66, 122,  91,  73,  56,  42,  64,  44,  21,  25,
+     90,  43,  41,  77,  73,  63,  56,  92,  77,  66,  47,  67,  48,  53,  36,  20,
+     71,  34,  67,  60,  58,  49,  88,  76,  67, 106,  71,  54,  38,  39,  23,  15,
+    109,  53,  51,  47,  90,  82,  58,  57,  48,  72,  57,  41,  23,  27,  62,   9,
+     86,  42,  40,  37,  70,  64,  52,  43,  70,  55,  42,  25,  29,  18,  11,  11,
+    118,  68,  30,  55,  50,  46,  74,  65,  49,  39,  24,  16,  22,  13,  14,   7,
+     91,  44,  39,  38,  34,  63,  52,  45,  31,  52,  28,  19,  14,   8,   9,   3,
+    123,  60,  58,  53,  47,  43,  32,  22,  37,  24,  17,  12,  15,  10,   2,   1,
+     71,  37,  34,  30,  28,  20,  17,  26,  21,  16,  10,   6,   8,   6,   2,   0
+};
+
+const uint8_t HUFFMAN_LENGTHS_15[256] = {
+     3,  4,  5,  7,  7,  8,  9,  9,  9, 10, 10, 11, 11, 11, 12, 13,
+     4,  3,  5,  6,  7,  7,  8,  8,  8,  9,  9, 10, 10, 10, 11, 11,
+     5,  5,  5,  6,  7,  7,  8,  8,  8,  9,  9, 10, 10, 11, 11, 11,
+     6,  6,  6,  7,  7,  8,  8,  9,  9,  9, 10, 10, 10, 11, 11, 11,
+     7,  6,  7,  7,  8,  8,  9,  9,  9,  9, 10, 10, 10, 11, 11, 11,
+     8,  7,  7,  8,  8,  8,  9,  9,  9,  9, 10, 10, 11, 11, 11, 12,
+     9,  7,  8,  8,  8,  9,  9,  9,  9, 10, 10, 10, 11, 11, 12, 12,
+     9,  8,  8,  9,  9,  9,  9, 10, 10, 10, 10, 10, 11, 11, 11, 12,
+     9,  8,  8,  9,  9,  9,  9, 10, 10, 10, 10, 11, 11, 12, 12, 12,
+     9,  8,  9,  9,  9,  9, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12,
+    10,  9,  9,  9, 10, 10, 10, 10, 10, 11, 11, 11, 11, 12, 13, 12,
+    10,  9,  9,  9, 10, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12, 13,
+    11, 10,  9, 10, 10, 10, 11, 11, 11, 11, 11, 11, 12, 12, 13, 13,
+    11, 10, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12, 12, 12, 13, 13,
+    12, 11, 11, 11, 11, 11, 11, 11, 12, 12, 12, 12, 13, 13, 12, 13,
+    12, 11, 11, 11, 11, 11, 11, 12, 12, 12, 12, 12, 13, 13, 13, 13
+};
+
+const uint16_t HUFFMAN_CODES_16[256] = {
+       1,    5,   14,   44,   74,   63,  110,   93,  172,  149,  138,  242,  225,  195,  376,   17,
+       3,    4,   12,   20,   35,   62,   53,   47,   83,   75,   68,  119,  201,  107,  207,    9,
+      15,   13,   23,   38,   67,   58,  103,   90,  161,   72,  127,  117,  110,  209,  206,   16,
+      45,   21,   39,   69,   64,  114,   99,   87,  158,  140,  252,  212,  199,  387,  365,   26,
+      75,   36,   68,   65,  115,  101,  179,  164,  155,  264,  246,  226,  395,  382,  362,    9,
+      66,   30,   59,   56,  102,  185,  173,  265,  142,  253,  232,  400,  388,  378,  445,   16,
+     111,   54,   52,  100,  184,  178,  160,  133,  257,  244,  228,  217,  385,  366,  715,   10,
+      98,   48,   91,   88,  165,  157,  148,  261,  248,  407,  397,  372,  380,  889,  884,    8,
+      85,   84,   81,  159,  156,  143,  260,  249,  427,  401,  392,  383,  727,  713,  708,    7,
+     154,   76,   73,  141,  131,  256,  245,  426,  406,  394,  384,  735,  359,  710,  352,   11,
+     139,  129,   67,  125,  247,  233,  229,  219,  393,  743,  737,  720,  885,  882,  439,    4,
+     243,  120,  118,  115,  227,  223,  396,  746,  742,  736,  721,  712,  706,  223,  436,    6,
+     202,  224,  222,  218,  216,  389,  386,  381,  364,  888,  443,  707,  440,  437, 1728,    4,
+     747,  211,  210,  208,  370,  379,  734,  723,  714, 1735,  883,  877,  876, 3459,  865,    2,
+     377,  369,  102,  187,  726,  722,  358,  711,  709,  866, 1734,  871, 3458,  870,  434,    0,
+      12,   10,    7,   11,   10,   17,   11,    9,   13,   12,   10,    7,    5,    3,    1,    3
+};
+
+const uint8_t HUFFMAN_LENGTHS_16[256] = {
+     1,  4,  6,  8,  9,  9, 10, 10, 11, 11, 11, 12, 12, 12, 13,  9,
+     3,  4,  6,  7,  8,  9,  9,  9, 10, 10, 10, 11, 12, 11, 12,  8,
+     6,  6,  7,  8,  9,  9, 10, 10, 11, 10, 11, 11, 11, 12, 12,  9,
+     8,  7,  8,  9,  9, 10, 10, 10, 11, 11, 12, 12, 12, 13, 13, 10,
+     9,  8,  9,  9, 10, 10, 11, 11, 11, 12, 12, 12, 13, 13, 13,  9,
+     9,  8,  9,  9, 10, 11, 11, 12, 11, 12, 12, 13, 13, 13, 14, 10,
+    10,  9,  9, 10, 11, 11, 11, 11, 12, 12, 12, 12, 13, 13, 14, 10,
+    10,  9, 10, 10, 11, 11, 11, 12, 12, 13, 13, 13, 13, 15, 15, 10,
+    10, 10, 10, 11, 11, 11, 12, 12, 13, 13, 13, 13, 14, 14, 14, 10,
+    11, 10, 10, 11, 11, 12, 12, 13, 13, 13, 13, 14, 13, 14, 13, 11,
+    11, 11, 10, 11, 12, 12, 12, 12, 13, 14, 14, 14, 15, 15, 14, 10,
+    12, 11, 11, 11, 12, 12, 13, 14, 14, 14, 14, 14, 14, 13, 14, 11,
+    12, 12, 12, 12, 12, 13, 13, 13, 13, 15, 14, 14, 14, 14, 16, 11,
+    14, 12, 12, 12, 13, 13, 14, 14, 14, 16, 15, 15, 15, 17, 15, 11,
+    13, 13, 11, 12, 14, 14, 13, 14, 14, 15, 16, 15, 17, 15, 14, 11,
+     9,  8,  8,  9,  9, 10, 10, 10, 11, 11, 11, 11, 11, 11, 11,  8
+};
+
+const uint16_t HUFFMAN_CODES_24[256] = {
+      15,   13,   46,   80,  146,  262,  248,  434,  426,  669,  653,  649,  621,  517, 1032,   88,
+      14,   12,   21,   38,   71,  130,  122,  216,  209,  198,  327,  345,  319,  297,  279,   42,
+      47,   22,   41,   74,   68,  128,  120,  221,  207,  194,  182,  340,  315,  295,  541,   18,
+      81,   39,   75,   70,  134,  125,  116,  220,  204,  190,  178,  325,  311,  293,  271,   16,
+     147,   72,   69,  135,  127,  118,  112,  210,  200,  188,  352,  323,  306,  285,  540,   14,
+     263,   66,  129,  126,  119,  114,  214,  202,  192,  180,  341,  317,  301,  281,  262,   12,
+     249,  123,  121,  117,  113,  215,  206,  195,  185,  347,  330,  308,  291,  272,  520,   10,
+     435,  115,  111,  109,  211,  203,  196,  187,  353,  332,  313,  298,  283,  531,  381,   17,
+     427,  212,  208,  205,  201,  193,  186,  177,  169,  320,  303,  286,  268,  514,  377,   16,
+     335,  199,  197,  191,  189,  181,  174,  333,  321,  305,  289,  275,  521,  379,  371,   11,
+     668,  184,  183,  179,  175,  344,  331,  314,  304,  290,  277,  530,  383,  373,  366,   10,
+     652,  346,  171,  168,  164,  318,  309,  299,  287,  276,  263,  513,  375,  368,  362,    6,
+     648,  322,  316,  312,  307,  302,  292,  284,  269,  261,  512,  376,  370,  364,  359,    4,
+     620,  300,  296,  294,  288,  282,  273,  266,  515,  380,  374,  369,  365,  361,  357,    2,
+    1033,  280,  278,  274,  267,  264,  259,  382,  378,  372,  367,  363,  360,  358,  356,    0,
+      43,   20,   19,   17,   15,   13,   11,    9,    7,    6,    4,    7,    5,    3,    1,    3
+};
+
+const uint8_t HUFFMAN_LENGTHS_24[256] = {
+     4,  4,  6,  7,  8,  9,  9, 10, 10, 11, 11, 11, 11, 11, 12,  9,
+     4,  4,  5,  6,  7,  8,  8,  9,  9,  9, 10, 10, 10, 10, 10,  8,
+     6,  5,  6,  7,  7,  8,  8,  9,  9,  9,  9, 10, 10, 10, 11,  7,
+     7,  6,  7,  7,  8,  8,  8,  9,  9,  9,  9, 10, 10, 10, 10,  7,
+     8,  7,  7,  8,  8,  8,  8,  9,  9,  9, 10, 10, 10, 10, 11,  7,
+     9,  7,  8,  8,  8,  8,  9,  9,  9,  9, 10, 10, 10, 10, 10,  7,
+     9,  8,  8,  8,  8,  9,  9,  9,  9, 10, 10, 10, 10, 10, 11,  7,
+    10,  8,  8,  8,  9,  9,  9,  9, 10, 10, 10, 10, 10, 11, 11,  8,
+    10,  9,  9,  9,  9,  9,  9,  9,  9, 10, 10, 10, 10, 11, 11,  8,
+    10,  9,  9,  9,  9,  9,  9, 10, 10, 10, 10, 10, 11, 11, 11,  8,
+    11,  9,  9,  9,  9, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11,  8,
+    11, 10,  9,  9,  9, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11,  8,
+    11, 10, 10, 10, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11, 11,  8,
+    11, 10, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11, 11, 11, 11,  8,
+    12, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11, 11, 11, 11, 11,  8,
+     8,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  8,  8,  8,  8,  4
+};
+
+// Huffman codes of the quadruples of values (v, w, x, y) of count1 table A, at index
+// v * 8 + w * 4 + x * 2 + y, and their lengths in bits. Table B codes each quadruple as its 4 bits,
+// inverted.
+const uint8_t HUFFMAN_COUNT1_CODES[16]   = { 1, 5, 4, 5, 6, 5, 4, 4, 7, 3, 6, 0, 7, 2, 3, 1 };
+const uint8_t HUFFMAN_COUNT1_LENGTHS[16] = { 1, 4, 4, 5, 4, 6, 5, 6, 4, 5, 5, 6, 5, 6, 6, 6 };
+
+// Code table of each Huffman table of the big values region, and the number of values x and y
+// range over. Tables 0, 4 and 14 have no codes.
+typedef struct huffman_table_s {
+    int             size;               // x and y range from 0 to size - 1
+    const uint16_t* codes;              // codes, by pair
+    const uint8_t*  lengths;            // code lengths, by pair
+} huffman_table;
+
+const huffman_table HUFFMAN_TABLES[32] = {
+    { 0 },
+    { 2, HUFFMAN_CODES_1, HUFFMAN_LENGTHS_1 },    { 3, HUFFMAN_CODES_2, HUFFMAN_LENGTHS_2 },
+    { 3, HUFFMAN_CODES_3, HUFFMAN_LENGTHS_3 },    { 0 },
+    { 4, HUFFMAN_CODES_5, HUFFMAN_LENGTHS_5 },    { 4, HUFFMAN_CODES_6, HUFFMAN_LENGTHS_6 },
+    { 6, HUFFMAN_CODES_7, HUFFMAN_LENGTHS_7 },    { 6, HUFFMAN_CODES_8, HUFFMAN_LENGTHS_8 },
+    { 6, HUFFMAN_CODES_9, HUFFMAN_LENGTHS_9 },    { 8, HUFFMAN_CODES_10, HUFFMAN_LENGTHS_10 },
+    { 8, HUFFMAN_CODES_11, HUFFMAN_LENGTHS_11 },  { 8, HUFFMAN_CODES_12, HUFFMAN_LENGTHS_12 },
+    { 16, HUFFMAN_CODES_13, HUFFMAN_LENGTHS_13 }, { 0 },
+    { 16, HUFFMAN_CODES_15, HUFFMAN_LENGTHS_15 },
+    { 16, HUFFMAN_CODES_16, HUFFMAN_LENGTHS_16 }, { 16, HUFFMAN_CODES_16, HUFFMAN_LENGTHS_16 },
+    { 16, HUFFMAN_CODES_16, HUFFMAN_LENGTHS_16 }, { 16, HUFFMAN_CODES_16, HUFFMAN_LENGTHS_16 },
+    { 16, HUFFMAN_CODES_16, HUFFMAN_LENGTHS_16 }, { 16, HUFFMAN_CODES_16, HUFFMAN_LENGTHS_16 },
+    { 16, HUFFMAN_CODES_16, HUFFMAN_LENGTHS_16 }, { 16, HUFFMAN_CODES_16, HUFFMAN_LENGTHS_16 },
+    { 16, HUFFMAN_CODES_24, HUFFMAN_LENGTHS_24 }, { 16, HUFFMAN_CODES_24, HUFFMAN_LENGTHS_24 },
+    { 16, HUFFMAN_CODES_24, HUFFMAN_LENGTHS_24 }, { 16, HUFFMAN_CODES_24, HUFFMAN_LENGTHS_24 },
+    { 16, HUFFMAN_CODES_24, HUFFMAN_LENGTHS_24 }, { 16, HUFFMAN_CODES_24, HUFFMAN_LENGTHS_24 },
+    { 16, HUFFMAN_CODES_24, HUFFMAN_LENGTHS_24 }, { 16, HUFFMAN_CODES_24, HUFFMAN_LENGTHS_24 }
+};
+
+// Most bits a lookup table probes at once. Longer codes take a second probe, into a subtable of
+// the first probe's entry.
+#define HUFFMAN_LOOKUP_BITS 10
+
+// Total number of entries of all lookup tables, subtables included, with room to spare.
+#define HUFFMAN_LOOKUP_SIZE 12288
+
+// Lookup tables decoding the Huffman codes of the bits they're indexed by, built on first use by
+// GetHuffmanLookup. Each 16-bit entry is either:
+// - a code: bit 15 clear, its length (in bits beyond those of earlier probes) in bits 8-12, and
+//   the values it codes in bits 4-7 (x, or v w x y for count1) and 0-3 (y)
+// - a subtable: bit 15 set, the number of bits it probes in bits 11-14, and its offset from the
+//   start of the lookup table in bits 0-10
+typedef struct huffman_lookup_s {
+    uint16_t* entries;                  // entries, indexed by the next bits of the stream
+    int       bits;                     // number of bits the first probe takes
+} huffman_lookup;
+
+// Fill a lookup table, starting at entries, for count codes and the values each codes (see
+// huffman_lookup), and return its total size in entries, subtables included. With NULL entries,
+// just return the size.
+size_t BuildHuffmanLookup (uint16_t* entries, int bits, const uint16_t* codes, const uint8_t* lengths,
+        const uint8_t* values, int count) {
+    // Codes longer than bits share a subtable with the codes of the same prefix, which probes as
+    // many more bits as the longest of them needs.
+    int subBits[1 << HUFFMAN_LOOKUP_BITS] = { 0 };
+    for (int i = 0; i < count; i++) {
+        if (lengths[i] <= bits) continue;
+        int prefix = codes[i] >> (lengths[i] - bits);
+        if (lengths[i] - bits > subBits[prefix]) subBits[prefix] = lengths[i] - bits;
+    }
+    size_t size = (size_t) 1 << bits;
+    for (int prefix = 0; prefix < (1 << bits); prefix++) {
+        if (subBits[prefix] == 0) continue;
+        if (entries != NULL) entries[prefix] = 0x8000 | (subBits[prefix] << 11) | (uint16_t) size;
+        size += (size_t) 1 << subBits[prefix];
+    }
+    if (entries == NULL) return size;
+
+    // Every index starting with a code's bits holds it.
+    for (int i = 0; i < count; i++) {
+        uint16_t* table = entries;
+        int       free  = bits - lengths[i];
+        int       code  = codes[i];
+        if (lengths[i] > bits) {
+            int prefix = code >> (lengths[i] - bits);
+            table = entries + (entries[prefix] & 0x7FF);
+            free  = subBits[prefix] - (lengths[i] - bits);
+            code &= (1 << (lengths[i] - bits)) - 1;
         }
+        uint16_t entry = ((lengths[i] - ((lengths[i] > bits)? bits : 0)) << 8) | values[i];
+        for (int j = 0; j < (1 << free); j++) table[(code << free) | j] = entry;
     }
+    return size;
+}
 
-    return 0;
+// Get the lookup table of a big values Huffman table, or of count1 table A if table is 32. Tables
+// without codes get a NULL one. All are built on first use.
+huffman_lookup GetHuffmanLookup (int table) {
+    static uint16_t       entries[HUFFMAN_LOOKUP_SIZE];
+    static huffman_lookup lookups[33];
+    static bool           lookupsBuilt = false;
+    if (!lookupsBuilt) {
+        size_t used = 0;
+        for (int t = 0; t <= 32; t++) {
+            const huffman_table* ht = &HUFFMAN_TABLES[(t < 32)? t : 0];
+            if (t < 32 && ht->size == 0) continue;
+            // Tables sharing codes share lookup tables.
+            if (t > 16 && t < 32 && ht->codes == HUFFMAN_TABLES[t - 1].codes) {
+                lookups[t] = lookups[t - 1];
+                continue;
+            }
+            const uint16_t* codes   = ht->codes;
+            const uint8_t*  lengths = ht->lengths;
+            uint16_t        count1Codes[16];
+            uint8_t         values[256];
+            int             count = ht->size * ht->size, maxLength = 0;
+            if (t == 32) {
+                for (int i = 0; i < 16; i++) count1Codes[i] = HUFFMAN_COUNT1_CODES[i];
+                codes   = count1Codes;
+                lengths = HUFFMAN_COUNT1_LENGTHS;
+                count   = 16;
+            }
+            for (int i = 0; i < count; i++) {
+                values[i] = (t == 32)? i : ((i / ht->size) << 4) | (i % ht->size);
+                if (lengths[i] > maxLength) maxLength = lengths[i];
+            }
+            int bits = (maxLength < HUFFMAN_LOOKUP_BITS)? maxLength : HUFFMAN_LOOKUP_BITS;
+            if (used + BuildHuffmanLookup(NULL, bits, codes, lengths, values, count) > HUFFMAN_LOOKUP_SIZE) {
+                fprintf(stderr, "GetHuffmanLookup: HUFFMAN_LOOKUP_SIZE is too small\n");
+                exit(1);
+            }
+            lookups[t] = (huffman_lookup) { entries + used, bits };
+            used += BuildHuffmanLookup(entries + used, bits, codes, lengths, values, count);
+        }
+        lookupsBuilt = true;
+    }
+    return lookups[table];
+}
+
+// Bit reader keeping the next bits of its stream in a 64-bit cache, so that reading a
+// variable-length code takes a shift to look at it and another to skip it. The cache is refilled
+// on demand, a whole 64-bit load at a time. Like bit_reader, it reads past the end of its stream.
+typedef struct bit_cache_s {
+    uint64_t bits;                      // next bits of the stream, from the most significant one
+    int      count;                     // number of bits of bits that are valid
+    uint8_t* next;                      // next byte of the stream to load into bits
+    uint8_t* start;                     // start of the stream
+} bit_cache;
+
+// Refill a bit cache with at least 56 bits. The bytes loaded are those following the ones
+// already in the cache, of which only the whole ones are counted as loaded.
+void RefillBitCache (bit_cache* bc) {
+    bc->bits  |= ReadBE64(bc->next) >> bc->count;
+    bc->next  += (63 - bc->count) >> 3;
+    bc->count |= 56;
+}
+
+// Create a bit cache reading from the position of a bit reader.
+bit_cache CreateBitCache (bit_reader* br) {
+    bit_cache bc = { 0, 0, br->loc + (br->pos >> 3), br->loc };
+    RefillBitCache(&bc);
+    bc.bits  <<= br->pos & 7;
+    bc.count  -= br->pos & 7;
+    return bc;
+}
+
+// Get the position of the next bit a bit cache reads, in bits from the start of its stream.
+size_t BitCachePosition (bit_cache* bc) {
+    return (size_t) (bc->next - bc->start) * 8 - bc->count;
+}
+
+// Take count bits (at most 32, and at most as many as are cached) from a bit cache.
+uint32_t TakeBits (bit_cache* bc, int count) {
+    if (count == 0) return 0;
+    uint32_t value = (uint32_t) (bc->bits >> (64 - count));
+    bc->bits  <<= count;
+    bc->count  -= count;
+    return value;
+}
+
+// Decode one Huffman code from a bit cache, through a lookup table, and return its values (see
+// huffman_lookup). The cache must hold at least as many bits as the code.
+int DecodeHuffmanCode (bit_cache* bc, huffman_lookup lookup) {
+    uint16_t entry = lookup.entries[bc->bits >> (64 - lookup.bits)];
+    if (entry & 0x8000) {
+        TakeBits(bc, lookup.bits);
+        int subBits = (entry >> 11) & 0xF;
+        entry = lookup.entries[(entry & 0x7FF) + (bc->bits >> (64 - subBits))];
+    }
+    TakeBits(bc, (entry >> 8) & 0x1F);
+    return entry & 0xFF;
+}
+
+// Decode the Huffman data of one channel of a granule into its 576 quantized spectral values. br
+// must be at the start of the data, right after the granule's scale factors, and end be the
+// position its part2_3_length ends at. The big values region is split into 3 regions, each coded
+// with its own table, and the count1 region takes what's left of the bits, 4 values at a time,
+// its last quadruple being dropped if it overruns them. Returns the number of values up to the
+// last that was decoded, the rest being zero, or -1 if the big values overran end. Leaves br
+// after the last code read, which is end in valid streams; the next granule starts at end
+// whatever happens.
+int DecodeHuffman (bit_reader* br, size_t end, mpa_header* hdr, granule_info* g, int16_t values[576]) {
+    int index = GetSamplerateIndex(hdr);
+    int bigValues = (g->bigValues <= 288)? 2 * g->bigValues : 576;
+
+    // Region 1 starts after region0_count + 1 bands, and region 2 after region1_count + 1 more.
+    // Short and mixed blocks have region 1 start after the first 3 short bands (36 values, or 72
+    // for MPEG2.5 8000 Hz), the other window switching blocks after 8 long bands, and no region 2.
+    int regionEnds[3];
+    if (g->windowSwitching) {
+        regionEnds[0] = (g->blockType == 2)? 3 * SFB_SHORT_BOUNDS[index][3] : SFB_LONG_BOUNDS[index][8];
+        regionEnds[1] = 576;
+    } else {
+        int region1 = g->region0Count + 1, region2 = region1 + g->region1Count + 1;
+        regionEnds[0] = SFB_LONG_BOUNDS[index][(region1 < 22)? region1 : 22];
+        regionEnds[1] = SFB_LONG_BOUNDS[index][(region2 < 22)? region2 : 22];
+    }
+    regionEnds[2] = 576;
+
+    bit_cache bc = CreateBitCache(br);
+    int i = 0;
+    for (int region = 0; region < 3; region++) {
+        int regionEnd = (regionEnds[region] < bigValues)? regionEnds[region] : bigValues;
+        int table     = g->tableSelect[region];
+        huffman_lookup lookup  = GetHuffmanLookup(table);
+        int            linbits = HUFFMAN_LINBITS[table];
+        if (lookup.entries == NULL) {
+            for (; i < regionEnd; i++) values[i] = 0;
+            continue;
+        }
+        for (; i < regionEnd; i += 2) {
+            // A refill covers a pair: a code of up to 19 bits, and up to 2 * 13 linbits and 2 signs.
+            if (bc.count < 47) RefillBitCache(&bc);
+            int pair = DecodeHuffmanCode(&bc, lookup);
+            int x = pair >> 4, y = pair & 0xF;
+            if (x == 15 && linbits) x += TakeBits(&bc, linbits);
+            if (x && TakeBits(&bc, 1)) x = -x;
+            if (y == 15 && linbits) y += TakeBits(&bc, linbits);
+            if (y && TakeBits(&bc, 1)) y = -y;
+            values[i]     = (int16_t) x;
+            values[i + 1] = (int16_t) y;
+        }
+    }
+    if (BitCachePosition(&bc) > end) {
+        for (; i < 576; i++) values[i] = 0;
+        br->pos = BitCachePosition(&bc);
+        return -1;
+    }
+
+    // Count1 region: quadruples of values of at most 1.
+    huffman_lookup lookup = GetHuffmanLookup(32);
+    int last = i;
+    while (i + 4 <= 576 && BitCachePosition(&bc) < end) {
+        if (bc.count < 16) RefillBitCache(&bc);
+        int quad = g->count1TableSelect? 0xF ^ TakeBits(&bc, 4) : DecodeHuffmanCode(&bc, lookup);
+        for (int k = 0; k < 4; k++) {
+            int value = (quad >> (3 - k)) & 1;
+            values[i + k] = (int16_t) ((value && TakeBits(&bc, 1))? -1 : value);
+        }
+        if (BitCachePosition(&bc) > end) break;
+        i += 4;
+        last = i;
+    }
+    for (int k = last; k < 576; k++) values[k] = 0;
+    br->pos = BitCachePosition(&bc);
+    return last;
+}
+
+// Vector kernels are written once, with the compiler's vector extensions, and inlined into
+// functions for each instruction set they're dispatched between at run time: on x86-64, the
+// baseline one and AVX2 with FMA. Elsewhere, such as on ARM, where the vectors map to NEON, there's
+// just the one; without the extensions, the scalar references stand in for them.
+#ifdef __GNUC__
+#define VECTOR_KERNEL static inline __attribute__((always_inline))
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#define AVX2_DISPATCH
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+
+// Whether the processor has AVX2 and FMA, checked on first use.
+bool HasAVX2 () {
+    static int hasAVX2 = -1;
+    if (hasAVX2 < 0) {
+        __builtin_cpu_init();
+        hasAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+    return hasAVX2;
+}
+#endif
+
+#ifdef __GNUC__
+// 8 floats operated on at once, which the compiler maps to whatever vector registers there are,
+// and the same to load from and store to arrays of floats.
+typedef float   float8 __attribute__((vector_size(32)));
+typedef float   float8_array __attribute__((vector_size(32), aligned(4), may_alias));
+typedef int32_t int8x32 __attribute__((vector_size(32)));
+#endif
+
+// Subband samples, which the filterbanks pass on from one to the next, are kept in lanes, channel *
+// 32 + subband, laid out next to each other so that vector code can work on 8 subbands at once.
+#define SUBBAND_LANES 64
+
+// The Layer 3 hybrid filterbank runs an IMDCT on the 18 spectral values of each subband of each
+// channel, windows it by the block type and overlaps it with the last granule's.
+
+// Tables of the IMDCTs, built on first use. Row n of the 36 by 18 long IMDCT matrix,
+// cos(pi/72 (2n + 19)(2k + 1)), is the negative of row 17 - n for n < 9, and equal to row 53 - n
+// for n > 26, so only rows 9 to 26 are kept. Likewise, rows 3 to 8 of the 12 by 6 short one,
+// cos(pi/24 (2n + 7)(2k + 1)), make up the others.
+typedef struct imdct_tables_s {
+    float longCos[18][18];
+    float shortCos[6][6];
+    float windows[4][36];               // window of each block type, the short one for type 2
+} imdct_tables;
+
+imdct_tables* GetIMDCTTables () {
+    static imdct_tables t;
+    static bool         tablesBuilt = false;
+    if (!tablesBuilt) {
+        const double PI = 3.14159265358979323846;
+        for (int n = 0; n < 18; n++) {
+            for (int k = 0; k < 18; k++) t.longCos[n][k] = (float) cos(PI / 72 * (2 * n + 37) * (2 * k + 1));
+        }
+        for (int n = 0; n < 6; n++) {
+            for (int k = 0; k < 6; k++) t.shortCos[n][k] = (float) cos(PI / 24 * (2 * n + 13) * (2 * k + 1));
+        }
+        // Start and stop windows join a long window's halves to a short one's by flat parts.
+        for (int n = 0; n < 36; n++) {
+            float longWindow = (float) sin(PI / 36 * (n + 0.5));
+            t.windows[0][n] = longWindow;
+            t.windows[1][n] = (n < 18)? longWindow : (n < 24)? 1 :
+                              (n < 30)? (float) sin(PI / 12 * (n - 18 + 0.5)) : 0;
+            t.windows[2][n] = (n < 12)? (float) sin(PI / 12 * (n + 0.5)) : 0;
+            t.windows[3][n] = (n < 6)? 0 : (n < 12)? (float) sin(PI / 12 * (n - 6 + 0.5)) :
+                              (n < 18)? 1 : longWindow;
+        }
+        tablesBuilt = true;
+    }
+    return &t;
+}
+
+// Get the block type each lane of a granule is transformed with: that of its channel, but for
+// the long subbands of mixed blocks (see GetMixedBlockLongEnd), which use the normal long window.
+void GetIMDCTBlockTypes (mpa_header* hdr, side_info* si, int gr, uint8_t blockTypes[SUBBAND_LANES]) {
+    int longSubbands = GetMixedBlockLongEnd(hdr) / 18;
+    for (int lane = 0; lane < SUBBAND_LANES; lane++) {
+        granule_info* g = &si->gr[gr][(lane / 32 < si->channels)? lane / 32 : 0];
+        int type = g->windowSwitching? g->blockType : 0;
+        blockTypes[lane] = (type == 2 && g->mixedBlock && lane % 32 < longSubbands)? 0 : type;
+    }
+}
+
+// Run the hybrid filterbank on a granule, one lane at a time: the reference InverseMDCT is
+// checked against. xr holds the spectral values of each channel by subband, then frequency, or
+// for short blocks frequency, then window. overlap is the state carried between granules, and
+// out gets the subband samples by time slot, then lane, with the odd time slots of the odd
+// subbands negated, as the polyphase filterbank expects.
+void InverseMDCTReference (float xr[2][576], int channels, uint8_t blockTypes[SUBBAND_LANES],
+        float overlap[18][SUBBAND_LANES], float out[18][SUBBAND_LANES]) {
+    imdct_tables* t = GetIMDCTTables();
+    for (int lane = 0; lane < channels * 32; lane++) {
+        float* x = xr[lane / 32] + lane % 32 * 18;
+        float  result[36] = { 0 };
+        if (blockTypes[lane] == 2) {
+            // 3 overlapping 12-point IMDCTs, with 6 zeros at each end.
+            for (int w = 0; w < 3; w++) {
+                for (int p = 0; p < 12; p++) {
+                    int   row = (p < 3)? 2 - p : (p < 9)? p - 3 : 14 - p;
+                    float sum = 0;
+                    for (int m = 0; m < 6; m++) sum += x[w + 3 * m] * t->shortCos[row][m];
+                    result[6 * w + 6 + p] += ((p < 3)? -sum : sum) * t->windows[2][p];
+                }
+            }
+        } else {
+            for (int n = 0; n < 36; n++) {
+                int   row = (n < 9)? 8 - n : (n < 27)? n - 9 : 44 - n;
+                float sum = 0;
+                for (int k = 0; k < 18; k++) sum += x[k] * t->longCos[row][k];
+                result[n] = ((n < 9)? -sum : sum) * t->windows[blockTypes[lane]][n];
+            }
+        }
+        for (int n = 0; n < 18; n++) {
+            float sample = result[n] + overlap[n][lane];
+            overlap[n][lane] = result[n + 18];
+            out[n][lane] = (n & lane & 1)? -sample : sample;
+        }
+    }
+}
+
+#ifdef __GNUC__
+// Run the hybrid filterbank on a granule, like InverseMDCTReference, 8 lanes at a time. The
+// unique rows of the IMDCT matrices are computed once and the others derived from them, and the
+// operations are otherwise those of the reference, in the same order, so the results only differ
+// by the rounding of fused multiply-adds where the processor has them.
+VECTOR_KERNEL void InverseMDCTVector (float xr[2][576], int channels, uint8_t blockTypes[SUBBAND_LANES],
+        float overlap[18][SUBBAND_LANES], float out[18][SUBBAND_LANES]) {
+    imdct_tables* t = GetIMDCTTables();
+
+    // Transpose to frequency, then lane, so that the vectors hold a frequency of 8 subbands.
+    float in[18][SUBBAND_LANES];
+    for (int lane = 0; lane < channels * 32; lane++) {
+        float* x = xr[lane / 32] + lane % 32 * 18;
+        for (int k = 0; k < 18; k++) in[k][lane] = x[k];
+    }
+
+    for (int group = 0; group < channels * 32; group += 8) {
+        float8 x[18];
+        for (int k = 0; k < 18; k++) x[k] = *(float8_array*) &in[k][group];
+
+        // Lanes of short blocks, and of long ones, with the window of each.
+        int32_t shortLanes[8];
+        float   windows[36][8];
+        int     shortCount = 0;
+        for (int l = 0; l < 8; l++) {
+            int type = blockTypes[group + l];
+            shortLanes[l] = (type == 2)? -1 : 0;
+            shortCount += (type == 2);
+            for (int n = 0; n < 36; n++) windows[n][l] = t->windows[type][n];
+        }
+
+        float8 longResult[36], shortResult[36];
+        if (shortCount < 8) {
+            float8 y[18];
+            for (int row = 0; row < 18; row++) {
+                float8 sum = { 0 };
+                for (int k = 0; k < 18; k++) sum += x[k] * t->longCos[row][k];
+                y[row] = sum;
+            }
+            for (int n = 0; n < 36; n++) {
+                float8 value = (n < 9)? -y[8 - n] : (n < 27)? y[n - 9] : y[44 - n];
+                longResult[n] = value * *(float8_array*) windows[n];
+            }
+        }
+        if (shortCount > 0) {
+            for (int n = 0; n < 36; n++) shortResult[n] = (float8) { 0 };
+            for (int w = 0; w < 3; w++) {
+                float8 y[6];
+                for (int row = 0; row < 6; row++) {
+                    float8 sum = { 0 };
+                    for (int m = 0; m < 6; m++) sum += x[w + 3 * m] * t->shortCos[row][m];
+                    y[row] = sum;
+                }
+                for (int p = 0; p < 12; p++) {
+                    float8 value = (p < 3)? -y[2 - p] : (p < 9)? y[p - 3] : y[14 - p];
+                    shortResult[6 * w + 6 + p] += value * t->windows[2][p];
+                }
+            }
+        }
+
+        // Mixed blocks have both kinds in their first group.
+        float8* result = (shortCount == 0)? longResult : shortResult;
+        if (shortCount > 0 && shortCount < 8) {
+            int8x32 mask;
+            memcpy(&mask, shortLanes, sizeof(mask));
+            for (int n = 0; n < 36; n++) {
+                shortResult[n] = (float8) (((int8x32) shortResult[n] & mask) | ((int8x32) longResult[n] & ~mask));
+            }
+        }
+
+        // Groups start at even subbands, so the odd lanes are the odd subbands.
+        const float8 INVERSION = { 1, -1, 1, -1, 1, -1, 1, -1 };
+        for (int n = 0; n < 18; n++) {
+            float8 sample = result[n] + *(float8_array*) &overlap[n][group];
+            *(float8_array*) &overlap[n][group] = result[n + 18];
+            *(float8_array*) &out[n][group] = (n & 1)? sample * INVERSION : sample;
+        }
+    }
+}
+
+#ifdef AVX2_DISPATCH
+AVX2_TARGET void InverseMDCTAVX2 (float xr[2][576], int channels, uint8_t blockTypes[SUBBAND_LANES],
+        float overlap[18][SUBBAND_LANES], float out[18][SUBBAND_LANES]) {
+    InverseMDCTVector(xr, channels, blockTypes, overlap, out);
+}
+#endif
+#endif
+
+// Run the hybrid filterbank on a granule with the fastest kernel the processor supports.
+void InverseMDCT (float xr[2][576], int channels, uint8_t blockTypes[SUBBAND_LANES],
+        float overlap[18][SUBBAND_LANES], float out[18][SUBBAND_LANES]) {
+#if defined(AVX2_DISPATCH)
+    if (HasAVX2()) InverseMDCTAVX2(xr, channels, blockTypes, overlap, out);
+    else           InverseMDCTVector(xr, channels, blockTypes, overlap, out);
+#elif defined(__GNUC__)
+    InverseMDCTVector(xr, channels, blockTypes, overlap, out);
+#else
+    InverseMDCTReference(xr, channels, blockTypes, overlap, out);
+#endif
+}
+
+// The polyphase synthesis filterbank turns the 32 subband samples of a channel in a time slot
+// into 32 PCM samples: a DCT makes them into a vector V of 64 samples, and each PCM sample adds up
+// 16 samples of the last 16 V vectors, weighted by the 512 taps of the window D.
+#define SYNTHESIS_VECTORS 16
+
+// Synthesis window of the standard, D[0] to D[256] in units of 2^-16. D[512 - i] is -D[i], but
+// for multiples of 64, where it's D[i].
+const int32_t SYNTHESIS_WINDOW[257] = {
+    0, -1, -1, -1, -1, -1, -1, -2, -2, -2, -2, -3,
+    -3, -4, -4, -5, -5, -6, -7, -7, -8, -9, -10, -11,
+    -13, -14, -16, -17, -19, -21, -24, -26, -29, -31, -35, -38,
+    -41, -45, -49, -53, -58, -63, -68, -73, -79, -85, -91, -97,
+    -104, -111, -117, -125, -132, -139, -147, -154, -161, -169, -176, -183,
+    -190, -196, -202, -208, 213, 218, 222, 225, 227, 228, 228, 227,
+    224, 221, 215, 208, 200, 189, 177, 163, 146, 127, 106, 83,
+    57, 29, -2, -36, -72, -111, -153, -197, -244, -294, -347, -401,
+    -459, -519, -581, -645, -711, -779, -848, -919, -991, -1064, -1137, -1210,
+    -1283, -1356, -1428, -1498, -1567, -1634, -1698, -1759, -1817, -1870, -1919, -1962,
+    -2001, -2032, -2057, -2075, -2085, -2087, -2080, -2063, 2037, 2000, 1952, 1893,
+    1822, 1739, 1644, 1535, 1414, 1280, 1131, 970, 794, 605, 402, 185,
+    -45, -288, -545, -814, -1095, -1388, -1692, -2006, -2330, -2663, -3004, -3351,
+    -3705, -4063, -4425, -4788, -5153, -5517, -5879, -6237, -6589, -6935, -7271, -7597,
+    -7910, -8209, -8491, -8755, -8998, -9219, -9416, -9585, -9727, -9838, -9916, -9959,
+    -9966, -9935, -9863, -9750, -9592, -9389, -9139, -8840, -8492, -8092, -7640, -7134,
+    6574, 5959, 5288, 4561, 3776, 2935, 2037, 1082, 70, -998, -2122, -3300,
+    -4533, -5818, -7154, -8540, -9975, -11455, -12980, -14548, -16155, -17799, -19478, -21189,
+    -22929, -24694, -26482, -28289, -30112, -31947, -33791, -35640, -37489, -39336, -41176, -43006,
+    -44821, -46617, -48390, -50137, -51853, -53534, -55178, -56778, -58333, -59838, -61289, -62684,
+    -64019, -65290, -66494, -67629, -68692, -69679, -70590, -71420, -72169, -72835, -73415, -73908,
+    -74313, -74630, -74856, -74992, 75038
+};
+
+// Tables of the polyphase synthesis, built on first use.
+typedef struct synthesis_tables_s {
+    float window[512];                  // D
+    float dctScales[5][16];             // 1 / (2 cos(pi (2n + 1) / 2size)), for sizes 32 down to 2
+    float matrix[64][32];               // cos((16 + i)(2k + 1) pi / 64), V from the subband samples
+} synthesis_tables;
+
+synthesis_tables* GetSynthesisTables () {
+    static synthesis_tables t;
+    static bool             tablesBuilt = false;
+    if (!tablesBuilt) {
+        const double PI = 3.14159265358979323846;
+        for (int i = 0; i < 512; i++) {
+            int   mirrored = (i <= 256)? i : 512 - i;
+            float tap      = SYNTHESIS_WINDOW[mirrored] / 65536.0f;
+            t.window[i] = (i > 256 && i % 64)? -tap : tap;
+        }
+        for (int level = 0, size = 32; size >= 2; level++, size /= 2) {
+            for (int n = 0; n < size / 2; n++) t.dctScales[level][n] = (float) (0.5 / cos(PI * (2 * n + 1) / (2 * size)));
+        }
+        for (int i = 0; i < 64; i++) {
+            for (int k = 0; k < 32; k++) t.matrix[i][k] = (float) cos((16 + i) * (2 * k + 1) * PI / 64);
+        }
+        tablesBuilt = true;
+    }
+    return &t;
+}
+
+// State of the polyphase synthesis: the V vectors of each channel's last 16 time slots.
+typedef struct synthesis_state_s {
+    float v[2][SYNTHESIS_VECTORS][64];
+    int   newest;                       // index of the newest V vector, the next older ones following
+} synthesis_state;
+
+// Run the polyphase synthesis on slots time slots of subband samples of channels channels, as
+// the standard spells it out: the reference Synthesize is checked against. pcm gets 32 samples a
+// time slot, interleaved by channel, in the range -1 to 1.
+void SynthesizeReference (synthesis_state* s, float in[][SUBBAND_LANES], int slots, int channels, float* pcm) {
+    synthesis_tables* t = GetSynthesisTables();
+    for (int slot = 0; slot < slots; slot++) {
+        s->newest = (s->newest - 1) & (SYNTHESIS_VECTORS - 1);
+        for (int ch = 0; ch < channels; ch++) {
+            float* v = s->v[ch][s->newest];
+            for (int i = 0; i < 64; i++) {
+                float sum = 0;
+                for (int k = 0; k < 32; k++) sum += t->matrix[i][k] * in[slot][ch * 32 + k];
+                v[i] = sum;
+            }
+            // Sample j takes the first half of the even V vectors, and the second half of the odd
+            // ones, counting back from the newest.
+            for (int j = 0; j < 32; j++) {
+                float sum = 0;
+                for (int i = 0; i < 8; i++) {
+                    sum += t->window[64 * i + j]      * s->v[ch][(s->newest + 2 * i) & (SYNTHESIS_VECTORS - 1)][j];
+                    sum += t->window[64 * i + 32 + j] * s->v[ch][(s->newest + 2 * i + 1) & (SYNTHESIS_VECTORS - 1)][32 + j];
+                }
+                pcm[(slot * 32 + j) * channels + ch] = sum;
+            }
+        }
+    }
+}
+
+#ifdef __GNUC__
+// Compute the DCT-II of 32 samples, A[n] = sum of x[k] cos(n (2k + 1) pi / 64), of 8 vectors of
+// samples at once, with Lee's algorithm: a DCT is that of the sums of its input's mirrored halves
+// for the even outputs, and that of their scaled differences for the odd ones, each of which adds
+// up 2 neighbouring outputs. Splitting down to size 1 and merging back up again takes 80
+// multiplications and 209 additions, instead of 1024 multiply-adds.
+VECTOR_KERNEL void DCT32Vector (float8 x[32], synthesis_tables* t) {
+    float8 parts[32];
+    for (int level = 0, size = 32; size >= 2; level++, size /= 2) {
+        int half = size / 2;
+        for (int start = 0; start < 32; start += size) {
+            for (int n = 0; n < half; n++) {
+                float8 a = x[start + n], b = x[start + size - 1 - n];
+                parts[start + n]        = a + b;
+                parts[start + half + n] = (a - b) * t->dctScales[level][n];
+            }
+        }
+        for (int n = 0; n < 32; n++) x[n] = parts[n];
+    }
+    for (int size = 2; size <= 32; size *= 2) {
+        int half = size / 2;
+        for (int start = 0; start < 32; start += size) {
+            for (int k = 0; k < half; k++) {
+                parts[start + 2 * k]     = x[start + k];
+                parts[start + 2 * k + 1] = (k + 1 < half)? x[start + half + k] + x[start + half + k + 1] : x[start + half + k];
+            }
+        }
+        for (int n = 0; n < 32; n++) x[n] = parts[n];
+    }
+}
+
+// Run the polyphase synthesis like SynthesizeReference, with the DCTs of 8 time slots at once,
+// and the windowing of 8 PCM samples at once. The V vectors are kept whole, and the window in
+// order, so that both are read straight through rather than in strides.
+VECTOR_KERNEL void SynthesizeVector (synthesis_state* s, float in[][SUBBAND_LANES], int slots, int channels, float* pcm) {
+    synthesis_tables* t = GetSynthesisTables();
+    for (int first = 0; first < slots; first += 8) {
+        int count = (slots - first < 8)? slots - first : 8;
+        for (int ch = 0; ch < channels; ch++) {
+            // Transpose the time slots to subband, then slot, to run their DCTs side by side.
+            float columns[32][8] = { { 0 } };
+            for (int slot = 0; slot < count; slot++) {
+                for (int k = 0; k < 32; k++) columns[k][slot] = in[first + slot][ch * 32 + k];
+            }
+            float8 x[32];
+            for (int k = 0; k < 32; k++) x[k] = *(float8_array*) columns[k];
+            DCT32Vector(x, t);
+            for (int n = 0; n < 32; n++) *(float8_array*) columns[n] = x[n];
+
+            for (int slot = 0; slot < count; slot++) {
+                // V[i] is A[i + 16], where A[32] is 0, A[64 - n] is -A[n] and A[64 + n] is too.
+                int    newest = (s->newest - 1 - slot) & (SYNTHESIS_VECTORS - 1);
+                float* v      = s->v[ch][newest];
+                for (int i = 0; i < 16; i++)  v[i] = columns[i + 16][slot];
+                v[16] = 0;
+                for (int i = 17; i < 48; i++) v[i] = -columns[48 - i][slot];
+                for (int i = 48; i < 64; i++) v[i] = -columns[i - 48][slot];
+
+                float samples[32];
+                for (int j = 0; j < 32; j += 8) {
+                    float8 sum = { 0 };
+                    for (int i = 0; i < 8; i++) {
+                        sum += *(float8_array*) &t->window[64 * i + j] *
+                               *(float8_array*) &s->v[ch][(newest + 2 * i) & (SYNTHESIS_VECTORS - 1)][j];
+                        sum += *(float8_array*) &t->window[64 * i + 32 + j] *
+                               *(float8_array*) &s->v[ch][(newest + 2 * i + 1) & (SYNTHESIS_VECTORS - 1)][32 + j];
+                    }
+                    *(float8_array*) &samples[j] = sum;
+                }
+                float* out = pcm + (first + slot) * 32 * channels + ch;
+                for (int j = 0; j < 32; j++) out[j * channels] = samples[j];
+            }
+        }
+        s->newest = (s->newest - count) & (SYNTHESIS_VECTORS - 1);
+    }
+}
+
+#ifdef AVX2_DISPATCH
+AVX2_TARGET void SynthesizeAVX2 (synthesis_state* s, float in[][SUBBAND_LANES], int slots, int channels, float* pcm) {
+    SynthesizeVector(s, in, slots, channels, pcm);
+}
+#endif
+#endif
+
+// Run the polyphase synthesis with the fastest kernel the processor supports.
+void Synthesize (synthesis_state* s, float in[][SUBBAND_LANES], int slots, int channels, float* pcm) {
+#if defined(AVX2_DISPATCH)
+    if (HasAVX2()) SynthesizeAVX2(s, in, slots, channels, pcm);
+    else           SynthesizeVector(s, in, slots, channels, pcm);
+#elif defined(__GNUC__)
+    SynthesizeVector(s, in, slots, channels, pcm);
+#else
+    SynthesizeReference(s, in, slots, channels, pcm);
+#endif
+}
+
+// Convert count float PCM samples to 16-bit ones, rounding them and clipping them to the range.
+void ConvertToInt16 (float* in, size_t count, int16_t* out) {
+    for (size_t i = 0; i < count; i++) {
+        float sample = in[i] * 32768.0f;
+        sample = (sample > 32767.0f)? 32767.0f : (sample < -32768.0f)? -32768.0f : sample;
+        out[i] = (int16_t) lrintf(sample);
+    }
+}
+
+// Scale factor band of one channel of a Layer 3 granule, in the order its values are coded in:
+// long block bands by frequency, short block ones by band, then window.
+typedef struct layer3_band_s {
+    uint16_t start;                     // first value of the band
+    uint16_t end;                       // value after its last
+    uint8_t  sfb;                       // scale factor band
+    int8_t   window;                    // short block window, or -1 for long block bands
+} layer3_band;
+
+// Get the scale factor bands of one channel of a granule, in the order they're coded in. Mixed
+// blocks have long block bands over their first values (see GetMixedBlockLongEnd), then short
+// block bands from the third on. Returns how many there are.
+int GetLayer3Bands (mpa_header* hdr, granule_info* g, layer3_band bands[39]) {
+    int  index = GetSamplerateIndex(hdr);
+    bool shortBlock = g->windowSwitching && g->blockType == 2;
+    int  count = 0, firstShort = 0;
+    if (!shortBlock || g->mixedBlock) {
+        int longEnd = GetMixedBlockLongEnd(hdr);
+        for (int sfb = 0; sfb < 22; sfb++) {
+            int start = SFB_LONG_BOUNDS[index][sfb];
+            if (shortBlock && start >= longEnd) break;
+            bands[count++] = (layer3_band) { start, SFB_LONG_BOUNDS[index][sfb + 1], sfb, -1 };
+        }
+        firstShort = 3;
+    }
+    if (shortBlock) {
+        for (int sfb = firstShort; sfb < 13; sfb++) {
+            int start = 3 * SFB_SHORT_BOUNDS[index][sfb];
+            int width = SFB_SHORT_BOUNDS[index][sfb + 1] - SFB_SHORT_BOUNDS[index][sfb];
+            for (int w = 0; w < 3; w++) {
+                bands[count++] = (layer3_band) { start + w * width, start + (w + 1) * width, sfb, w };
+            }
+        }
+    }
+    return count;
+}
+
+// Largest magnitude Huffman decoding gives: 15 plus 13 linbits.
+#define LAYER3_MAX_VALUE 8206
+
+// Requantize the Huffman decoded values of one channel of a granule into spectral values, in the
+// order they're coded in. Each is sign(value) |value|^(4/3) times 2 to the power of a quarter of
+// the global gain less 210, less 8 times the window's subblock gain for short block bands, less
+// 2 times the band's scale factor (plus its pretab boost with preflag set), 4 times with
+// scalefac_scale set. Only the first count values may be non-zero.
+void RequantizeLayer3 (mpa_header* hdr, granule_info* g, scalefactors* sf, int16_t values[576],
+        int count, float xr[576]) {
+    static float powers[LAYER3_MAX_VALUE + 1];
+    static bool  powersBuilt = false;
+    if (!powersBuilt) {
+        for (int i = 0; i <= LAYER3_MAX_VALUE; i++) powers[i] = (float) pow(i, 4.0 / 3.0);
+        powersBuilt = true;
+    }
+    const float QUARTER_POWERS[4] = { 1.0f, 1.189207115f, 1.414213562f, 1.681792831f };
+
+    layer3_band bands[39];
+    int bandCount = GetLayer3Bands(hdr, g, bands);
+    int shift     = g->scalefacScale? 4 : 2;
+    memset(xr, 0, 576 * sizeof(float));
+    for (int b = 0; b < bandCount && bands[b].start < count; b++) {
+        layer3_band* band = &bands[b];
+        int exponent = g->globalGain - 210;
+        if (band->window < 0) {
+            exponent -= shift * (sf->l[band->sfb] + (g->preflag? SFB_PRETAB[band->sfb] : 0));
+        } else {
+            exponent -= 8 * g->subblockGain[band->window] + shift * sf->s[band->sfb][band->window];
+        }
+        float scale = ldexpf(QUARTER_POWERS[exponent & 3], (exponent - (exponent & 3)) / 4);
+        int   end   = (band->end < count)? band->end : count;
+        for (int i = band->start; i < end; i++) {
+            xr[i] = (values[i] < 0)? -powers[-values[i]] * scale : powers[values[i]] * scale;
+        }
+    }
+}
+
+// Share of the left channel in MPEG1 intensity stereo, tan(pos pi / 12) / (1 + tan(pos pi / 12)),
+// by position; the right channel gets the rest. Position 7 stands for no intensity stereo, and so
+// do those above, which 4-bit scale factors can hold but which have no share.
+const float INTENSITY_RATIOS[7] = {
+    0.0f, 0.211324865f, 0.366025404f, 0.5f, 0.633974596f, 0.788675135f, 1.0f
+};
+
+// Apply the stereo coding of a joint stereo granule to the requantized values of both channels,
+// as the header's mode extension enables it. Intensity stereo codes the bands above the highest
+// non-zero one of the right channel (of each window, for short blocks) as the left channel alone,
+// the right channel's scale factors giving the position of the sound between the two. MS stereo
+// codes the other bands, if enabled, as the sum and difference of the channels over sqrt(2).
+// counts holds the values of each channel that may be non-zero, and gets what they are after.
+void ProcessLayer3Stereo (mpa_header* hdr, side_info* si, int gr, scalefactors* sf, float xr[2][576], int counts[2]) {
+    const float SQRT_HALF = 0.707106781f;
+    float* left  = xr[0];
+    float* right = xr[1];
+    int    count = (counts[0] > counts[1])? counts[0] : counts[1];
+    counts[0] = counts[1] = count;
+    if (!hdr->cmLayer3IntensityStereo) {
+        if (!hdr->cmLayer3MSStereo) return;
+        for (int i = 0; i < count; i++) {
+            float mid = left[i], side = right[i];
+            left[i]  = (mid + side) * SQRT_HALF;
+            right[i] = (mid - side) * SQRT_HALF;
+        }
+        return;
+    }
+
+    // Find the last band of the right channel with non-zero values, among the long block bands
+    // and those of each short block window. The long bands of mixed blocks only take intensity
+    // stereo if the short ones are all zero.
+    granule_info* g = &si->gr[gr][1];
+    layer3_band   bands[39];
+    int bandCount = GetLayer3Bands(hdr, g, bands);
+    int lastNonZero[4] = { -1, -1, -1, -1 };
+    for (int b = 0; b < bandCount && bands[b].start < count; b++) {
+        for (int i = bands[b].start; i < bands[b].end; i++) {
+            if (right[i] != 0) {
+                lastNonZero[bands[b].window + 1] = b;
+                break;
+            }
+        }
+    }
+    bool shortNonZero = lastNonZero[1] >= 0 || lastNonZero[2] >= 0 || lastNonZero[3] >= 0;
+
+    // MPEG2/2.5 positions scale one channel by a power of 2^-1/4, or of 2^-1/2 where the right
+    // channel's scalefac_compress is odd. The last band, which has no scale factor, takes the
+    // position of the one before.
+    bool  mpeg1 = hdr->mpegVersion == MPEG_V1;
+    float lsfRatio = (g->scalefacCompress & 1)? SQRT_HALF : 0.840896415f;
+    for (int b = 0; b < bandCount; b++) {
+        layer3_band* band = &bands[b];
+        int  pos, bits;
+        bool intensity;
+        if (band->window < 0) {
+            int sfb = (band->sfb == 21)? 20 : band->sfb;
+            pos  = sf[1].l[sfb];
+            bits = sf[1].lBits[sfb];
+            intensity = b > lastNonZero[0] && !shortNonZero;
+        } else {
+            int sfb = (band->sfb == 12)? 11 : band->sfb;
+            pos  = sf[1].s[sfb][band->window];
+            bits = sf[1].sBits[sfb];
+            intensity = b > lastNonZero[band->window + 1];
+        }
+        if (intensity && (mpeg1? pos < 7 : pos != (1 << bits) - 1)) {
+            float leftScale = 1, rightScale = 1;
+            if (mpeg1) {
+                leftScale  = INTENSITY_RATIOS[pos];
+                rightScale = 1 - leftScale;
+            } else if (pos & 1) {
+                leftScale  = powf(lsfRatio, (pos + 1) / 2);
+            } else {
+                rightScale = powf(lsfRatio, pos / 2);
+            }
+            for (int i = band->start; i < band->end; i++) {
+                right[i] = left[i] * rightScale;
+                left[i] *= leftScale;
+            }
+        } else if (hdr->cmLayer3MSStereo) {
+            for (int i = band->start; i < band->end; i++) {
+                float mid = left[i], side = right[i];
+                left[i]  = (mid + side) * SQRT_HALF;
+                right[i] = (mid - side) * SQRT_HALF;
+            }
+        }
+    }
+    counts[0] = counts[1] = 576;
+}
+
+// Reorder the short block bands of one channel of a granule, which are coded by band, window,
+// then frequency, to the order the hybrid filterbank takes them in: by subband, frequency, then
+// window.
+void ReorderLayer3 (mpa_header* hdr, granule_info* g, float xr[576]) {
+    if (!g->windowSwitching || g->blockType != 2) return;
+    layer3_band bands[39];
+    int   bandCount = GetLayer3Bands(hdr, g, bands);
+    float band[3 * 64];
+    for (int b = 0; b < bandCount; b++) {
+        if (bands[b].window != 0) continue;
+        int start = bands[b].start, width = bands[b].end - start;
+        memcpy(band, xr + start, 3 * width * sizeof(float));
+        for (int w = 0; w < 3; w++) {
+            for (int j = 0; j < width; j++) xr[start + 3 * j + w] = band[w * width + j];
+        }
+    }
+}
+
+// Butterfly coefficients of the antialiasing between subbands, 1 / sqrt(1 + c^2) and c / sqrt(1 +
+// c^2) for the standard's c.
+const float ANTIALIAS_CS[8] = {
+    0.857492926f, 0.881741997f, 0.949628649f, 0.983314592f, 0.995517816f, 0.999160558f, 0.999899195f, 0.999993155f
+};
+const float ANTIALIAS_CA[8] = {
+    -0.514495755f, -0.471731969f, -0.313377454f, -0.181913200f, -0.094574193f, -0.040965583f, -0.014198569f, -0.003699975f
+};
+
+// Undo the aliasing the encoder's analysis filterbank leaves between neighbouring subbands of the
+// long blocks of one channel of a granule, only the first count values of which may be non-zero.
+// Short blocks have none, and mixed blocks have it between their long subbands only.
+void AntialiasLayer3 (mpa_header* hdr, granule_info* g, float xr[576], int count) {
+    bool shortBlock = g->windowSwitching && g->blockType == 2;
+    int  subbands   = shortBlock? (g->mixedBlock? GetMixedBlockLongEnd(hdr) / 18 : 0) : 32;
+    for (int sb = 1; sb < subbands && 18 * sb - 8 < count; sb++) {
+        for (int i = 0; i < 8; i++) {
+            float lower = xr[18 * sb - 1 - i], upper = xr[18 * sb + i];
+            xr[18 * sb - 1 - i] = lower * ANTIALIAS_CS[i] - upper * ANTIALIAS_CA[i];
+            xr[18 * sb + i]     = upper * ANTIALIAS_CS[i] + lower * ANTIALIAS_CA[i];
+        }
+    }
+}
+
+// State of an MPEG audio decoder, which decodes the frames of a stream in order. A zeroed one
+// starts a stream. Layer 1 and 2 frames stand alone, so only its synthesis state carries over
+// between them.
+typedef struct mpa_decoder_s {
+    main_data       md;
+    scalefactors    sf[2];              // scale factors of the last granule, which MPEG1 granules reuse
+    float           overlap[18][SUBBAND_LANES];
+    synthesis_state synthesis;
+} mpa_decoder;
+
+// Largest number of samples a frame decodes to, over all channels.
+#define MAX_FRAME_SAMPLES (1152 * 2)
+
+// Decode the Layer 3 frame hdr, which follows the last one d decoded. Each of its granules decodes
+// to 576 samples of each channel, which go to pcm interleaved. Frames whose main data isn't there,
+// as after seeking, decode to silence. Returns the samples of each channel, or 0 if the frame's
+// side information is broken.
+int DecodeLayer3Frame (mpa_decoder* d, mpa_header* hdr, float* pcm) {
+    side_info si = ReadSideInfo(hdr);
+    if (!si.valid) return 0;
+    bit_reader br;
+    bool    loaded = LoadMainData(&d->md, hdr, &si, &br);
+    bool    jointStereo = si.channels == 2 && hdr->channelMode == CHANNEL_MODE_JOINT_STEREO;
+    float   xr[2][576], subbands[18][SUBBAND_LANES];
+    int16_t values[576];
+    uint8_t blockTypes[SUBBAND_LANES];
+    for (int gr = 0; gr < si.granules; gr++) {
+        int counts[2] = { 0, 0 };
+        for (int ch = 0; ch < si.channels; ch++) {
+            granule_info* g = &si.gr[gr][ch];
+            if (!loaded) {
+                memset(xr[ch], 0, sizeof(xr[ch]));
+                continue;
+            }
+            size_t part23End = br.pos + g->part23Length;
+            ReadScalefactors(&br, hdr, &si, gr, ch, &d->sf[ch]);
+            int count = DecodeHuffman(&br, part23End, hdr, g, values);
+            br.pos = part23End;
+            counts[ch] = (count < 0)? 576 : count;
+            RequantizeLayer3(hdr, g, &d->sf[ch], values, counts[ch], xr[ch]);
+        }
+        if (loaded && jointStereo) ProcessLayer3Stereo(hdr, &si, gr, d->sf, xr, counts);
+        for (int ch = 0; ch < si.channels && loaded; ch++) {
+            ReorderLayer3(hdr, &si.gr[gr][ch], xr[ch]);
+            AntialiasLayer3(hdr, &si.gr[gr][ch], xr[ch], counts[ch]);
+        }
+        GetIMDCTBlockTypes(hdr, &si, gr, blockTypes);
+        InverseMDCT(xr, si.channels, blockTypes, d->overlap, subbands);
+        Synthesize(&d->synthesis, subbands, 18, si.channels, pcm + gr * 576 * si.channels);
+    }
+    return si.granules * 576;
+}
+
+// Scale factors of Layer 1 and 2 subbands are 2^(1 - index / 3): the powers of 2^(-1/3).
+const float THIRD_POWERS[3] = { 1.0f, 0.793700526f, 0.629960525f };
+
+// Quantizers of Layer 1 and 2 subband samples, by code. Codes 1 to 16 code each sample in that
+// many bits, with 2^code - 1 levels. Codes 17 to 19 code 3 samples at once, in a group of
+// LAYER12_GROUP_BITS bits, with LAYER12_GROUP_LEVELS levels each.
+const uint16_t LAYER12_GROUP_LEVELS[3] = { 3, 5, 9 };
+const uint8_t  LAYER12_GROUP_BITS[3]   = { 5, 7, 10 };
+
+// Quantizer codes of the allocations of Layer 2 subbands, one row for each kind of subband.
+const uint8_t LAYER2_QUANTIZERS[6][16] = {
+    { 0, 17,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 16 },
+    { 0, 17, 18,  3, 19,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 16 },
+    { 0, 17, 18,  3, 19,  4,  5, 16 },
+    { 0, 17, 18, 16 },
+    { 0, 17, 18, 19,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 0, 17, 18,  3, 19,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14 },
+};
+
+// Run of Layer 2 subbands whose allocations take the same number of bits and code quantizers from
+// the same row of LAYER2_QUANTIZERS.
+typedef struct layer2_run_s {
+    uint8_t subbands;                   // subbands in the run, 0 ending a table
+    uint8_t row;                        // row of LAYER2_QUANTIZERS
+    uint8_t bits;                       // bits of each allocation
+} layer2_run;
+
+// Bit allocation tables of Layer 2, which end at the highest subband they code: tables B.2a to
+// B.2d of ISO 11172-3, then table B.1 of ISO 13818-3 for the lower sample rates.
+const layer2_run LAYER2_ALLOCATIONS[5][5] = {
+    { { 3, 0, 4 }, { 8, 1, 4 }, { 12, 2, 3 }, { 4, 3, 2 } },
+    { { 3, 0, 4 }, { 8, 1, 4 }, { 12, 2, 3 }, { 7, 3, 2 } },
+    { { 2, 4, 4 }, { 6, 4, 3 } },
+    { { 2, 4, 4 }, { 10, 4, 3 } },
+    { { 4, 5, 4 }, { 7, 4, 3 }, { 19, 4, 2 } },
+};
+
+// Get the bit allocation table of a Layer 2 frame, which depends on its sample rate and bitrate
+// per channel.
+const layer2_run* GetLayer2Allocation (mpa_header* hdr) {
+    if (hdr->mpegVersion != MPEG_V1) return LAYER2_ALLOCATIONS[4];
+    int bitrate = (hdr->channelMode == CHANNEL_MODE_MONO)? hdr->bitrate : hdr->bitrate / 2;
+    if (bitrate < 56)                                 return LAYER2_ALLOCATIONS[(hdr->samplerate == 32000)? 3 : 2];
+    if (bitrate >= 96 && hdr->samplerate != 48000)    return LAYER2_ALLOCATIONS[1];
+    return LAYER2_ALLOCATIONS[0];
+}
+
+// Size in bytes of the largest Layer 1 or 2 frame, 384 kbps at 32 kHz.
+#define LAYER12_MAX_FRAME_SIZE 1729
+
+// Copy the audio data of a Layer 1 or 2 frame, after its header and CRC, to data, followed by
+// MAIN_DATA_PADDING zeros for ReadBits to read past its end, and create a bit reader over it.
+// Returns false if the frame is too small or too big.
+bool LoadLayer12Frame (mpa_header* hdr, uint8_t data[LAYER12_MAX_FRAME_SIZE + MAIN_DATA_PADDING], bit_reader* br) {
+    size_t start = hdr->crcEnabled? 6 : 4;
+    if (hdr->frameSize <= start || hdr->frameSize > LAYER12_MAX_FRAME_SIZE) return false;
+    memcpy(data, hdr->location + start, hdr->frameSize - start);
+    memset(data + hdr->frameSize - start, 0, MAIN_DATA_PADDING);
+    *br = CreateBitReader(data, hdr->frameSize - start);
+    return true;
+}
+
+// Read the 3 samples of a Layer 2 subband coded with the given quantizer (see LAYER2_QUANTIZERS),
+// dequantized to fractions of their scale factor, into samples.
+void ReadLayer2Samples (bit_reader* br, int quantizer, float samples[3]) {
+    int levels;
+    int values[3];
+    if (quantizer >= 17) {
+        levels = LAYER12_GROUP_LEVELS[quantizer - 17];
+        uint32_t group = ReadBits(br, LAYER12_GROUP_BITS[quantizer - 17]);
+        for (int i = 0; i < 3; i++) {
+            values[i] = group % levels;
+            group    /= levels;
+        }
+    } else {
+        levels = (1 << quantizer) - 1;
+        for (int i = 0; i < 3; i++) values[i] = ReadBits(br, quantizer);
+    }
+    for (int i = 0; i < 3; i++) samples[i] = (float) (2 * values[i] + 1 - levels) / levels;
+}
+
+// Decode the Layer 2 frame hdr, which follows the last one d decoded, to 1152 samples of each
+// channel, which go to pcm interleaved. The subbands from the joint stereo bound up share their
+// samples between channels, each scaling them by its own scale factors. Returns the samples of
+// each channel, or 0 if the frame is broken.
+int DecodeLayer2Frame (mpa_decoder* d, mpa_header* hdr, float* pcm) {
+    uint8_t    data[LAYER12_MAX_FRAME_SIZE + MAIN_DATA_PADDING];
+    bit_reader br;
+    if (!LoadLayer12Frame(hdr, data, &br)) return 0;
+    int channels = (hdr->channelMode == CHANNEL_MODE_MONO)? 1 : 2;
+    int bound    = (channels == 2 && hdr->channelMode == CHANNEL_MODE_JOINT_STEREO)? hdr->cmLayer2BandLower : 32;
+
+    // Quantizers, from the bit allocation, up to the highest subband the table codes.
+    uint8_t quantizers[2][32] = { { 0 } };
+    int     subbands = 0;
+    for (const layer2_run* run = GetLayer2Allocation(hdr); run->subbands > 0; run++) {
+        for (int i = 0; i < run->subbands; i++, subbands++) {
+            for (int ch = 0; ch < channels; ch++) {
+                if (ch == 1 && subbands >= bound) quantizers[1][subbands] = quantizers[0][subbands];
+                else quantizers[ch][subbands] = LAYER2_QUANTIZERS[run->row][ReadBits(&br, run->bits)];
+            }
+        }
+    }
+
+    // Scale factors of each third of the frame, which the scale factor selection information says
+    // how many of are coded: 3, or 2 or 1 shared between thirds.
+    uint8_t scfsi[2][32];
+    float   scales[2][32][3];
+    for (int sb = 0; sb < subbands; sb++) {
+        for (int ch = 0; ch < channels; ch++) {
+            if (quantizers[ch][sb] != 0) scfsi[ch][sb] = ReadBits(&br, 2);
+        }
+    }
+    for (int sb = 0; sb < subbands; sb++) {
+        for (int ch = 0; ch < channels; ch++) {
+            if (quantizers[ch][sb] == 0) continue;
+            int index[3];
+            index[0] = ReadBits(&br, 6);
+            switch (scfsi[ch][sb]) {
+            case 0: index[1] = ReadBits(&br, 6); index[2] = ReadBits(&br, 6); break;
+            case 1: index[1] = index[0];         index[2] = ReadBits(&br, 6); break;
+            case 2: index[1] = index[0];         index[2] = index[0];         break;
+            case 3: index[1] = ReadBits(&br, 6); index[2] = index[1];         break;
+            }
+            for (int part = 0; part < 3; part++) {
+                scales[ch][sb][part] = ldexpf(THIRD_POWERS[index[part] % 3], 1 - index[part] / 3);
+            }
+        }
+    }
+
+    // Samples, in 12 granules of 3 time slots, each third of the frame taking 4 granules.
+    float subbandSamples[36][SUBBAND_LANES] = { { 0 } };
+    for (int gr = 0; gr < 12; gr++) {
+        for (int sb = 0; sb < subbands; sb++) {
+            float samples[3];
+            for (int ch = 0; ch < channels; ch++) {
+                if (quantizers[ch][sb] == 0) continue;
+                if (ch == 0 || sb < bound) ReadLayer2Samples(&br, quantizers[ch][sb], samples);
+                for (int i = 0; i < 3; i++) {
+                    subbandSamples[3 * gr + i][32 * ch + sb] = samples[i] * scales[ch][sb][gr / 4];
+                }
+            }
+        }
+    }
+    if (br.pos > br.end) return 0;
+
+    Synthesize(&d->synthesis, subbandSamples, 36, channels, pcm);
+    return 1152;
+}
+
+// Decode the Layer 1 frame hdr, which follows the last one d decoded, to 384 samples of each
+// channel, which go to pcm interleaved. Each subband has 12 samples, which make one time slot
+// each, and which share their bit allocation and scale factor. The subbands from the joint stereo
+// bound up share their samples between channels, like in Layer 2. Returns the samples of each
+// channel, or 0 if the frame is broken.
+int DecodeLayer1Frame (mpa_decoder* d, mpa_header* hdr, float* pcm) {
+    uint8_t    data[LAYER12_MAX_FRAME_SIZE + MAIN_DATA_PADDING];
+    bit_reader br;
+    if (!LoadLayer12Frame(hdr, data, &br)) return 0;
+    int channels = (hdr->channelMode == CHANNEL_MODE_MONO)? 1 : 2;
+    int bound    = (channels == 2 && hdr->channelMode == CHANNEL_MODE_JOINT_STEREO)? hdr->cmLayer2BandLower : 32;
+
+    // Bits of each sample, from the bit allocation: an allocation of n > 0 codes samples in n + 1
+    // bits, and 15 is forbidden.
+    uint8_t bits[2][32] = { { 0 } };
+    for (int sb = 0; sb < 32; sb++) {
+        for (int ch = 0; ch < channels; ch++) {
+            if (ch == 1 && sb >= bound) {
+                bits[1][sb] = bits[0][sb];
+                continue;
+            }
+            uint32_t allocation = ReadBits(&br, 4);
+            if (allocation == 15) return 0;
+            bits[ch][sb] = (allocation == 0)? 0 : allocation + 1;
+        }
+    }
+    float scales[2][32];
+    for (int sb = 0; sb < 32; sb++) {
+        for (int ch = 0; ch < channels; ch++) {
+            if (bits[ch][sb] == 0) continue;
+            int index = ReadBits(&br, 6);
+            scales[ch][sb] = ldexpf(THIRD_POWERS[index % 3], 1 - index / 3);
+        }
+    }
+
+    float subbandSamples[12][SUBBAND_LANES] = { { 0 } };
+    for (int slot = 0; slot < 12; slot++) {
+        for (int sb = 0; sb < 32; sb++) {
+            float sample = 0.0f;
+            for (int ch = 0; ch < channels; ch++) {
+                if (bits[ch][sb] == 0) continue;
+                if (ch == 0 || sb < bound) {
+                    int levels = (1 << bits[ch][sb]) - 1;
+                    sample = (float) (2 * (int) ReadBits(&br, bits[ch][sb]) + 1 - levels) / levels;
+                }
+                subbandSamples[slot][32 * ch + sb] = sample * scales[ch][sb];
+            }
+        }
+    }
+    if (br.pos > br.end) return 0;
+
+    Synthesize(&d->synthesis, subbandSamples, 12, channels, pcm);
+    return 384;
+}
+
+// Decode the frame hdr of a stream of any layer (see DecodeLayer1Frame, DecodeLayer2Frame and
+// DecodeLayer3Frame). Returns the samples of each channel, or 0 if the frame is broken.
+int DecodeFrame (mpa_decoder* d, mpa_header* hdr, float* pcm) {
+    if (hdr->mpegLayer == 3) return DecodeLayer3Frame(d, hdr, pcm);
+    if (hdr->mpegLayer == 2) return DecodeLayer2Frame(d, hdr, pcm);
+    if (hdr->mpegLayer == 1) return DecodeLayer1Frame(d, hdr, pcm);
+    return 0;
+}
+
+// Compute the CRC-16 used by the LAME tag (polynomial 0x8005, bit-reversed) over size bytes at
+// loc, continuing from the given crc value. Start with a crc of 0. The music CRC covers whole
+// files, so this goes 8 bytes at a time ("slicing by 8"), through tables built on first use:
+// tables[k][b] is the CRC of byte b followed by k zero bytes.
+uint16_t CRC16LAME (uint8_t* loc, size_t size, uint16_t crc) {
+    static uint16_t tables[8][256];
+    static bool     tablesBuilt = false;
+    if (!tablesBuilt) {
+        for (int i = 0; i < 256; i++) {
+            uint16_t entry = i;
+            for (int bit = 0; bit < 8; bit++) entry = (entry & 1)? (entry >> 1) ^ 0xA001 : (entry >> 1);
+            tables[0][i] = entry;
+        }
+        for (int k = 1; k < 8; k++) {
+            for (int i = 0; i < 256; i++) {
+                tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 0xFF];
+            }
+        }
+        tablesBuilt = true;
+    }
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint8_t* b = loc + i;
+        crc ^= b[0] | (b[1] << 8);
+        crc = tables[7][crc & 0xFF] ^ tables[6][crc >> 8] ^ tables[5][b[2]] ^ tables[4][b[3]] ^
+              tables[3][b[4]] ^ tables[2][b[5]] ^ tables[1][b[6]] ^ tables[0][b[7]];
+    }
+    for (; i < size; i++) crc = (crc >> 8) ^ tables[0][(crc ^ loc[i]) & 0xFF];
+    return crc;
+}
+
+// Compute the CRC-16 protecting MPEG audio frames (polynomial 0x8005, not bit-reversed) over size
+// bytes at loc, continuing from the given crc value. Start with a crc of 0xFFFF.
+uint16_t CRC16MPA (uint8_t* loc, size_t size, uint16_t crc) {
+    for (size_t i = 0; i < size; i++) {
+        crc ^= loc[i] << 8;
+        for (int bit = 0; bit < 8; bit++) crc = (crc & 0x8000)? (crc << 1) ^ 0x8005 : (crc << 1);
+    }
+    return crc;
+}
+
+// Compute the CRC of a Layer 3 frame, which covers the last 2 bytes of its header and its side
+// information. Frames with crcEnabled store it right after their header.
+uint16_t GetLayer3FrameCRC (mpa_header* hdr) {
+    uint16_t crc = CRC16MPA(hdr->location + 2, 2, 0xFFFF);
+    return CRC16MPA(hdr->location + 6, GetSideInfoSize(hdr), crc);
+}
+
+// Try to read a Xing/Info header from the given frame, which must lie entirely in memory.
+// Returns INVALID_XING_HEADER if the frame doesn't contain one.
+xing_header ReadXingHeader (mpa_header* hdr) {
+    // The Xing header sits right where the audio data would start, after the side information.
+    size_t offset = 4 + (hdr->crcEnabled? 2 : 0) + GetSideInfoSize(hdr);
+    if (hdr->mpegLayer != 3 || offset + 8 > hdr->frameSize) return INVALID_XING_HEADER;
+
+    uint8_t* loc = hdr->location + offset;
+    xing_header xing = { 0 };
+    if      (loc[0] == 'X' && loc[1] == 'i' && loc[2] == 'n' && loc[3] == 'g') xing.isInfo = false;
+    else if (loc[0] == 'I' && loc[1] == 'n' && loc[2] == 'f' && loc[3] == 'o') xing.isInfo = true;
+    else    return INVALID_XING_HEADER;
+
+    xing.location = loc;
+    xing.flags    = ReadBE32(loc + 4);
+
+    // Each field is only present if its flag is set, so keep track of where the next one is.
+    size_t size = 8;
+    size_t fieldsSize = ((xing.flags & XING_FLAG_FRAMES)?  4   : 0) +
+                        ((xing.flags & XING_FLAG_BYTES)?   4   : 0) +
+                        ((xing.flags & XING_FLAG_TOC)?     100 : 0) +
+                        ((xing.flags & XING_FLAG_QUALITY)? 4   : 0);
+    if (offset + size + fieldsSize > hdr->frameSize) return INVALID_XING_HEADER;
+
+    if (xing.flags & XING_FLAG_FRAMES) {
+        xing.frameCount = ReadBE32(loc + size);
+        size += 4;
+    }
+    if (xing.flags & XING_FLAG_BYTES) {
+        xing.byteCount = ReadBE32(loc + size);
+        size += 4;
+    }
+    if (xing.flags & XING_FLAG_TOC) {
+        for (int i = 0; i < 100; i++) xing.toc[i] = loc[size + i];
+        size += 100;
+    }
+    if (xing.flags & XING_FLAG_QUALITY) {
+        xing.quality = ReadBE32(loc + size);
+        size += 4;
+    }
+
+    xing.size  = size;
+    xing.valid = true;
+    return xing;
+}
+
+// Decode one of the LAME tag's 16-bit ReplayGain fields:
+// - 3-bit name code (0 not set, 1 radio, 2 audiophile)
+// - 3-bit originator code (0 not set)
+// - 1-bit sign (1 means negative)
+// - 9-bit absolute gain adjustment, in units of 0.1 dB
+// Returns whether the field is set and stores the adjustment in dB into gain.
+bool ReadLAMEReplayGain (uint8_t* loc, float* gain) {
+    uint16_t field      = (loc[0] << 8) | loc[1];
+    uint8_t  nameCode   = (field >> 13) & 0b111;
+    uint8_t  originator = (field >> 10) & 0b111;
+    int      value      = field & 0b111111111;
+    if (field & 0b1000000000) value = -value;
+
+    *gain = value / 10.0f;
+    return nameCode != 0 && originator != 0;
+}
+
+// Try to read the LAME extension following the given Xing/Info header. frameHdr must be the header
+// of the frame containing it. Returns INVALID_LAME_TAG if no LAME tag is present.
+lame_tag ReadLAMETag (mpa_header* frameHdr, xing_header* xing) {
+    if (!xing->valid) return INVALID_LAME_TAG;
+
+    uint8_t* loc = xing->location + xing->size;
+    if (loc + LAME_TAG_SIZE > frameHdr->location + frameHdr->frameSize) return INVALID_LAME_TAG;
+
+    lame_tag tag = { 0 };
+    tag.location    = loc;
+    tag.tagCRC      = (loc[34] << 8) | loc[35];
+    tag.tagCRCValid = CRC16LAME(frameHdr->location, loc + 34 - frameHdr->location, 0) == tag.tagCRC;
+
+    // The tag has no magic number of its own, so require either a matching CRC or the name of an
+    // encoder known to write it.
+    bool knownEncoder = (loc[0] == 'L' && loc[1] == 'A' && loc[2] == 'M' && loc[3] == 'E') ||
+                        (loc[0] == 'L' && loc[1] == 'a' && loc[2] == 'v' &&
+                            (loc[3] == 'f' || loc[3] == 'c'));
+    if (!tag.tagCRCValid && !knownEncoder) return INVALID_LAME_TAG;
+
+    for (int i = 0; i < 9; i++) tag.encoder[i] = (loc[i] >= 0x20 && loc[i] < 0x7F)? loc[i] : '\0';
+    tag.encoder[9] = '\0';
+
+    tag.revision  = loc[9] >> 4;
+    tag.vbrMethod = loc[9] & 0b1111;
+    tag.lowpass   = loc[10] * 100;
+    tag.peak      = ReadBE32(loc + 11) / (float) (1 << 23);
+
+    tag.radioGainSet      = ReadLAMEReplayGain(loc + 15, &tag.radioGain);
+    tag.audiophileGainSet = ReadLAMEReplayGain(loc + 17, &tag.audiophileGain);
+
+    tag.encodingFlags  = loc[19] >> 4;
+    tag.athType        = loc[19] & 0b1111;
+    tag.abrBitrate     = loc[20];
+    tag.encoderDelay   = (loc[21] << 4) | (loc[22] >> 4);
+    tag.encoderPadding = ((loc[22] & 0b1111) << 8) | loc[23];
+    tag.mp3Gain        = (int8_t) loc[25];
+    tag.musicLength    = ReadBE32(loc + 28);
+    tag.musicCRC       = (loc[32] << 8) | loc[33];
+
+    tag.valid = true;
+    return tag;
+}
+
+// Write a 32-bit value to loc, in big-endian order.
+void WriteBE32 (uint8_t* loc, uint32_t value) {
+    loc[0] = value >> 24;
+    loc[1] = (value >> 16) & 0xFF;
+    loc[2] = (value >> 8) & 0xFF;
+    loc[3] = value & 0xFF;
+}
+
+// Set the music length and music CRC fields of the 36-byte LAME tag at loc. WriteXingFrame
+// recomputes the tag CRC when writing the tag into a frame.
+void SetLAMETagMusic (uint8_t* loc, uint32_t musicLength, uint16_t musicCRC) {
+    WriteBE32(loc + 28, musicLength);
+    loc[32] = musicCRC >> 8;
+    loc[33] = musicCRC & 0xFF;
+}
+
+// Set the encoder delay and padding fields of the 36-byte LAME tag at loc, which are 12 bits each.
+void SetLAMETagDelays (uint8_t* loc, uint16_t delay, uint16_t padding) {
+    loc[21] = (delay >> 4) & 0xFF;
+    loc[22] = ((delay & 0b1111) << 4) | ((padding >> 8) & 0b1111);
+    loc[23] = padding & 0xFF;
+}
+
+// Get the size a Xing/Info header with all four fields (and a LAME tag, if withLAMETag is set)
+// takes up in a frame with the given header, counting the header and side information before it.
+// Xing frames are written without CRC protection.
+size_t GetXingFrameMinSize (mpa_packed_header hdr, bool withLAMETag) {
+    mpa_header unpacked = UnpackMPAHeader(hdr, NULL);
+    return 4 + GetSideInfoSize(&unpacked) + 8 + 4 + 4 + 100 + 4 +
+           (withLAMETag? LAME_TAG_SIZE : 0);
+}
+
+// Write a Xing/Info frame with the given header into frame, which must have room for the header's
+// frame size, without CRC protection. The side information is left zeroed, so that decoders
+// play the frame as silence. The header takes its isInfo, frameCount, byteCount, toc and quality values from xing, and is
+// always written with all four fields. If lameTag isn't NULL, its 36 bytes are written after the
+// Xing fields, with a recomputed tag CRC. Returns the frame's size, or 0 if the fields don't fit
+// or the header isn't a Layer3 one.
+size_t WriteXingFrame (uint8_t* frame, mpa_packed_header hdr, xing_header* xing, uint8_t* lameTag) {
+    hdr.word |= 0b00000000000000010000000000000000;
+    size_t frameSize = PackedFrameSize(hdr);
+    if (!PackedHeaderValid(hdr) || PackedMPEGLayer(hdr) != 3 ||
+            GetXingFrameMinSize(hdr, lameTag != NULL) > frameSize) {
+        return 0;
+    }
+    memset(frame, 0, frameSize);
+    WriteBE32(frame, hdr.word);
+
+    mpa_header unpacked = UnpackMPAHeader(hdr, frame);
+    uint8_t* loc = frame + 4 + GetSideInfoSize(&unpacked);
+    memcpy(loc, xing->isInfo? "Info" : "Xing", 4);
+    WriteBE32(loc + 4, XING_FLAG_FRAMES | XING_FLAG_BYTES | XING_FLAG_TOC | XING_FLAG_QUALITY);
+    WriteBE32(loc + 8, xing->frameCount);
+    WriteBE32(loc + 12, xing->byteCount);
+    memcpy(loc + 16, xing->toc, 100);
+    WriteBE32(loc + 116, xing->quality);
+    loc += 120;
+
+    if (lameTag != NULL) {
+        memcpy(loc, lameTag, LAME_TAG_SIZE - 2);
+        uint16_t crc = CRC16LAME(frame, loc + 34 - frame, 0);
+        loc[34] = crc >> 8;
+        loc[35] = crc & 0xFF;
+    }
+    return frameSize;
+}
+
+// Struct for an in-memory file.
+typedef struct mem_file_s {
+    size_t   size;
+    uint8_t* mem;
+} mem_file;
+
+// Move a stream to the given offset from its start, which may be past 2 GB even where long is 32
+// bits, as it is on Windows. Returns 0 on success, like fseek.
+int SeekFile (FILE* stream, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(stream, (__int64) offset, SEEK_SET);
+#else
+    return fseeko(stream, (off_t) offset, SEEK_SET);
+#endif
+}
+
+// Load an entire file into memory as a null-terminated string. Returns a mem_file object.
+mem_file ReadFileIntoMemory (char* filename) {
+    // Open the file:
+    FILE* stream = fopen(filename, "r");
+    if (stream == NULL) {
+        fprintf(stderr, "ReadFile: failed to open %s\n", filename);
+        exit(1);
+    }
+
+    // Get the file's size and allocate a suitably-sized buffer:
+    fseek(stream, 0, SEEK_END);
+    size_t   size = ftell(stream);
+    uint8_t* mem  = (uint8_t*) malloc(size + 1);
+    if (mem == NULL) {
+        fprintf(stderr, "ReadFile: %lld byte allocation failed\n", (uint64_t) size);
+        exit(1);
+    }
+    
+    // Rewind, read the file and close it.
+    rewind(stream);
+    fread(mem, 1, size, stream);
+    fclose(stream);
+
+    // Add the null terminator and build up the mem_file object to return.
+    mem[size] = '\0';
+    mem_file mf = {size, mem};
+    return mf;
+}
+
+
+// Map an entire file into memory, read-only. Unlike ReadFileIntoMemory, nothing is read until it's
+// accessed, so this is the way to go for huge files of which only a part is needed. Returns a
+// mem_file object with a NULL mem if the file can't be opened or is empty; release it with
+// UnmapFile. Where mapping isn't available, this falls back to reading the whole file.
+mem_file MapFileIntoMemory (char* filename) {
+    mem_file mf = {0, NULL};
+#ifdef _WIN32
+    FILE* stream = fopen(filename, "rb");
+    if (stream == NULL) return mf;
+    fseek(stream, 0, SEEK_END);
+    mf.size = ftell(stream);
+    rewind(stream);
+    mf.mem = (uint8_t*) malloc(mf.size + 1);
+    if (mf.mem == NULL || fread(mf.mem, 1, mf.size, stream) != mf.size) {
+        free(mf.mem);
+        mf.mem = NULL;
+    }
+    fclose(stream);
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return mf;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mem != MAP_FAILED) {
+            mf.size = st.st_size;
+            mf.mem  = (uint8_t*) mem;
+        }
+    }
+    close(fd);
+#endif
+    return mf;
+}
+
+// Release a file mapped by MapFileIntoMemory.
+void UnmapFile (mem_file* file) {
+    if (file->mem == NULL) return;
+#ifdef _WIN32
+    free(file->mem);
+#else
+    munmap(file->mem, file->size);
+#endif
+    file->mem  = NULL;
+    file->size = 0;
+}
+
+// Map an entire file into memory for reading and writing, so that changes to the memory are
+// changes to the file, and only the pages written to are written back. Returns a mem_file object
+// with a NULL mem if the file can't be opened or is empty; release it with UnmapWritableFile.
+// Where mapping isn't available, this falls back to reading the whole file, which
+// UnmapWritableFile then writes back.
+mem_file MapFileForWriting (char* filename) {
+    mem_file mf = {0, NULL};
+#ifdef _WIN32
+    mf = MapFileIntoMemory(filename);
+#else
+    int fd = open(filename, O_RDWR);
+    if (fd < 0) return mf;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem != MAP_FAILED) {
+            mf.size = st.st_size;
+            mf.mem  = (uint8_t*) mem;
+        }
+    }
+    close(fd);
+#endif
+    return mf;
+}
+
+// Release a file mapped by MapFileForWriting, making sure the changes made to it reach the disk.
+// Returns false if they might not have.
+bool UnmapWritableFile (mem_file* file, char* filename) {
+    if (file->mem == NULL) return false;
+#ifdef _WIN32
+    FILE* stream = fopen(filename, "r+b");
+    bool  ok     = stream != NULL && fwrite(file->mem, 1, file->size, stream) == file->size;
+    if (stream != NULL) ok = (fclose(stream) == 0) && ok;
+    free(file->mem);
+#else
+    bool ok = msync(file->mem, file->size, MS_SYNC) == 0;
+    munmap(file->mem, file->size);
+#endif
+    file->mem  = NULL;
+    file->size = 0;
+    return ok;
+}
+
+// Get the offset of the 128-byte ID3v1 tag at the end of a file, or 0 if it has none.
+size_t GetID3v1TagOffset (mem_file* file) {
+    if (file->size < 128) return 0;
+    uint8_t* loc = file->mem + file->size - 128;
+    if (loc[0] == 'T' && loc[1] == 'A' && loc[2] == 'G') return file->size - 128;
+    return 0;
+}
+
+// Get the offset of the APEv2 tag at the end of a file, just before any ID3v1 tag, or 0 if it has
+// none. APEv2 tags end with a 32-byte footer containing:
+// - the sequence "APETAGEX"
+// - a 4-byte little-endian version
+// - a 4-byte little-endian tag size, including the footer but not the optional header
+// - a 4-byte little-endian item count
+// - 4-byte little-endian flags, of which bit 31 says whether the tag also has a 32-byte header
+// - 8 reserved bytes
+size_t GetAPEv2TagOffset (mem_file* file) {
+    size_t end = GetID3v1TagOffset(file);
+    if (end == 0) end = file->size;
+    if (end < 32) return 0;
+
+    uint8_t* footer = file->mem + end - 32;
+    if (memcmp(footer, "APETAGEX", 8) != 0) return 0;
+    uint32_t size  = footer[12] | (footer[13] << 8) | (footer[14] << 16) | ((uint32_t) footer[15] << 24);
+    uint32_t flags = footer[20] | (footer[21] << 8) | (footer[22] << 16) | ((uint32_t) footer[23] << 24);
+    if (flags & 0x80000000) size += 32;
+    if (size > end) return 0;
+    return end - size;
+}
+
+// Read a 32-bit little-endian value from loc.
+uint32_t ReadLE32 (uint8_t* loc) {
+    return loc[0] | (loc[1] << 8) | (loc[2] << 16) | ((uint32_t) loc[3] << 24);
+}
+
+// Write a 32-bit value to loc, in little-endian order.
+void WriteLE32 (uint8_t* loc, uint32_t value) {
+    for (int i = 0; i < 4; i++) loc[i] = (value >> (8 * i)) & 0xFF;
+}
+
+// Get the items of a file's APEv2 tag, storing their end into end and their number into count.
+// Returns NULL if the file has no such tag. Each item holds:
+// - a 4-byte little-endian value size
+// - 4-byte little-endian flags
+// - a null-terminated ASCII key, compared regardless of case
+// - the value, normally UTF-8 text
+uint8_t* GetAPEv2Items (mem_file* file, uint8_t** end, uint32_t* count) {
+    size_t offset = GetAPEv2TagOffset(file);
+    if (offset == 0) return NULL;
+    size_t   tagEnd = GetID3v1TagOffset(file);
+    uint8_t* footer = file->mem + ((tagEnd == 0)? file->size : tagEnd) - 32;
+    *end   = footer;
+    *count = ReadLE32(footer + 16);
+    return file->mem + offset + ((ReadLE32(footer + 20) & 0x80000000)? 32 : 0);
+}
+
+// Get the size of the APEv2 item at loc, which ends at end at the latest, and its key's size. Returns
+// 0 if the item doesn't fit.
+size_t GetAPEv2ItemSize (uint8_t* loc, uint8_t* end, size_t* keySize) {
+    if (end - loc < 9) return 0;
+    uint8_t* key = loc + 8;
+    *keySize = 0;
+    while (key + *keySize < end && key[*keySize] != '\0') (*keySize)++;
+    if (key + *keySize >= end || ReadLE32(loc) > (size_t) (end - key - *keySize - 1)) return 0;
+    return 8 + *keySize + 1 + ReadLE32(loc);
+}
+
+// Check whether an APEv2 item key of the given size is the given one, regardless of case.
+bool APEv2KeyIs (uint8_t* key, size_t size, char* other) {
+    if (strlen(other) != size) return false;
+    for (size_t i = 0; i < size; i++) {
+        char a = key[i], b = other[i];
+        if (a >= 'a' && a <= 'z') a -= 'a' - 'A';
+        if (b >= 'a' && b <= 'z') b -= 'a' - 'A';
+        if (a != b) return false;
+    }
+    return true;
+}
+
+// Read the value of a file's APEv2 item with the given key into value, as a null-terminated
+// string of at most capacity - 1 characters. Returns false if there's no such item.
+bool ReadAPEv2Item (mem_file* file, char* key, char* value, size_t capacity) {
+    uint8_t* end;
+    uint32_t count;
+    uint8_t* loc = GetAPEv2Items(file, &end, &count);
+    size_t   itemSize, keySize;
+    for (uint32_t i = 0; loc != NULL && i < count && (itemSize = GetAPEv2ItemSize(loc, end, &keySize)); i++) {
+        if (APEv2KeyIs(loc + 8, keySize, key)) {
+            size_t size = ReadLE32(loc);
+            if (size >= capacity) size = capacity - 1;
+            memcpy(value, loc + 8 + keySize + 1, size);
+            value[size] = '\0';
+            return true;
+        }
+        loc += itemSize;
+    }
+    return false;
+}
+
+// Set text items of a file's APEv2 tag, keeping its other items, or remove them where values[i]
+// is NULL. The tag is rewritten in place at the end of the file, before any ID3v1 tag, with both a
+// header and a footer; it's added if there's none, and removed if it ends up empty. Returns false
+// on failure.
+bool SetAPEv2Items (char* filename, char** keys, char** values, int count) {
+    mem_file file = MapFileIntoMemory(filename);
+    if (file.mem == NULL) return false;
+    size_t id3v1  = GetID3v1TagOffset(&file);
+    size_t end    = (id3v1 == 0)? file.size : id3v1;
+    size_t offset = GetAPEv2TagOffset(&file);
+    if (offset == 0) offset = end;
+
+    size_t capacity = (end - offset) + 64;
+    for (int i = 0; i < count; i++) capacity += 9 + strlen(keys[i]) + (values[i]? strlen(values[i]) : 0);
+    uint8_t* tag = (uint8_t*) calloc(capacity, 1);
+    if (tag == NULL) {
+        fprintf(stderr, "SetAPEv2Items: allocation failed\n");
+        exit(1);
+    }
+
+    // Keep the items not being set, then add the new ones.
+    size_t   size = 32, keySize, itemSize;
+    uint32_t itemCount = 0, oldCount;
+    uint8_t* itemsEnd;
+    uint8_t* loc = GetAPEv2Items(&file, &itemsEnd, &oldCount);
+    for (uint32_t i = 0; loc != NULL && i < oldCount && (itemSize = GetAPEv2ItemSize(loc, itemsEnd, &keySize)); i++) {
+        bool replaced = false;
+        for (int j = 0; j < count; j++) replaced = replaced || APEv2KeyIs(loc + 8, keySize, keys[j]);
+        if (!replaced) {
+            memcpy(tag + size, loc, itemSize);
+            size += itemSize;
+            itemCount++;
+        }
+        loc += itemSize;
+    }
+    for (int i = 0; i < count; i++) {
+        if (values[i] == NULL) continue;
+        size_t keyLength = strlen(keys[i]), valueLength = strlen(values[i]);
+        WriteLE32(tag + size, (uint32_t) valueLength);
+        memcpy(tag + size + 8, keys[i], keyLength + 1);
+        memcpy(tag + size + 8 + keyLength + 1, values[i], valueLength);
+        size += 8 + keyLength + 1 + valueLength;
+        itemCount++;
+    }
+
+    // The header and footer are identical, but for the flag saying which is which.
+    for (int i = 0; i < 2; i++) {
+        uint8_t* field = (i == 0)? tag : tag + size;
+        memcpy(field, "APETAGEX", 8);
+        WriteLE32(field + 8, 2000);
+        WriteLE32(field + 12, (uint32_t) size);     // the items and footer, but not the header
+        WriteLE32(field + 16, itemCount);
+        WriteLE32(field + 20, (i == 0)? 0xA0000000 : 0x80000000);
+    }
+    size = (itemCount > 0)? size + 32 : 0;
+
+    uint8_t id3v1Tag[128];
+    size_t  id3v1Size = (id3v1 != 0)? 128 : 0;
+    if (id3v1 != 0) memcpy(id3v1Tag, file.mem + id3v1, 128);
+    UnmapFile(&file);
+
+    FILE* stream = fopen(filename, "r+b");
+    bool  ok     = stream != NULL && SeekFile(stream, offset) == 0 &&
+                   fwrite(tag, 1, size, stream) == size && fwrite(id3v1Tag, 1, id3v1Size, stream) == id3v1Size &&
+                   fflush(stream) == 0;
+#ifdef _WIN32
+    ok = ok && _chsize_s(_fileno(stream), offset + size + id3v1Size) == 0;
+#else
+    ok = ok && ftruncate(fileno(stream), offset + size + id3v1Size) == 0;
+#endif
+    if (stream != NULL) ok = (fclose(stream) == 0) && ok;
+    free(tag);
+    return ok;
+}
+
+// Get the first header of a file's MPEG stream, skipping over any ID3v2 tag at its start. Returns
+// INVALID_HEADER if there is none.
+mpa_header GetFirstStreamHeader (mem_file* file) {
+    if (file->size < 10) return INVALID_HEADER;
+    size_t tagSize = GetID3v2TagSize(file->mem);
+    if (tagSize + 4 > file->size) return INVALID_HEADER;
+    return GetFirstHeader(file->mem + tagSize, file->mem + file->size - 4);
+}
+
+// Check whether the given header's frame lies entirely within the file. Also rejects free-format
+// frames, whose size can't be known from their header alone.
+bool FrameFitsInFile (mpa_header* hdr, mem_file* file) {
+    return hdr->valid && hdr->frameSize >= 4 &&
+           hdr->location + hdr->frameSize <= file->mem + file->size;
+}
+
+// Look for the first header at or after loc that is followed by confirmations more frames of the
+// same stream, one right after the other. A lone header is often a false sync (any 0xFFE in the
+// audio data looks like one), but several in a row almost never are. Returns INVALID_HEADER if
+// there's no such header in the file.
+mpa_header GetConfirmedHeader (mem_file* file, uint8_t* loc, int confirmations) {
+    uint8_t* lastLoc = file->mem + file->size - 4;
+    while (loc <= lastLoc) {
+        mpa_header header = GetFirstHeader(loc, lastLoc);
+        if (!FrameFitsInFile(&header, file)) return INVALID_HEADER;
+
+        mpa_packed_header packed = PackMPAHeader(&header);
+        mpa_header next = header;
+        int confirmed = 0;
+        while (confirmed < confirmations) {
+            uint8_t* nextLoc = next.location + next.frameSize;
+            if (nextLoc > lastLoc) break;
+            next = ReadMPAHeader(nextLoc);
+            if (!FrameFitsInFile(&next, file) || !PackedSameStream(PackMPAHeader(&next), packed)) break;
+            confirmed++;
+        }
+        // Near the end of the file, running out of frames is fine.
+        if (confirmed == confirmations || (next.valid && next.location + next.frameSize + 4 > lastLoc)) {
+            return header;
+        }
+        loc = header.location + 1;
+    }
+    return INVALID_HEADER;
+}
+
+// Find the frame right before the given one, which is the header of the same stream that ends
+// exactly where the given frame starts. Returns INVALID_HEADER if there's none.
+mpa_header GetPreviousHeader (mem_file* file, mpa_header* hdr) {
+    mpa_packed_header packed = PackMPAHeader(hdr);
+    // The largest frames are Layer2 ones at 384 kbps and 32 kHz: 1728 bytes, plus padding.
+    for (size_t back = 4; back <= 1729 && hdr->location - back >= file->mem; back++) {
+        mpa_header prev = ReadMPAHeader(hdr->location - back);
+        if (prev.valid && prev.frameSize == back && PackedSameStream(PackMPAHeader(&prev), packed)) {
+            return prev;
+        }
+    }
+    return INVALID_HEADER;
+}
+
+// Get the first audio frame of a file's MPEG stream, skipping over any ID3v2 tag and over the
+// Xing/Info frame, which holds no audio. The offset of the stream's first frame (which is the Xing
+// frame if there is one) is stored into streamStart. Returns INVALID_HEADER if there is none.
+mpa_header GetFirstAudioHeader (mem_file* file, uint64_t* streamStart) {
+    mpa_header header = GetFirstStreamHeader(file);
+    if (!FrameFitsInFile(&header, file)) return INVALID_HEADER;
+    *streamStart = header.location - file->mem;
+
+    if (ReadXingHeader(&header).valid) header = GetNextHeader(&header, file->mem + file->size - 4);
+    return header;
+}
+
+// Compact index of the audio frames of a stream, kept as parallel arrays so that it costs 5.5 bytes
+// per frame (5 for the per-frame arrays, and a 16th of a block offset), plus a few bytes for the
+// header word table and any far frames, instead of the 40-odd of an mpa_header:
+// - the absolute offset of every FRAME_INDEX_BLOCK-th frame
+// - each frame's offset relative to the first frame of its block, as 16 bits
+// - each frame's size, as 16 bits
+// - an 8-bit id per frame into a table of the distinct header words found in the stream
+// Frames whose relative offset doesn't fit in 16 bits (because of junk between frames) are marked
+// with FRAME_INDEX_FAR and have their absolute offset stored separately.
+// The Xing/Info frame, if any, is not audio and isn't indexed.
+typedef struct frame_index_s {
+    size_t    frameCount;               // number of frames indexed
+    size_t    capacity;                 // number of frames the arrays have room for
+    uint64_t* blockOffsets;             // absolute offset of the first frame of each block
+    uint16_t* offsetDeltas;             // offset of each frame relative to its block
+    uint16_t* frameSizes;               // size of each frame in bytes
+    uint8_t*  headerIds;                // index of each frame's header word in headerWords
+    uint32_t  headerWords[256];         // distinct raw header words found in the stream
+    int       headerWordCount;          // number of entries in headerWords
+    size_t    farCount;                 // number of frames stored in farFrames/farOffsets
+    size_t    farCapacity;              // number of entries farFrames/farOffsets have room for
+    uint64_t* farFrames;                // frame numbers of far frames, in increasing order
+    uint64_t* farOffsets;               // absolute offsets of far frames
+    uint64_t  streamStart;              // offset of the stream's first frame (the Xing frame, if any)
+    uint64_t  scanEnd;                  // offset right after the last indexed frame
+} frame_index;
+
+const size_t   FRAME_INDEX_BLOCK = 16;
+const uint16_t FRAME_INDEX_FAR   = 0xFFFF;
+
+// Grow the arrays of a frame index so they can hold at least the given number of frames.
+void ReserveFrameIndex (frame_index* idx, size_t frameCount) {
+    if (frameCount <= idx->capacity) return;
+    size_t capacity = idx->capacity? idx->capacity : 1024;
+    while (capacity < frameCount) capacity *= 2;
+
+    size_t blockCount = (capacity + FRAME_INDEX_BLOCK - 1) / FRAME_INDEX_BLOCK;
+    idx->blockOffsets = (uint64_t*) realloc(idx->blockOffsets, blockCount * sizeof(uint64_t));
+    idx->offsetDeltas = (uint16_t*) realloc(idx->offsetDeltas, capacity * sizeof(uint16_t));
+    idx->frameSizes   = (uint16_t*) realloc(idx->frameSizes,   capacity * sizeof(uint16_t));
+    idx->headerIds    = (uint8_t*)  realloc(idx->headerIds,    capacity * sizeof(uint8_t));
+    if (!idx->blockOffsets || !idx->offsetDeltas || !idx->frameSizes || !idx->headerIds) {
+        fprintf(stderr, "ReserveFrameIndex: allocation of %llu frames failed\n",
+            (unsigned long long) capacity);
+        exit(1);
+    }
+    idx->capacity = capacity;
+}
+
+// Record frame k of a frame index as a far frame at the given absolute offset. Far frames must be
+// added in frame order.
+void AddFarFrame (frame_index* idx, size_t k, uint64_t offset) {
+    if (idx->farCount == idx->farCapacity) {
+        idx->farCapacity = idx->farCapacity? idx->farCapacity * 2 : 16;
+        idx->farFrames   = (uint64_t*) realloc(idx->farFrames,  idx->farCapacity * sizeof(uint64_t));
+        idx->farOffsets  = (uint64_t*) realloc(idx->farOffsets, idx->farCapacity * sizeof(uint64_t));
+        if (!idx->farFrames || !idx->farOffsets) {
+            fprintf(stderr, "AddFarFrame: allocation failed\n");
+            exit(1);
+        }
+    }
+    idx->farFrames[idx->farCount]  = k;
+    idx->farOffsets[idx->farCount] = offset;
+    idx->farCount++;
+}
+
+// Append a frame to the end of a frame index. Frames must be appended in file order. Returns false
+// if the frame can't be stored because the stream has more than 256 distinct header words, which
+// only happens with streams that aren't consistent anyway.
+bool AppendFrameToIndex (frame_index* idx, uint64_t offset, uint32_t headerWord, size_t frameSize) {
+    // Look the header word up, adding it to the table if it's new. VBR streams only have a few
+    // dozen distinct words, and consecutive frames usually share one, so check the last one first.
+    int id = -1;
+    if (idx->frameCount > 0 && idx->headerWords[idx->headerIds[idx->frameCount - 1]] == headerWord) {
+        id = idx->headerIds[idx->frameCount - 1];
+    } else {
+        for (int i = 0; i < idx->headerWordCount; i++) {
+            if (idx->headerWords[i] == headerWord) { id = i; break; }
+        }
+    }
+    if (id < 0) {
+        if (idx->headerWordCount == 256) return false;
+        id = idx->headerWordCount++;
+        idx->headerWords[id] = headerWord;
+    }
+
+    ReserveFrameIndex(idx, idx->frameCount + 1);
+    size_t k     = idx->frameCount;
+    size_t block = k / FRAME_INDEX_BLOCK;
+    if (k % FRAME_INDEX_BLOCK == 0) idx->blockOffsets[block] = offset;
+
+    uint64_t delta = offset - idx->blockOffsets[block];
+    if (delta < FRAME_INDEX_FAR) {
+        idx->offsetDeltas[k] = (uint16_t) delta;
+    } else {
+        AddFarFrame(idx, k, offset);
+        idx->offsetDeltas[k] = FRAME_INDEX_FAR;
+    }
+
+    idx->frameSizes[k] = (uint16_t) frameSize;
+    idx->headerIds[k]  = (uint8_t) id;
+    idx->frameCount++;
+    idx->scanEnd = offset + frameSize;
+    return true;
+}
+
+// Get the absolute offset of frame k of a frame index.
+uint64_t FrameIndexOffset (frame_index* idx, size_t k) {
+    uint16_t delta = idx->offsetDeltas[k];
+    if (delta != FRAME_INDEX_FAR) return idx->blockOffsets[k / FRAME_INDEX_BLOCK] + delta;
+
+    // Far frames are rare, so a binary search over them is fine. There are none to search in a
+    // corrupt index file.
+    if (idx->farCount == 0) return idx->blockOffsets[k / FRAME_INDEX_BLOCK];
+    size_t lo = 0, hi = idx->farCount;
+    while (lo + 1 < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (idx->farFrames[mid] <= k) lo = mid;
+        else                          hi = mid;
+    }
+    return idx->farOffsets[lo];
+}
+
+// Get the size in bytes of frame k of a frame index.
+size_t FrameIndexSize (frame_index* idx, size_t k) {
+    return idx->frameSizes[k];
+}
+
+// Get the header of frame k of a frame index.
+mpa_packed_header FrameIndexHeader (frame_index* idx, size_t k) {
+    return (mpa_packed_header) { idx->headerWords[idx->headerIds[k]] };
+}
+
+// Get the number of bytes of memory used by a frame index's arrays.
+size_t FrameIndexMemoryUsage (frame_index* idx) {
+    size_t blockCount = (idx->frameCount + FRAME_INDEX_BLOCK - 1) / FRAME_INDEX_BLOCK;
+    return blockCount * sizeof(uint64_t) +
+           idx->frameCount * (sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint8_t)) +
+           idx->farCount * 2 * sizeof(uint64_t) +
+           idx->headerWordCount * sizeof(uint32_t);
+}
+
+// Free the arrays of a frame index.
+void FreeFrameIndex (frame_index* idx) {
+    free(idx->blockOffsets);
+    free(idx->offsetDeltas);
+    free(idx->frameSizes);
+    free(idx->headerIds);
+    free(idx->farFrames);
+    free(idx->farOffsets);
+    *idx = (frame_index) { 0 };
+}
+
+// Extend a frame index with the frames found after its last one, in an in-memory file that may
+// have grown since the index was built. The walk resumes at the index's scanEnd and reads nothing
+// before it. A partial frame at the end of the file isn't indexed, so that the next extension
+// picks it up once it's complete. Returns the number of frames added.
+size_t ExtendFrameIndex (frame_index* idx, mem_file* file) {
+    size_t before = idx->frameCount;
+    if (idx->scanEnd + 4 > file->size) return 0;
+    uint8_t* lastLoc = file->mem + file->size - 4;
+
+    mpa_header header = GetFirstHeader(file->mem + idx->scanEnd, lastLoc);
+    while (FrameFitsInFile(&header, file)) {
+        if (!AppendFrameToIndex(idx, header.location - file->mem, ReadBE32(header.location),
+                header.frameSize)) {
+            break;
+        }
+        header = GetNextHeader(&header, lastLoc);
+    }
+    return idx->frameCount - before;
+}
+
+// Build a frame index of every audio frame of an in-memory file, in a single pass over its headers.
+frame_index BuildFrameIndex (mem_file* file) {
+    frame_index idx = { 0 };
+
+    mpa_header header = GetFirstAudioHeader(file, &idx.streamStart);
+    if (!header.valid) {
+        idx.scanEnd = idx.streamStart;
+        return idx;
+    }
+    idx.scanEnd = header.location - file->mem;
+
+    // Assuming frames of about 400 bytes is a good guess for the frame count, and saves reallocations.
+    ReserveFrameIndex(&idx, file->size / 400 + 1);
+    ExtendFrameIndex(&idx, file);
+    return idx;
+}
+
+// Copy a frame index into newly allocated arrays, so that it can be extended even when it points
+// into a mapped index file. Free the copy with FreeFrameIndex.
+frame_index CloneFrameIndex (frame_index* idx) {
+    frame_index clone = *idx;
+    clone.capacity     = 0;
+    clone.blockOffsets = NULL;
+    clone.offsetDeltas = NULL;
+    clone.frameSizes   = NULL;
+    clone.headerIds    = NULL;
+    ReserveFrameIndex(&clone, idx->frameCount + 1);
+
+    size_t blockCount = (idx->frameCount + FRAME_INDEX_BLOCK - 1) / FRAME_INDEX_BLOCK;
+    if (blockCount)      memcpy(clone.blockOffsets, idx->blockOffsets, blockCount * sizeof(uint64_t));
+    if (idx->frameCount) memcpy(clone.offsetDeltas, idx->offsetDeltas, idx->frameCount * sizeof(uint16_t));
+    if (idx->frameCount) memcpy(clone.frameSizes,   idx->frameSizes,   idx->frameCount * sizeof(uint16_t));
+    if (idx->frameCount) memcpy(clone.headerIds,    idx->headerIds,    idx->frameCount * sizeof(uint8_t));
+
+    clone.farCapacity = idx->farCount;
+    clone.farFrames   = NULL;
+    clone.farOffsets  = NULL;
+    if (idx->farCount) {
+        clone.farFrames  = (uint64_t*) malloc(idx->farCount * sizeof(uint64_t));
+        clone.farOffsets = (uint64_t*) malloc(idx->farCount * sizeof(uint64_t));
+        if (!clone.farFrames || !clone.farOffsets) {
+            fprintf(stderr, "CloneFrameIndex: allocation failed\n");
+            exit(1);
+        }
+        memcpy(clone.farFrames,  idx->farFrames,  idx->farCount * sizeof(uint64_t));
+        memcpy(clone.farOffsets, idx->farOffsets, idx->farCount * sizeof(uint64_t));
+    }
+    return clone;
+}
+
+// Run of consecutive frames sharing a header template (see GetRunTemplate). A CBR stream is a
+// single run.
+// A CBR encoder pads frames so that the average frame size matches the bitrate exactly. Calling
+// the unpadded frame size base + rem / samplerate slots (see PackedFrameSize), the number of padded
+// frames among the first j of a run is then floor((j * rem + paddingPhase) / samplerate), for a
+// paddingPhase between 0 and samplerate that depends on where the encoder's padding counter was
+// when the run started. The offset of any frame of the run can therefore be computed directly.
+typedef struct frame_run_s {
+    uint64_t startOffset;               // offset of the run's first frame
+    uint32_t startFrame;                // number of the run's first frame in the stream
+    uint32_t frameCount;                // number of frames in the run
+    uint32_t templateWord;              // header word of the run's frames, without the padding bit
+    uint32_t paddingPhase;              // phase of the run's padding pattern
+} frame_run;
+
+// Run-length compressed frame index, made of runs of frames sharing a header template. Frames can
+// be looked up in O(log runs). The Xing/Info frame, if any, is not indexed.
+typedef struct run_index_s {
+    size_t     runCount;                // number of runs
+    size_t     capacity;                // number of runs the runs array has room for
+    frame_run* runs;                    // the runs, in stream order
+    size_t     frameCount;              // total number of frames in all runs
+    uint64_t   streamStart;             // offset of the stream's first frame (the Xing frame, if any)
+    uint64_t   scanEnd;                 // offset right after the last indexed frame
+    int64_t    phaseLimit;              // upper bound (exclusive) on the last run's padding phase
+} run_index;
+
+// Get the unpadded size of frames with the given header template as a number of slots (4 bytes for
+// Layer1, 1 byte otherwise), and the remainder of that division by the sample rate.
+void GetRunSlots (mpa_packed_header templ, uint64_t* slots, uint64_t* rem, uint64_t* slotSize) {
+    *slotSize = (PackedMPEGLayer(templ) == 1)? 4 : 1;
+    uint64_t numerator = PackedSamplesPerFrame(templ) / 8 / *slotSize * (PackedBitrate(templ) * 1000);
+    *slots = numerator / PackedSamplerate(templ);
+    *rem   = numerator % PackedSamplerate(templ);
+}
+
+// Get the header template of a frame: its header word with the padding bit cleared. Frames whose
+// size divides evenly by the sample rate never need padding, so an encoder padding them anyway
+// keeps the padding bit in the template.
+uint32_t GetRunTemplate (mpa_packed_header hdr) {
+    uint64_t slots, rem, slotSize;
+    GetRunSlots(hdr, &slots, &rem, &slotSize);
+    return (rem == 0)? hdr.word : hdr.word & ~(uint32_t) 0b1000000000;
+}
+
+// Append a frame to the end of a run index, extending the last run if the frame continues it.
+// Frames must be appended in file order, and must have valid, non-free-format headers.
+void AppendFrameToRunIndex (run_index* ri, uint64_t offset, uint32_t headerWord) {
+    mpa_packed_header hdr = { headerWord };
+    uint32_t templateWord = GetRunTemplate(hdr);
+    uint64_t slots, rem, slotSize;
+    GetRunSlots(hdr, &slots, &rem, &slotSize);
+    int64_t  sr = PackedSamplerate(hdr);
+
+    // The frame continues the last run if it has the same template, follows the run's last frame
+    // directly, and its padding bit still fits a single padding phase. Each frame narrows the range
+    // of phases that fit: with P padded frames among the first j + 1, the phase must satisfy
+    // P * samplerate <= (j + 1) * rem + phase < (P + 1) * samplerate.
+    if (ri->runCount > 0) {
+        frame_run* run = &ri->runs[ri->runCount - 1];
+        if (run->templateWord == templateWord && ri->scanEnd == offset) {
+            int64_t j      = run->frameCount;
+            int64_t padded = (offset - run->startOffset) / slotSize - j * slots +
+                             PackedFramePadded(hdr);
+            int64_t lo     = padded * sr - (j + 1) * (int64_t) rem;
+            int64_t hi     = (padded + 1) * sr - (j + 1) * (int64_t) rem;
+            if (lo < (int64_t) run->paddingPhase) lo = run->paddingPhase;
+            if (hi > ri->phaseLimit)              hi = ri->phaseLimit;
+            if (rem == 0 || lo < hi) {
+                if (rem != 0) {
+                    run->paddingPhase = (uint32_t) lo;
+                    ri->phaseLimit    = hi;
+                }
+                run->frameCount++;
+                ri->frameCount++;
+                ri->scanEnd = offset + PackedFrameSize(hdr);
+                return;
+            }
+        }
+    }
+
+    // Otherwise, start a new run, with the range of phases that fit its first frame.
+    if (ri->runCount == ri->capacity) {
+        ri->capacity = ri->capacity? ri->capacity * 2 : 16;
+        ri->runs     = (frame_run*) realloc(ri->runs, ri->capacity * sizeof(frame_run));
+        if (ri->runs == NULL) {
+            fprintf(stderr, "AppendFrameToRunIndex: allocation of %llu runs failed\n",
+                (unsigned long long) ri->capacity);
+            exit(1);
+        }
+    }
+    frame_run run = { offset, (uint32_t) ri->frameCount, 1, templateWord, 0 };
+    if (rem != 0 && PackedFramePadded(hdr)) {
+        run.paddingPhase = (uint32_t) (sr - (int64_t) rem);
+        ri->phaseLimit   = sr;
+    } else {
+        ri->phaseLimit   = sr - (int64_t) rem;
+    }
+    ri->runs[ri->runCount++] = run;
+    ri->frameCount++;
+    ri->scanEnd = offset + PackedFrameSize(hdr);
+}
+
+// Look up frame k of a run index, storing its offset and header. Returns false if there's no
+// such frame.
+bool RunIndexFrame (run_index* ri, size_t k, uint64_t* offset, mpa_packed_header* hdr) {
+    if (k >= ri->frameCount) return false;
+
+    // Binary search for the last run starting at or before frame k.
+    size_t lo = 0, hi = ri->runCount;
+    while (lo + 1 < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (ri->runs[mid].startFrame <= k) lo = mid;
+        else                               hi = mid;
+    }
+    frame_run* run = &ri->runs[lo];
+    mpa_packed_header templ = { run->templateWord };
+    uint64_t j = k - run->startFrame;
+
+    uint64_t slots, rem, slotSize;
+    GetRunSlots(templ, &slots, &rem, &slotSize);
+    if (rem == 0) {
+        *offset = run->startOffset + j * PackedFrameSize(templ);
+        *hdr    = templ;
+        return true;
+    }
+
+    uint64_t sr = PackedSamplerate(templ);
+    uint64_t paddedBefore = (j * rem + run->paddingPhase) / sr;
+    uint64_t paddedAfter  = ((j + 1) * rem + run->paddingPhase) / sr;
+    *offset   = run->startOffset + (j * slots + paddedBefore) * slotSize;
+    hdr->word = run->templateWord | ((paddedAfter > paddedBefore)? 0b1000000000 : 0);
+    return true;
+}
+
+// Get the number of bytes of memory used by a run index's runs.
+size_t RunIndexMemoryUsage (run_index* ri) {
+    return ri->runCount * sizeof(frame_run);
+}
+
+// Free the runs of a run index.
+void FreeRunIndex (run_index* ri) {
+    free(ri->runs);
+    *ri = (run_index) { 0 };
+}
+
+// Build a run index of every audio frame of an in-memory file, in a single pass over its headers.
+run_index BuildRunIndex (mem_file* file) {
+    run_index ri = { 0 };
+    uint8_t* lastLoc = file->mem + file->size - 4;
+
+    mpa_header header = GetFirstAudioHeader(file, &ri.streamStart);
+    while (FrameFitsInFile(&header, file)) {
+        AppendFrameToRunIndex(&ri, header.location - file->mem, ReadBE32(header.location));
+        header = GetNextHeader(&header, lastLoc);
+    }
+    return ri;
+}
+
+// Count the bits set in a 64-bit word.
+int PopCount64 (uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int) ((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Get the position of the r-th (counting from 0) set bit of a 64-bit word, which must have more
+// than r bits set.
+int SelectInWord64 (uint64_t x, int r) {
+    for (int i = 0; i < r; i++) x &= x - 1;
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int pos = 0;
+    while (!(x & 1)) { x >>= 1; pos++; }
+    return pos;
+#endif
+}
+
+// Elias-Fano encoding of the frame start offsets of a stream, a monotone sequence of count values
+// below universe. Each value is split into its lowBits low bits, stored as is, and its remaining
+// high bits, stored in unary as gaps in a bitvector of count + (universe >> lowBits) + 1 bits: the
+// value k sets bit (high part + k). With lowBits = log2(universe / count), that's about
+// 2 + log2(universe / count) bits per frame, close to the log2(universe choose count) minimum.
+// The position of every EF_SAMPLE_RATE-th set and clear bit is sampled, so that reaching the k-th
+// one (select) or the h-th zero (to find a byte's frame) only scans a few words.
+typedef struct elias_fano_s {
+    size_t    count;                    // number of values
+    uint64_t  universe;                 // upper bound (exclusive) on the values
+    int       lowBits;                  // number of low bits stored per value
+    uint64_t* low;                      // the low bits of each value, packed
+    uint64_t* high;                     // the unary-coded high bits
+    size_t    highBits;                 // size of high in bits
+    uint64_t* oneSamples;               // position in high of every EF_SAMPLE_RATE-th set bit
+    uint64_t* zeroSamples;              // position in high of every EF_SAMPLE_RATE-th clear bit
+    size_t    filled;                   // number of values appended so far
+} elias_fano;
+
+const size_t EF_SAMPLE_RATE = 256;
+
+// Create an empty Elias-Fano sequence with room for count values below universe.
+elias_fano CreateEliasFano (size_t count, uint64_t universe) {
+    elias_fano ef = { 0 };
+    ef.count    = count;
+    ef.universe = universe;
+    while (count > 0 && (universe >> (ef.lowBits + 1)) >= count) ef.lowBits++;
+
+    size_t lowWords  = (count * ef.lowBits + 63) / 64 + 1;
+    ef.highBits      = count + (universe >> ef.lowBits) + 1;
+    size_t highWords = (ef.highBits + 63) / 64 + 1;
+    size_t zeroCount = ef.highBits - count;
+
+    ef.low         = (uint64_t*) calloc(lowWords, sizeof(uint64_t));
+    ef.high        = (uint64_t*) calloc(highWords, sizeof(uint64_t));
+    ef.oneSamples  = (uint64_t*) calloc(count / EF_SAMPLE_RATE + 1, sizeof(uint64_t));
+    ef.zeroSamples = (uint64_t*) calloc(zeroCount / EF_SAMPLE_RATE + 1, sizeof(uint64_t));
+    if (!ef.low || !ef.high || !ef.oneSamples || !ef.zeroSamples) {
+        fprintf(stderr, "CreateEliasFano: allocation of %llu values failed\n", (unsigned long long) count);
+        exit(1);
+    }
+    return ef;
+}
+
+// Append the next value to an Elias-Fano sequence. Values must be appended in increasing order,
+// and no more than the count the sequence was created with.
+void AppendEliasFano (elias_fano* ef, uint64_t value) {
+    size_t k = ef->filled++;
+
+    if (ef->lowBits > 0) {
+        uint64_t lowValue = value & ((1ULL << ef->lowBits) - 1);
+        size_t   bitPos   = k * ef->lowBits;
+        ef->low[bitPos / 64] |= lowValue << (bitPos % 64);
+        if (bitPos % 64 + ef->lowBits > 64) ef->low[bitPos / 64 + 1] |= lowValue >> (64 - bitPos % 64);
+    }
+
+    uint64_t highPos = (value >> ef->lowBits) + k;
+    ef->high[highPos / 64] |= 1ULL << (highPos % 64);
+    if (k % EF_SAMPLE_RATE == 0) ef->oneSamples[k / EF_SAMPLE_RATE] = highPos;
+}
+
+// Sample the positions of the clear bits of an Elias-Fano sequence, once every value is appended.
+void FinishEliasFano (elias_fano* ef) {
+    size_t zeros = 0;
+    for (size_t pos = 0; pos < ef->highBits; pos++) {
+        if (!(ef->high[pos / 64] & (1ULL << (pos % 64)))) {
+            if (zeros % EF_SAMPLE_RATE == 0) ef->zeroSamples[zeros / EF_SAMPLE_RATE] = pos;
+            zeros++;
+        }
+    }
+}
+
+// Get the low bits of value k of an Elias-Fano sequence.
+uint64_t EliasFanoLow (elias_fano* ef, size_t k) {
+    if (ef->lowBits == 0) return 0;
+    size_t   bitPos = k * ef->lowBits;
+    uint64_t value  = ef->low[bitPos / 64] >> (bitPos % 64);
+    if (bitPos % 64 + ef->lowBits > 64) value |= ef->low[bitPos / 64 + 1] << (64 - bitPos % 64);
+    return value & ((1ULL << ef->lowBits) - 1);
+}
+
+// Get the position in the high bitvector of its r-th set bit (or clear bit, if ones is false).
+uint64_t EliasFanoSelectBit (elias_fano* ef, size_t r, bool ones) {
+    uint64_t* samples = ones? ef->oneSamples : ef->zeroSamples;
+    uint64_t  pos     = samples[r / EF_SAMPLE_RATE];
+    size_t    left    = r % EF_SAMPLE_RATE;
+
+    // Start from the sampled bit, then skip whole words until the wanted bit is in the current one.
+    size_t   word = pos / 64;
+    uint64_t bits = ones? ef->high[word] : ~ef->high[word];
+    bits &= ~0ULL << (pos % 64);
+    int n = PopCount64(bits);
+    while ((size_t) n <= left) {
+        left -= n;
+        word++;
+        bits = ones? ef->high[word] : ~ef->high[word];
+        n    = PopCount64(bits);
+    }
+    return word * 64 + SelectInWord64(bits, (int) left);
+}
+
+// Get value k of an Elias-Fano sequence: the byte offset of frame k.
+uint64_t EliasFanoSelect (elias_fano* ef, size_t k) {
+    uint64_t high = EliasFanoSelectBit(ef, k, true) - k;
+    return (high << ef->lowBits) | EliasFanoLow(ef, k);
+}
+
+// Find the last value of an Elias-Fano sequence that is at most b, which for frame offsets is the
+// frame containing byte b (provided b is inside a frame at all). Stores its position into k and
+// returns true, or returns false if every value is above b.
+bool EliasFanoPredecessor (elias_fano* ef, uint64_t b, size_t* k) {
+    if (ef->count == 0) return false;
+    if (b >= ef->universe) b = ef->universe - 1;
+
+    // Values with a high part of h are the set bits just before the h-th clear bit, so the values
+    // with a high part up to h are the ones before it.
+    uint64_t h         = b >> ef->lowBits;
+    uint64_t upToH     = EliasFanoSelectBit(ef, h, false) - h;
+    uint64_t belowH    = (h == 0)? 0 : EliasFanoSelectBit(ef, h - 1, false) - (h - 1);
+    uint64_t lowTarget = b & ((1ULL << ef->lowBits) - 1);
+
+    // Within the bucket of high part h, values are sorted by their low bits.
+    size_t pos = upToH;
+    while (pos > belowH && EliasFanoLow(ef, pos - 1) > lowTarget) pos--;
+    if (pos == 0) return false;
+    *k = pos - 1;
+    return true;
+}
+
+// Get the number of bytes of memory used by an Elias-Fano sequence.
+size_t EliasFanoMemoryUsage (elias_fano* ef) {
+    return ((ef->count * ef->lowBits + 63) / 64 + 1) * sizeof(uint64_t) +
+           ((ef->highBits + 63) / 64 + 1) * sizeof(uint64_t) +
+           (ef->count / EF_SAMPLE_RATE + 1) * sizeof(uint64_t) +
+           ((ef->highBits - ef->count) / EF_SAMPLE_RATE + 1) * sizeof(uint64_t);
+}
+
+// Free the arrays of an Elias-Fano sequence.
+void FreeEliasFano (elias_fano* ef) {
+    free(ef->low);
+    free(ef->high);
+    free(ef->oneSamples);
+    free(ef->zeroSamples);
+    *ef = (elias_fano) { 0 };
+}
+
+// Build an Elias-Fano sequence of the offsets of every audio frame of an in-memory file. This walks
+// the frames twice, once to count them and once to encode their offsets, so that nothing but the
+// final encoding is ever allocated.
+elias_fano BuildEliasFanoOffsets (mem_file* file) {
+    uint8_t* lastLoc = file->mem + file->size - 4;
+    uint64_t streamStart;
+
+    size_t count = 0;
+    mpa_header header = GetFirstAudioHeader(file, &streamStart);
+    mpa_header firstHeader = header;
+    while (FrameFitsInFile(&header, file)) {
+        count++;
+        header = GetNextHeader(&header, lastLoc);
+    }
+
+    elias_fano ef = CreateEliasFano(count, file->size);
+    header = firstHeader;
+    while (FrameFitsInFile(&header, file)) {
+        AppendEliasFano(&ef, header.location - file->mem);
+        header = GetNextHeader(&header, lastLoc);
+    }
+    FinishEliasFano(&ef);
+    return ef;
+}
+
+// Hash size bytes at loc, continuing from the given hash value (use 0 to start). This is a fast
+// non-cryptographic hash, good for spotting changed files and corrupt indexes. When hashing in
+// several pieces, all but the last must be a multiple of 8 bytes long.
+uint64_t Hash64 (uint8_t* loc, size_t size, uint64_t hash) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, loc + i, 8);
+        hash  = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++) {
+        hash  = (hash ^ loc[i]) * 0x100000001B3ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// Identity of a file on disk, used to tell whether results computed from it are still valid.
+typedef struct file_identity_s {
+    uint64_t size;                      // file size in bytes
+    int64_t  mtime;                     // modification time, in nanoseconds since the epoch
+    uint64_t device;                    // device the file lives on
+    uint64_t inode;                     // inode number of the file
+    uint64_t headHash;                  // Hash64 of the first IDENTITY_HASH_SPAN bytes
+    uint64_t tailHash;                  // Hash64 of the last IDENTITY_HASH_SPAN bytes
+} file_identity;
+
+const size_t IDENTITY_HASH_SPAN = 65536;
+
+// Hash the span bytes of a file starting at offset, reading only those bytes.
+uint64_t HashFileSpan (FILE* stream, uint64_t offset, size_t span) {
+    uint8_t* buffer = (uint8_t*) malloc(span);
+    if (buffer == NULL) return 0;
+    SeekFile(stream, offset);
+    size_t got = fread(buffer, 1, span, stream);
+    uint64_t hash = Hash64(buffer, got, 0);
+    free(buffer);
+    return hash;
+}
+
+// Get the modification time of a file from its metadata, in nanoseconds since the epoch, to the
+// resolution the platform keeps it at.
+int64_t GetModificationTime (struct stat* st) {
+#if defined(__APPLE__)
+    return (int64_t) st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    return (int64_t) st->st_mtime * 1000000000;
+#else
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+// Get the identity of a file from its metadata and, if withHashes is set, by hashing its first and
+// last IDENTITY_HASH_SPAN bytes (which never reads more than that, however big the file is).
+// Returns false if the file can't be accessed.
+bool ReadFileIdentity (char* filename, file_identity* id, bool withHashes) {
+    struct stat st;
+    if (stat(filename, &st) != 0) return false;
+
+    *id = (file_identity) { 0 };
+    id->size   = st.st_size;
+    id->device = st.st_dev;
+    id->inode  = st.st_ino;
+    id->mtime  = GetModificationTime(&st);
+
+    if (withHashes) {
+        FILE* stream = fopen(filename, "rb");
+        if (stream == NULL) return false;
+        size_t span  = (id->size < IDENTITY_HASH_SPAN)? id->size : IDENTITY_HASH_SPAN;
+        id->headHash = HashFileSpan(stream, 0, span);
+        id->tailHash = HashFileSpan(stream, id->size - span, span);
+        fclose(stream);
+    }
+    return true;
+}
+
+// Map a file into memory, as MapFileIntoMemory does, and get the identity of the bytes mapped. Its
+// metadata is read first, so a file that grows meanwhile ends up with an identity that no longer
+// matches it; its size and hashes come from the mapping itself. Whatever is worked out from the
+// mapping can then never pass for a description of bytes appended after it was made. Returns false,
+// with nothing mapped, if the file can't be accessed or is empty.
+bool MapFileWithIdentity (char* filename, mem_file* file, file_identity* id) {
+    *file = (mem_file) { 0, NULL };
+    if (!ReadFileIdentity(filename, id, false)) return false;
+    *file = MapFileIntoMemory(filename);
+    if (file->mem == NULL) return false;
+
+    size_t span  = (file->size < IDENTITY_HASH_SPAN)? file->size : IDENTITY_HASH_SPAN;
+    id->size     = file->size;
+    id->headHash = Hash64(file->mem, span, 0);
+    id->tailHash = Hash64(file->mem + file->size - span, span, 0);
+    return true;
+}
+
+// Get the current time in seconds, for measurements.
+double GetTimeSeconds () {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Sidecar index file, holding everything a GetFirstHeader/GetNextHeader walk finds in an MPEG
+// audio file. It's laid out to be mapped into memory and used as is: a fixed-size header, followed
+// by the arrays of a frame_index, each aligned to 8 bytes. Integers are stored in the byte order of
+// the host that wrote the file, which byteOrder tells; other hosts just rebuild the index.
+// The index of a file that grows is appended to in place (see AppendIndexFile), which costs only the
+// frames appended: its arrays have room for more frames than they hold, and rather than hashing the
+// whole index file, the checksum takes running hashes of the blocks and far frames, which appending
+// carries on from where they were.
+#define INDEX_XING_BYTES 256
+
+typedef struct index_file_header_s {
+    char     magic[8];                  // "MPAINDEX"
+    uint32_t version;                   // INDEX_FILE_VERSION
+    uint32_t byteOrder;                 // 0x01020304, as stored by the writing host
+    uint64_t totalSize;                 // size of the whole index file in bytes
+    uint64_t checksum;                  // see IndexFileChecksum
+
+    // Identity of the indexed file, see file_identity:
+    uint64_t fileSize;
+    int64_t  fileMtime;
+    uint64_t headHash;
+    uint64_t tailHash;
+
+    // Tags found in the indexed file:
+    uint64_t id3v2Size;                 // size of the ID3v2 tag at its start, 0 if none
+    uint64_t apeOffset;                 // offset of the APEv2 tag at its end, 0 if none
+    uint64_t id3v1Offset;               // offset of the ID3v1 tag at its end, 0 if none
+
+    // Xing/Info frame, which is the frame at streamStart when there is one:
+    uint32_t xingFrameSize;             // size of the Xing frame, 0 if there's none
+    uint32_t xingBytesStored;           // how many of its bytes xingFrame holds
+    uint8_t  xingFrame[INDEX_XING_BYTES]; // the first bytes of the Xing frame, LAME tag included
+
+    // Frame table, see frame_index. The *Pos fields are offsets in the index file.
+    uint64_t frameCount;
+    uint64_t streamStart;
+    uint64_t scanEnd;
+    uint64_t farCount;
+    uint64_t frameCapacity;             // number of frames the arrays have room for
+    uint64_t farCapacity;               // number of far frames the far arrays have room for
+    uint64_t blocksHash;                // HashIndexBlocks of the complete blocks
+    uint64_t farHash;                   // HashFarFrames of the far frames
+    uint32_t headerWordCount;
+    uint32_t reserved;
+    uint32_t headerWords[256];
+    uint64_t blockOffsetsPos;
+    uint64_t farFramesPos;
+    uint64_t farOffsetsPos;
+    uint64_t offsetDeltasPos;
+    uint64_t frameSizesPos;
+    uint64_t headerIdsPos;
+} index_file_header;
+
+const uint32_t INDEX_FILE_VERSION    = 2;
+const uint32_t INDEX_FILE_BYTE_ORDER = 0x01020304;
+
+// An index file mapped into memory. frames points into the mapping, so it must not be freed with
+// FreeFrameIndex; close the whole index file with CloseIndexFile instead.
+typedef struct index_file_s {
+    mem_file            map;            // the mapped index file
+    index_file_header*  header;         // the index file's header
+    frame_index         frames;         // the index file's frame table
+} index_file;
+
+// Get the name of the sidecar index file of an audio file, which is the audio file's name with
+// ".mpaidx" appended. Free the returned string when done.
+char* GetIndexFileName (char* filename) {
+    size_t length = strlen(filename);
+    char*  name   = (char*) malloc(length + 8);
+    if (name == NULL) {
+        fprintf(stderr, "GetIndexFileName: allocation failed\n");
+        exit(1);
+    }
+    memcpy(name, filename, length);
+    memcpy(name + length, ".mpaidx", 8);
+    return name;
+}
+
+// Start replacing a file atomically: open a temporary file next to it for writing, storing its
+// name into tmpName. FinishAtomicWrite then renames it over the file, so that readers (even in
+// other processes) see either the old contents or the new ones, never a mix. Returns NULL on
+// failure.
+FILE* StartAtomicWrite (char* filename, char** tmpName) {
+    size_t length = strlen(filename);
+    *tmpName = (char*) malloc(length + 32);
+    if (*tmpName == NULL) return NULL;
+#ifdef _WIN32
+    snprintf(*tmpName, length + 32, "%s.tmp%d", filename, rand());
+#else
+    snprintf(*tmpName, length + 32, "%s.tmp%d", filename, (int) getpid());
+#endif
+
+    FILE* stream = fopen(*tmpName, "wb");
+    if (stream == NULL) {
+        free(*tmpName);
+        *tmpName = NULL;
+    }
+    return stream;
+}
+
+// Finish an atomic write started by StartAtomicWrite. If ok is set, flush the temporary file to
+// disk and rename it over filename; otherwise (or if that fails) remove it. Frees tmpName.
+// Returns whether the file was replaced.
+bool FinishAtomicWrite (FILE* stream, char* tmpName, char* filename, bool ok) {
+    ok = (fflush(stream) == 0) && ok;
+#ifndef _WIN32
+    ok = ok && fsync(fileno(stream)) == 0;
+#endif
+    ok = (fclose(stream) == 0) && ok;
+#ifdef _WIN32
+    if (ok) remove(filename);
+#endif
+    ok = ok && rename(tmpName, filename) == 0;
+    if (!ok) remove(tmpName);
+    free(tmpName);
+    return ok;
+}
+
+// Atomically replace a file with size bytes from mem. Returns false on failure.
+bool WriteFileAtomically (char* filename, uint8_t* mem, size_t size) {
+    char* tmpName;
+    FILE* stream = StartAtomicWrite(filename, &tmpName);
+    if (stream == NULL) return false;
+    return FinishAtomicWrite(stream, tmpName, filename, fwrite(mem, 1, size, stream) == size);
+}
+
+// Round a size up to a multiple of 8 bytes.
+size_t AlignTo8 (size_t size) {
+    return (size + 7) & ~(size_t) 7;
+}
+
+// Chain onto hash the Hash64 of blocks first to last (exclusive) of a frame index: the offset of
+// each, then the offset deltas, sizes and header ids of its frames. Once a block is complete its
+// entries never change, so the hash of the complete blocks of a growing index can be carried on.
+uint64_t HashIndexBlocks (frame_index* idx, size_t first, size_t last, uint64_t hash) {
+    for (size_t b = first; b < last; b++) {
+        size_t k     = b * FRAME_INDEX_BLOCK;
+        size_t count = (idx->frameCount - k < FRAME_INDEX_BLOCK)? idx->frameCount - k : FRAME_INDEX_BLOCK;
+        hash = Hash64((uint8_t*) (idx->blockOffsets + b), sizeof(uint64_t), hash);
+        hash = Hash64((uint8_t*) (idx->offsetDeltas + k), count * sizeof(uint16_t), hash);
+        hash = Hash64((uint8_t*) (idx->frameSizes + k),   count * sizeof(uint16_t), hash);
+        hash = Hash64(idx->headerIds + k, count * sizeof(uint8_t), hash);
+    }
+    return hash;
+}
+
+// Chain onto hash the Hash64 of count far frames, given by their frame numbers and offsets.
+uint64_t HashFarFrames (uint64_t* frames, uint64_t* offsets, size_t count, uint64_t hash) {
+    for (size_t i = 0; i < count; i++) {
+        hash = Hash64((uint8_t*) (frames + i),  sizeof(uint64_t), hash);
+        hash = Hash64((uint8_t*) (offsets + i), sizeof(uint64_t), hash);
+    }
+    return hash;
+}
+
+// Compute the checksum of an index file from its header and its frame table: the Hash64 of the
+// header, with its checksum field taken as 0, followed by that of the last block if it's partial.
+// The header holds the hashes of the complete blocks and of the far frames, so this covers it all.
+uint64_t IndexFileChecksum (uint8_t* header, frame_index* idx) {
+    size_t   checksumPos = offsetof(index_file_header, checksum);
+    uint8_t  zero[8]     = { 0 };
+    uint64_t checksum    = Hash64(header, checksumPos, 0);
+    checksum = Hash64(zero, 8, checksum);
+    checksum = Hash64(header + checksumPos + 8, sizeof(index_file_header) - checksumPos - 8, checksum);
+
+    size_t complete = idx->frameCount / FRAME_INDEX_BLOCK;
+    size_t blocks   = (idx->frameCount + FRAME_INDEX_BLOCK - 1) / FRAME_INDEX_BLOCK;
+    return HashIndexBlocks(idx, complete, blocks, checksum);
+}
+
+// Serialize the frame index of an in-memory file, whose identity on disk is id, into the index
+// file format. With withRoom set, its arrays get room for as many frames again, for a file that's
+// still growing. Stores the serialized size into size; free the returned buffer when done.
+uint8_t* SerializeIndexFile (mem_file* file, file_identity* id, frame_index* idx, bool withRoom, size_t* size) {
+    size_t frameCapacity = withRoom? 2 * idx->frameCount + FRAME_INDEX_BLOCK : idx->frameCount;
+    size_t farCapacity   = withRoom? 2 * idx->farCount + 16 : idx->farCount;
+    size_t blockCapacity = (frameCapacity + FRAME_INDEX_BLOCK - 1) / FRAME_INDEX_BLOCK;
+    size_t blockCount    = (idx->frameCount + FRAME_INDEX_BLOCK - 1) / FRAME_INDEX_BLOCK;
+
+    // Lay the arrays out after the header.
+    index_file_header hdr = { { 'M', 'P', 'A', 'I', 'N', 'D', 'E', 'X' } };
+    size_t pos = AlignTo8(sizeof(index_file_header));
+    hdr.blockOffsetsPos = pos;  pos += AlignTo8(blockCapacity * sizeof(uint64_t));
+    hdr.farFramesPos    = pos;  pos += AlignTo8(farCapacity * sizeof(uint64_t));
+    hdr.farOffsetsPos   = pos;  pos += AlignTo8(farCapacity * sizeof(uint64_t));
+    hdr.offsetDeltasPos = pos;  pos += AlignTo8(frameCapacity * sizeof(uint16_t));
+    hdr.frameSizesPos   = pos;  pos += AlignTo8(frameCapacity * sizeof(uint16_t));
+    hdr.headerIdsPos    = pos;  pos += AlignTo8(frameCapacity * sizeof(uint8_t));
+
+    hdr.version   = INDEX_FILE_VERSION;
+    hdr.byteOrder = INDEX_FILE_BYTE_ORDER;
+    hdr.totalSize = pos;
+
+    hdr.fileSize  = id->size;
+    hdr.fileMtime = id->mtime;
+    hdr.headHash  = id->headHash;
+    hdr.tailHash  = id->tailHash;
+
+    hdr.id3v2Size   = GetID3v2TagSize(file->mem);
+    hdr.apeOffset   = GetAPEv2TagOffset(file);
+    hdr.id3v1Offset = GetID3v1TagOffset(file);
+
+    // The Xing frame is the first frame of the stream when it isn't the first indexed one.
+    mpa_header first = (idx->streamStart + 4 <= file->size)?
+        ReadMPAHeader(file->mem + idx->streamStart) : INVALID_HEADER;
+    if (first.valid && ReadXingHeader(&first).valid) {
+        hdr.xingFrameSize   = (uint32_t) first.frameSize;
+        hdr.xingBytesStored = (uint32_t) ((first.frameSize < INDEX_XING_BYTES)? first.frameSize : INDEX_XING_BYTES);
+        memcpy(hdr.xingFrame, first.location, hdr.xingBytesStored);
+    }
+
+    hdr.frameCount      = idx->frameCount;
+    hdr.streamStart     = idx->streamStart;
+    hdr.scanEnd         = idx->scanEnd;
+    hdr.farCount        = idx->farCount;
+    hdr.frameCapacity   = frameCapacity;
+    hdr.farCapacity     = farCapacity;
+    hdr.blocksHash      = HashIndexBlocks(idx, 0, idx->frameCount / FRAME_INDEX_BLOCK, 0);
+    hdr.farHash         = HashFarFrames(idx->farFrames, idx->farOffsets, idx->farCount, 0);
+    hdr.headerWordCount = idx->headerWordCount;
+    memcpy(hdr.headerWords, idx->headerWords, sizeof(hdr.headerWords));
+
+    uint8_t* mem = (uint8_t*) calloc(1, pos);
+    if (mem == NULL) {
+        fprintf(stderr, "SerializeIndexFile: %llu byte allocation failed\n", (unsigned long long) pos);
+        exit(1);
+    }
+    memcpy(mem, &hdr, sizeof(hdr));
+    if (blockCount)      memcpy(mem + hdr.blockOffsetsPos, idx->blockOffsets, blockCount * sizeof(uint64_t));
+    if (idx->farCount)   memcpy(mem + hdr.farFramesPos,    idx->farFrames,    idx->farCount * sizeof(uint64_t));
+    if (idx->farCount)   memcpy(mem + hdr.farOffsetsPos,   idx->farOffsets,   idx->farCount * sizeof(uint64_t));
+    if (idx->frameCount) memcpy(mem + hdr.offsetDeltasPos, idx->offsetDeltas, idx->frameCount * sizeof(uint16_t));
+    if (idx->frameCount) memcpy(mem + hdr.frameSizesPos,   idx->frameSizes,   idx->frameCount * sizeof(uint16_t));
+    if (idx->frameCount) memcpy(mem + hdr.headerIdsPos,    idx->headerIds,    idx->frameCount * sizeof(uint8_t));
+
+    ((index_file_header*) mem)->checksum = IndexFileChecksum(mem, idx);
+    *size = pos;
+    return mem;
+}
+
+// Write the frame index of the in-memory copy of an audio file, whose identity is id (see
+// MapFileWithIdentity), to the given index file, atomically. With withRoom set, the index file gets
+// room to be appended to, see SerializeIndexFile. Returns false on failure.
+bool WriteIndexFile (char* indexName, mem_file* file, file_identity* id, frame_index* idx, bool withRoom) {
+    size_t   size;
+    uint8_t* mem = SerializeIndexFile(file, id, idx, withRoom, &size);
+    bool     ok  = WriteFileAtomically(indexName, mem, size);
+    free(mem);
+    return ok;
+}
+
+// Check that an array of count items of itemSize bytes at pos in an index file of totalSize bytes
+// lies within it, and is aligned for direct use, without overflowing on crafted values.
+bool IndexSectionFits (uint64_t pos, uint64_t count, uint64_t itemSize, uint64_t totalSize) {
+    return pos >= sizeof(index_file_header) && pos <= totalSize && pos % 8 == 0 &&
+           count <= (totalSize - pos) / itemSize;
+}
+
+// Map an index file into memory and check that it's usable as it is: that its header is
+// consistent and every array it points to lies within the file. This is constant time, whatever
+// the size of the index file; VerifyIndexFile checks its contents as well. Until it has, the
+// frame offsets may point anywhere, so check them against the file before reading there (see
+// ReadHeaderInFile). Returns false if the index file doesn't exist, was written by an incompatible
+// version or host, or is truncated or corrupt.
+bool OpenIndexFile (char* indexName, index_file* index) {
+    *index = (index_file) { 0 };
+    index->map = MapFileIntoMemory(indexName);
+    if (index->map.mem == NULL) return false;
+
+    index_file_header* hdr   = (index_file_header*) index->map.mem;
+    uint64_t           total = index->map.size;
+    bool ok = total >= sizeof(index_file_header) &&
+              memcmp(hdr->magic, "MPAINDEX", 8) == 0 &&
+              hdr->version   == INDEX_FILE_VERSION &&
+              hdr->byteOrder == INDEX_FILE_BYTE_ORDER &&
+              hdr->totalSize == total &&
+              hdr->headerWordCount <= 256 &&
+              hdr->xingBytesStored <= INDEX_XING_BYTES &&
+              hdr->streamStart <= hdr->scanEnd && hdr->scanEnd <= hdr->fileSize &&
+              hdr->frameCount <= hdr->frameCapacity && hdr->farCount <= hdr->farCapacity &&
+              hdr->frameCapacity <= total && hdr->farCapacity <= total;
+    ok = ok && IndexSectionFits(hdr->blockOffsetsPos, (hdr->frameCapacity + FRAME_INDEX_BLOCK - 1) / FRAME_INDEX_BLOCK, sizeof(uint64_t), total) &&
+               IndexSectionFits(hdr->farFramesPos,    hdr->farCapacity,   sizeof(uint64_t), total) &&
+               IndexSectionFits(hdr->farOffsetsPos,   hdr->farCapacity,   sizeof(uint64_t), total) &&
+               IndexSectionFits(hdr->offsetDeltasPos, hdr->frameCapacity, sizeof(uint16_t), total) &&
+               IndexSectionFits(hdr->frameSizesPos,   hdr->frameCapacity, sizeof(uint16_t), total) &&
+               IndexSectionFits(hdr->headerIdsPos,    hdr->frameCapacity, sizeof(uint8_t),  total);
+    if (!ok) {
+        UnmapFile(&index->map);
+        return false;
+    }
+
+    // Point the frame table straight into the mapping.
+    uint8_t* mem = index->map.mem;
+    index->header                 = hdr;
+    index->frames.frameCount      = hdr->frameCount;
+    index->frames.capacity        = hdr->frameCount;
+    index->frames.blockOffsets    = (uint64_t*) (mem + hdr->blockOffsetsPos);
+    index->frames.farFrames       = (uint64_t*) (mem + hdr->farFramesPos);
+    index->frames.farOffsets      = (uint64_t*) (mem + hdr->farOffsetsPos);
+    index->frames.offsetDeltas    = (uint16_t*) (mem + hdr->offsetDeltasPos);
+    index->frames.frameSizes      = (uint16_t*) (mem + hdr->frameSizesPos);
+    index->frames.headerIds       = (uint8_t*)  (mem + hdr->headerIdsPos);
+    index->frames.farCount        = hdr->farCount;
+    index->frames.farCapacity     = hdr->farCount;
+    index->frames.headerWordCount = hdr->headerWordCount;
+    index->frames.streamStart     = hdr->streamStart;
+    index->frames.scanEnd         = hdr->scanEnd;
+    memcpy(index->frames.headerWords, hdr->headerWords, sizeof(hdr->headerWords));
+    return true;
+}
+
+// Check the contents of an index file opened with OpenIndexFile, in time linear in its size: its
+// checksum, and that every frame it lists has a known header and lies within the indexed file.
+bool VerifyIndexFile (index_file* index) {
+    index_file_header* hdr = index->header;
+    frame_index*       idx = &index->frames;
+    if (HashIndexBlocks(idx, 0, idx->frameCount / FRAME_INDEX_BLOCK, 0) != hdr->blocksHash ||
+        HashFarFrames(idx->farFrames, idx->farOffsets, idx->farCount, 0) != hdr->farHash ||
+        IndexFileChecksum(index->map.mem, idx) != hdr->checksum) {
+        return false;
+    }
+
+    for (size_t k = 0; k < idx->farCount; k++) {
+        if (idx->farFrames[k] >= idx->frameCount || (k > 0 && idx->farFrames[k] <= idx->farFrames[k - 1])) return false;
+    }
+    for (size_t k = 0; k < idx->frameCount; k++) {
+        if (idx->offsetDeltas[k] == FRAME_INDEX_FAR && (idx->farCount == 0 || idx->farFrames[0] > k)) return false;
+        if (idx->headerIds[k] >= idx->headerWordCount) return false;
+        uint64_t offset = FrameIndexOffset(idx, k);
+        if (offset > hdr->fileSize || FrameIndexSize(idx, k) > hdr->fileSize - offset) return false;
+    }
+    return true;
+}
+
+// Unmap an index file opened with OpenIndexFile.
+void CloseIndexFile (index_file* index) {
+    UnmapFile(&index->map);
+    *index = (index_file) { 0 };
+}
+
+// Check whether an index file still describes the given audio file: same size and modification
+// time, and same hashes of its first and last bytes.
+bool IndexFileMatches (index_file* index, char* filename) {
+    file_identity id;
+    if (!ReadFileIdentity(filename, &id, false)) return false;
+    if (id.size != index->header->fileSize || id.mtime != index->header->fileMtime) return false;
+    if (!ReadFileIdentity(filename, &id, true)) return false;
+    return id.headHash == index->header->headHash && id.tailHash == index->header->tailHash;
+}
+
+// Check whether the audio file an index file describes has only had data appended to it since:
+// it's bigger, and the bytes the index file's head and tail hashes covered are unchanged. The
+// index can then be extended with ExtendFrameIndex rather than rebuilt.
+bool IndexFileGrown (index_file* index, char* filename) {
+    file_identity id;
+    uint64_t oldSize = index->header->fileSize;
+    if (!ReadFileIdentity(filename, &id, false) || id.size <= oldSize) return false;
+
+    FILE* stream = fopen(filename, "rb");
+    if (stream == NULL) return false;
+    size_t span  = (oldSize < IDENTITY_HASH_SPAN)? (size_t) oldSize : IDENTITY_HASH_SPAN;
+    bool   grown = HashFileSpan(stream, 0, span) == index->header->headHash &&
+                   HashFileSpan(stream, oldSize - span, span) == index->header->tailHash;
+    fclose(stream);
+    return grown;
+}
+
+// Get the Xing/Info frame header stored in an index file, or INVALID_HEADER if there's none.
+// Its location points into the index file, and only its first xingBytesStored bytes are there,
+// which is enough for ReadXingHeader and ReadLAMETag.
+mpa_header IndexFileXingFrame (index_file* index) {
+    if (index->header->xingFrameSize == 0) return INVALID_HEADER;
+    mpa_header hdr = ReadMPAHeader(index->header->xingFrame);
+    hdr.frameSize  = index->header->xingBytesStored;
+    return hdr;
+}
+
+// Get the frames of an index file from the start of its last block on, as a frame index of their
+// own which ExtendFrameIndex can extend: its frame k is frame *firstFrame + k of the index file,
+// *firstFrame being a multiple of FRAME_INDEX_BLOCK so that the blocks line up, and its far frames
+// are those of the index file from *firstFar on. Nothing before that is copied, however big the
+// index. Free it with FreeFrameIndex.
+frame_index GetIndexFileTail (index_file* index, size_t* firstFrame, size_t* firstFar) {
+    frame_index* idx   = &index->frames;
+    size_t       first = idx->frameCount / FRAME_INDEX_BLOCK * FRAME_INDEX_BLOCK;
+    size_t       count = idx->frameCount - first;
+    size_t       far   = idx->farCount;
+    while (far > 0 && idx->farFrames[far - 1] >= first) far--;
+
+    frame_index tail = { 0 };
+    ReserveFrameIndex(&tail, count + 1);
+    if (count > 0) {
+        tail.blockOffsets[0] = idx->blockOffsets[first / FRAME_INDEX_BLOCK];
+        memcpy(tail.offsetDeltas, idx->offsetDeltas + first, count * sizeof(uint16_t));
+        memcpy(tail.frameSizes,   idx->frameSizes + first,   count * sizeof(uint16_t));
+        memcpy(tail.headerIds,    idx->headerIds + first,    count * sizeof(uint8_t));
+    }
+    for (size_t i = far; i < idx->farCount; i++) AddFarFrame(&tail, idx->farFrames[i] - first, idx->farOffsets[i]);
+    tail.frameCount      = count;
+    tail.streamStart     = idx->streamStart;
+    tail.scanEnd         = idx->scanEnd;
+    tail.headerWordCount = idx->headerWordCount;
+    memcpy(tail.headerWords, idx->headerWords, sizeof(idx->headerWords));
+
+    *firstFrame = first;
+    *firstFar   = far;
+    return tail;
+}
+
+// Write size bytes from data at the given offset of a stream. Returns false on failure.
+bool WriteFileAt (FILE* stream, uint64_t offset, void* data, size_t size) {
+    return size == 0 || (SeekFile(stream, offset) == 0 && fwrite(data, 1, size, stream) == size);
+}
+
+// Update an index file in place for the in-memory file it describes, whose identity is now id and
+// which has only grown since (see IndexFileGrown). tail is the index file's tail, as
+// GetIndexFileTail gave it, extended with the frames appended to the file. Only the entries of
+// tail and the header are written, so this costs the file's growth, not its size. The header goes
+// last, once the entries it counts are on disk, so the index file is left as it was if this fails
+// halfway. Unlike WriteIndexFile, though, this isn't atomic: other processes opening the index file
+// meanwhile may get a mix of the two headers, which VerifyIndexFile catches. Returns false if the
+// index file has no room for the new frames, or on failure.
+bool AppendIndexFile (char* indexName, index_file* index, frame_index* tail, size_t firstFrame,
+        size_t firstFar, mem_file* file, file_identity* id) {
+    index_file_header* old        = index->header;
+    size_t             frameCount = firstFrame + tail->frameCount;
+    size_t             farCount   = firstFar + tail->farCount;
+    if (frameCount > old->frameCapacity || farCount > old->farCapacity) return false;
+
+    // The far frames, numbered as in the whole index.
+    uint64_t* farFrames = (uint64_t*) malloc(tail->farCount * sizeof(uint64_t) + 1);
+    if (farFrames == NULL) {
+        fprintf(stderr, "AppendIndexFile: allocation failed\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < tail->farCount; i++) farFrames[i] = tail->farFrames[i] + firstFrame;
+
+    // The new header, whose running hashes carry on from the complete blocks and far frames the
+    // index file already has.
+    uint8_t header[sizeof(index_file_header)];
+    memcpy(header, old, sizeof(header));
+    index_file_header* hdr = (index_file_header*) header;
+    size_t             kept = old->farCount - firstFar;
+    hdr->fileSize        = id->size;
+    hdr->fileMtime       = id->mtime;
+    hdr->headHash        = id->headHash;
+    hdr->tailHash        = id->tailHash;
+    hdr->apeOffset       = GetAPEv2TagOffset(file);
+    hdr->id3v1Offset     = GetID3v1TagOffset(file);
+    hdr->frameCount      = frameCount;
+    hdr->scanEnd         = tail->scanEnd;
+    hdr->farCount        = farCount;
+    hdr->blocksHash      = HashIndexBlocks(tail, 0, tail->frameCount / FRAME_INDEX_BLOCK, old->blocksHash);
+    hdr->farHash         = HashFarFrames(farFrames + kept, tail->farOffsets + kept, tail->farCount - kept, old->farHash);
+    hdr->headerWordCount = tail->headerWordCount;
+    memcpy(hdr->headerWords, tail->headerWords, sizeof(hdr->headerWords));
+    hdr->checksum        = IndexFileChecksum(header, tail);
+
+    FILE*  stream = fopen(indexName, "r+b");
+    size_t blocks = (tail->frameCount + FRAME_INDEX_BLOCK - 1) / FRAME_INDEX_BLOCK;
+    bool   ok     = stream != NULL &&
+        WriteFileAt(stream, hdr->blockOffsetsPos + firstFrame / FRAME_INDEX_BLOCK * sizeof(uint64_t), tail->blockOffsets, blocks * sizeof(uint64_t)) &&
+        WriteFileAt(stream, hdr->farFramesPos    + firstFar * sizeof(uint64_t),   farFrames,          tail->farCount * sizeof(uint64_t)) &&
+        WriteFileAt(stream, hdr->farOffsetsPos   + firstFar * sizeof(uint64_t),   tail->farOffsets,   tail->farCount * sizeof(uint64_t)) &&
+        WriteFileAt(stream, hdr->offsetDeltasPos + firstFrame * sizeof(uint16_t), tail->offsetDeltas, tail->frameCount * sizeof(uint16_t)) &&
+        WriteFileAt(stream, hdr->frameSizesPos   + firstFrame * sizeof(uint16_t), tail->frameSizes,   tail->frameCount * sizeof(uint16_t)) &&
+        WriteFileAt(stream, hdr->headerIdsPos    + firstFrame * sizeof(uint8_t),  tail->headerIds,    tail->frameCount * sizeof(uint8_t)) &&
+        fflush(stream) == 0;
+#ifndef _WIN32
+    ok = ok && fsync(fileno(stream)) == 0;
+#endif
+    ok = ok && WriteFileAt(stream, 0, header, sizeof(header)) && fflush(stream) == 0;
+    if (stream != NULL) ok = (fclose(stream) == 0) && ok;
+    free(farFrames);
+    return ok;
+}
+
+// Get the duration in seconds of the frames of a frame index.
+double FrameIndexDuration (frame_index* idx) {
+    if (idx->frameCount == 0) return 0.0;
+    mpa_packed_header first = FrameIndexHeader(idx, 0);
+    return (double) idx->frameCount * PackedSamplesPerFrame(first) / PackedSamplerate(first);
+}
+
+// Command: index [-v] FILE...
+// Make sure every given file has an up-to-date sidecar index file, building it if needed, and
+// print a summary of each. The index of a file that has grown since it was indexed (as live
+// recordings do) is extended with the new frames only, in place once it has room for them (see
+// AppendIndexFile); when it doesn't, it's rewritten with room to grow. With -v, the contents of
+// existing index files are verified too (see VerifyIndexFile), and corrupt ones rebuilt.
+int IndexCommand (int argc, char** argv) {
+    bool verify = strcmp(argv[0], "-v") == 0;
+    int  status = 0;
+    for (int i = verify? 1 : 0; i < argc; i++) {
+        char*      indexName = GetIndexFileName(argv[i]);
+        index_file index;
+        bool       opened = OpenIndexFile(indexName, &index);
+        if (opened && verify && !VerifyIndexFile(&index)) {
+            printf("%s: index file corrupt, rebuilding it\n", argv[i]);
+            CloseIndexFile(&index);
+            opened = false;
+        }
+        if (opened && IndexFileMatches(&index, argv[i])) {
+            printf("%s: %llu frames, %.2f s (index up to date)\n", argv[i],
+                (unsigned long long) index.frames.frameCount, FrameIndexDuration(&index.frames));
+            CloseIndexFile(&index);
+        } else {
+            bool          grown = opened && index.frames.frameCount > 0 && IndexFileGrown(&index, argv[i]);
+            double        start = GetTimeSeconds();
+            mem_file      file;
+            file_identity id;
+            if (!MapFileWithIdentity(argv[i], &file, &id)) {
+                fprintf(stderr, "index: failed to open %s\n", argv[i]);
+                status = 1;
+            } else {
+                frame_index idx, total;
+                size_t added = 0;
+                bool   ok    = false;
+                if (grown) {
+                    size_t firstFrame, firstFar;
+                    idx   = GetIndexFileTail(&index, &firstFrame, &firstFar);
+                    added = ExtendFrameIndex(&idx, &file);
+                    ok    = AppendIndexFile(indexName, &index, &idx, firstFrame, firstFar, &file, &id);
+                    total = index.frames;
+                    total.frameCount = firstFrame + idx.frameCount;
+                    if (!ok) {
+                        // No room left for the new frames: rewrite the whole index, with room to grow.
+                        FreeFrameIndex(&idx);
+                        idx = CloneFrameIndex(&index.frames);
+                        ExtendFrameIndex(&idx, &file);
+                        ok = WriteIndexFile(indexName, &file, &id, &idx, true);
+                        total = idx;
+                    }
+                } else {
+                    idx   = BuildFrameIndex(&file);
+                    ok    = WriteIndexFile(indexName, &file, &id, &idx, false);
+                    total = idx;
+                }
+                if (ok) {
+                    printf("%s: %llu frames, %.2f s ", argv[i],
+                        (unsigned long long) total.frameCount, FrameIndexDuration(&total));
+                    if (grown) printf("(%llu frames appended", (unsigned long long) added);
+                    else       printf("(indexed");
+                    printf(" in %.2f ms)\n", (GetTimeSeconds() - start) * 1e3);
+                } else {
+                    fprintf(stderr, "index: failed to write %s\n", indexName);
+                    status = 1;
+                }
+                FreeFrameIndex(&idx);
+                UnmapFile(&file);
+            }
+            CloseIndexFile(&index);
+        }
+        free(indexName);
+    }
+    return status;
+}
+
+// Frame index of a file, taken from its sidecar index file when that's up to date, or built from
+// the file otherwise. frames points into the struct itself, so it must not be copied.
+typedef struct file_frames_s {
+    index_file   index;                 // the sidecar index file, if it's used
+    frame_index  built;                 // the index built from the file, if the sidecar one isn't used
+    frame_index* frames;                // whichever of the two is used
+} file_frames;
+
+// Get the frame index of a file, which is mapped into memory as file. Release it with
+// ReleaseFileFrames. The commands using this go through every frame anyway, so the sidecar index
+// file is verified in full before its offsets are trusted.
+void LoadFileFrames (char* filename, mem_file* file, file_frames* ff) {
+    *ff = (file_frames) { 0 };
+    char* indexName = GetIndexFileName(filename);
+    if (OpenIndexFile(indexName, &ff->index) && IndexFileMatches(&ff->index, filename) &&
+        VerifyIndexFile(&ff->index)) {
+        ff->frames = &ff->index.frames;
+    } else {
+        CloseIndexFile(&ff->index);
+        ff->built  = BuildFrameIndex(file);
+        ff->frames = &ff->built;
+    }
+    free(indexName);
+}
+
+// Release a frame index loaded with LoadFileFrames.
+void ReleaseFileFrames (file_frames* ff) {
+    CloseIndexFile(&ff->index);
+    FreeFrameIndex(&ff->built);
+    ff->frames = NULL;
+}
+
+// Analysis cache: a directory of index files, named after the (device, inode, modification time,
+// size) key of the audio file they describe, so that finding an entry takes nothing but a stat().
+// Entries are still checked against the head and tail hashes of the audio file before use. Each
+// use touches the entry's modification time, and the cache is kept under a size limit by evicting
+// the least recently used entries. Entries are written atomically, so several processes can share
+// a cache directory.
+
+// Get the name of the cache entry for a file with the given identity. Free it when done.
+char* GetCacheEntryName (char* cacheDir, file_identity* id) {
+    uint64_t key[4] = { id->device, id->inode, (uint64_t) id->mtime, id->size };
+    uint64_t hash   = Hash64((uint8_t*) key, sizeof(key), 0);
+
+    size_t length = strlen(cacheDir) + 32;
+    char*  name   = (char*) malloc(length);
+    if (name == NULL) {
+        fprintf(stderr, "GetCacheEntryName: allocation failed\n");
+        exit(1);
+    }
+    snprintf(name, length, "%s/%016llx.mpaidx", cacheDir, (unsigned long long) hash);
+    return name;
+}
+
+// Look a file up in an analysis cache, opening its cached index into index. Returns false if there
+// is no valid entry for it.
+bool LoadCachedIndex (char* cacheDir, char* filename, index_file* index) {
+    file_identity id;
+    if (!ReadFileIdentity(filename, &id, false)) return false;
+
+    char* entryName = GetCacheEntryName(cacheDir, &id);
+    bool  ok        = OpenIndexFile(entryName, index);
+    if (ok && !IndexFileMatches(index, filename)) {
+        CloseIndexFile(index);
+        ok = false;
+    }
+    // Mark the entry as recently used.
+    if (ok) utime(entryName, NULL);
+    free(entryName);
+    return ok;
+}
+
+// Entry of an analysis cache, as EvictCache finds it.
+typedef struct cache_entry_s {
+    char*    name;                      // path of the entry's index file
+    uint64_t size;                      // its size in bytes
+    int64_t  used;                      // when it was last used: its modification time, in nanoseconds
+} cache_entry;
+
+// Order cache entries from least to most recently used, for qsort.
+int CompareCacheEntries (const void* a, const void* b) {
+    int64_t usedA = ((const cache_entry*) a)->used, usedB = ((const cache_entry*) b)->used;
+    return (usedA > usedB) - (usedA < usedB);
+}
+
+// Evict the least recently used entries of an analysis cache until it holds at most maxBytes.
+// Also cleans up temporary files left behind by writers that died more than an hour ago.
+void EvictCache (char* cacheDir, uint64_t maxBytes) {
+#ifndef _WIN32
+    DIR* dir = opendir(cacheDir);
+    if (dir == NULL) return;
+
+    size_t       count = 0, capacity = 0;
+    cache_entry* entries = NULL;
+    uint64_t     total = 0;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        size_t length = strlen(ent->d_name);
+        bool isEntry = length > 7 && strcmp(ent->d_name + length - 7, ".mpaidx") == 0;
+        bool isTemp  = strstr(ent->d_name, ".mpaidx.tmp") != NULL;
+        if (!isEntry && !isTemp) continue;
+
+        size_t nameLength = strlen(cacheDir) + length + 2;
+        char*  name       = (char*) malloc(nameLength);
+        if (name == NULL) break;
+        snprintf(name, nameLength, "%s/%s", cacheDir, ent->d_name);
+
+        struct stat st;
+        if (stat(name, &st) != 0) {
+            free(name);
+            continue;
+        }
+        if (isTemp) {
+            if (time(NULL) - st.st_mtime > 3600) remove(name);
+            free(name);
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity? capacity * 2 : 64;
+            cache_entry* grown = (cache_entry*) realloc(entries, capacity * sizeof(cache_entry));
+            if (grown == NULL) {
+                free(name);
+                break;
+            }
+            entries = grown;
+        }
+        entries[count++] = (cache_entry) { name, (uint64_t) st.st_size, GetModificationTime(&st) };
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    // Evict the oldest entries first. Another process may be evicting them too, which is harmless.
+    if (count > 0) qsort(entries, count, sizeof(cache_entry), CompareCacheEntries);
+    for (size_t i = 0; i < count && total > maxBytes; i++) {
+        remove(entries[i].name);
+        total -= entries[i].size;
+    }
+    for (size_t i = 0; i < count; i++) free(entries[i].name);
+    free(entries);
+#endif
+}
+
+// Store the frame index of the in-memory copy of an audio file, whose identity is id (see
+// MapFileWithIdentity), in an analysis cache, then bring the cache back under maxBytes. Returns
+// false on failure.
+bool StoreCachedIndex (char* cacheDir, mem_file* file, file_identity* id, frame_index* idx,
+        uint64_t maxBytes) {
+    char* entryName = GetCacheEntryName(cacheDir, id);
+    bool  ok        = WriteIndexFile(entryName, file, id, idx, false);
+    free(entryName);
+    if (ok) EvictCache(cacheDir, maxBytes);
+    return ok;
+}
+
+// Command: cache DIR MAXMB FILE...
+// Like the index command, but keep the indexes in the analysis cache DIR, limited to MAXMB
+// megabytes, instead of in sidecar files.
+int CacheCommand (int argc, char** argv) {
+    char*  cacheDir = argv[0];
+    char*  end;
+    double maxMB    = strtod(argv[1], &end);
+    int    status   = 0;
+    if (end == argv[1] || *end != '\0' || !(maxMB > 0.0)) {
+        fprintf(stderr, "cache: expected a size limit of more than 0 MB, got %s\n", argv[1]);
+        return 1;
+    }
+    // Limits beyond what a 64-bit size can tell, infinity included, are no limit at all.
+    double   bytes    = maxMB * 1024 * 1024;
+    uint64_t maxBytes = (bytes < 18446744073709551615.0)? (uint64_t) bytes : UINT64_MAX;
+
+    for (int i = 2; i < argc; i++) {
+        index_file index;
+        if (LoadCachedIndex(cacheDir, argv[i], &index)) {
+            printf("%s: %llu frames, %.2f s (cached)\n", argv[i],
+                (unsigned long long) index.frames.frameCount, FrameIndexDuration(&index.frames));
+            CloseIndexFile(&index);
+            continue;
+        }
+
+        mem_file      file;
+        file_identity id;
+        if (!MapFileWithIdentity(argv[i], &file, &id)) {
+            fprintf(stderr, "cache: failed to open %s\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        frame_index idx = BuildFrameIndex(&file);
+        if (StoreCachedIndex(cacheDir, &file, &id, &idx, maxBytes)) {
+            printf("%s: %llu frames, %.2f s (indexed)\n", argv[i],
+                (unsigned long long) idx.frameCount, FrameIndexDuration(&idx));
+        } else {
+            fprintf(stderr, "cache: failed to store %s in %s\n", argv[i], cacheDir);
+            status = 1;
+        }
+        FreeFrameIndex(&idx);
+        UnmapFile(&file);
+    }
+    return status;
+}
+
+// Result of a seek: the frame to start decoding from to reach a given sample. Sample positions
+// count the samples a decoder outputs from the first audio frame on, encoder delay included.
+typedef struct seek_result_s {
+    bool     valid;                     // whether the seek succeeded
+    bool     exact;                     // whether it came from a frame index, not an estimate
+    uint64_t sample;                    // position sought, clamped to the end of the stream
+    size_t   frame;                     // number of the frame, counting from the first audio frame
+    uint64_t offset;                    // byte offset of the frame in the file
+    uint64_t frameSample;               // position of the frame's first sample
+    size_t   decodeFrame;               // number of the frame a decoder must start from
+    uint64_t decodeOffset;              // byte offset of that frame
+    uint64_t discardSamples;            // samples to discard from the decoder's output from there
+} seek_result;
+
+#define INVALID_SEEK_RESULT ((seek_result) {0})
+
+// Seek to a sample position using a frame index. Every frame of a stream holds the same number of
+// samples, so finding the frame is a division, and the index makes its offset an O(1) lookup.
+// Positions past the end are clamped to the end of the stream, where the last frame ends.
+seek_result SeekFrameIndex (frame_index* idx, uint64_t sample) {
+    if (idx->frameCount == 0) return INVALID_SEEK_RESULT;
+    uint64_t samplesPerFrame = PackedSamplesPerFrame(FrameIndexHeader(idx, 0));
+    uint64_t end             = idx->frameCount * samplesPerFrame;
+
+    seek_result result = { true, true };
+    result.sample = (sample < end)? sample : end;
+    result.frame  = result.sample / samplesPerFrame;
+    if (result.frame >= idx->frameCount) result.frame = idx->frameCount - 1;
+    result.offset      = FrameIndexOffset(idx, result.frame);
+    result.frameSample = result.frame * samplesPerFrame;
+    return result;
+}
+
+// Estimate where a sample position is in a file without a frame index, using the Xing header's
+// seek table (or, lacking one, the average frame size) to guess a byte offset, then moving to the
+// next confirmed frame from there. The frame number is estimated the same way. Positions past the
+// end of the stream, as far as the Xing header tells, are clamped to it.
+seek_result SeekXingTOC (mem_file* file, uint64_t sample) {
+    uint64_t streamStart;
+    mpa_header first = GetFirstStreamHeader(file);
+    mpa_header audio = GetFirstAudioHeader(file, &streamStart);
+    if (!FrameFitsInFile(&first, file) || !FrameFitsInFile(&audio, file)) return INVALID_SEEK_RESULT;
+
+    mpa_packed_header packed = PackMPAHeader(&audio);
+    uint64_t samplesPerFrame = PackedSamplesPerFrame(packed);
+    uint64_t audioStart      = audio.location - file->mem;
+    double   frame           = (double) sample / samplesPerFrame;
+    double   offset;
+
+    xing_header xing = ReadXingHeader(&first);
+    if (xing.valid && (xing.flags & XING_FLAG_FRAMES) && xing.frameCount > 0) {
+        // The seek table gives the byte position, out of 256, of each percent of the stream. Fall
+        // back to spreading the bytes evenly if there's no table.
+        if (frame > xing.frameCount - 1) frame = xing.frameCount - 1;
+        uint64_t bytes   = (xing.flags & XING_FLAG_BYTES)? xing.byteCount : file->size - streamStart;
+        double   percent = 100.0 * frame / xing.frameCount;
+        if (percent < 0.0)   percent = 0.0;
+        if (percent > 99.99) percent = 99.99;
+        if (xing.flags & XING_FLAG_TOC) {
+            int    a  = (int) percent;
+            double fa = xing.toc[a];
+            double fb = (a < 99)? xing.toc[a + 1] : 256.0;
+            offset = streamStart + (fa + (fb - fa) * (percent - a)) / 256.0 * bytes;
+        } else {
+            offset = streamStart + percent / 100.0 * bytes;
+        }
+    } else {
+        // No Xing header: assume the stream is CBR.
+        double frameSize = samplesPerFrame / 8.0 * PackedBitrate(packed) * 1000 / PackedSamplerate(packed);
+        offset = audioStart + frame * frameSize;
+    }
+
+    // Near the end of the stream, the guess can land past its last frame, so back off until a frame
+    // turns up.
+    if (offset < audioStart) offset = audioStart;
+    if (offset >= file->size) offset = file->size - 1;
+    mpa_header header = GetConfirmedHeader(file, file->mem + (uint64_t) offset, 3);
+    while (!header.valid && offset > audioStart) {
+        offset = (offset - audioStart > 4096)? offset - 4096 : audioStart;
+        header = GetConfirmedHeader(file, file->mem + (uint64_t) offset, 3);
+    }
+    if (!header.valid) return INVALID_SEEK_RESULT;
+
+    // Estimate the frame number of the frame found from its position between the first audio frame
+    // and the end of the file, assuming the byte rate is constant locally.
+    seek_result result = { true, false };
+    result.sample = sample;
+    if (xing.valid && (xing.flags & XING_FLAG_FRAMES) && sample > xing.frameCount * samplesPerFrame) {
+        result.sample = xing.frameCount * samplesPerFrame;
+    }
+    result.offset = header.location - file->mem;
+    double found  = frame + (double) (result.offset - (uint64_t) offset) / header.frameSize;
+    result.frame       = (found > 0.0)? (size_t) (found + 0.5) : 0;
+    if (xing.valid && (xing.flags & XING_FLAG_FRAMES) && result.frame >= xing.frameCount) {
+        result.frame = xing.frameCount - 1;
+    }
+    result.frameSample = result.frame * samplesPerFrame;
+    return result;
+}
+
+// Read the header of the frame at offset in file, returning INVALID_HEADER unless the whole frame
+// lies within the file, as it may not when the offset comes from a corrupt sidecar index file.
+mpa_header ReadHeaderInFile (mem_file* file, uint64_t offset) {
+    if (offset > file->size || file->size - offset < 4) return INVALID_HEADER;
+    mpa_header hdr = ReadMPAHeader(file->mem + offset);
+    return FrameFitsInFile(&hdr, file)? hdr : INVALID_HEADER;
+}
+
+// Work out the pre-roll of a seek: which frame a decoder must be fed from, and how many of the
+// samples it decodes to throw away, so that its output is right from the sample sought on. idx
+// may be NULL, in which case earlier frames are found by scanning backwards. The pre-roll never
+// goes back past the first frame, and the samples to discard never run past the end of the frame
+// sought, even when an estimated frame number is off. The result is made invalid if the frame
+// sought isn't within file.
+// - Layer3 frames overlap their neighbours by half a granule, so frame k only comes out right if
+//   frame k - 1 was decoded properly too. That in turn needs the main data of frame k - 1, which
+//   starts main_data_begin bytes back in the main data of the frames before it.
+// - The synthesis filterbank has 480 samples of memory, which is one Layer2 frame or two Layer1
+//   frames.
+void AddPreRoll (seek_result* result, mem_file* file, frame_index* idx) {
+    if (!result->valid) return;
+    mpa_header hdr   = ReadHeaderInFile(file, result->offset);
+    size_t     frame = result->frame;
+    if (!hdr.valid) {
+        *result = INVALID_SEEK_RESULT;
+        return;
+    }
+
+    // Step back one frame at a time, looking frames up in the index if there is one.
+    size_t needed;
+    if      (hdr.mpegLayer == 1) needed = 2;
+    else if (hdr.mpegLayer == 2) needed = 1;
+    else                         needed = 1;
+    while (needed > 0 && frame > 0) {
+        mpa_header prev = idx? ReadHeaderInFile(file, FrameIndexOffset(idx, frame - 1))
+                             : GetPreviousHeader(file, &hdr);
+        if (!prev.valid) break;
+        hdr = prev;
+        frame--;
+        needed--;
+    }
+
+    // Then, for Layer3, keep going back until the frames skipped over hold the whole bit reservoir
+    // the frame before the one sought uses.
+    if (hdr.mpegLayer == 3) {
+        size_t reservoir = GetMainDataBegin(&hdr);
+        while (reservoir > 0 && frame > 0) {
+            mpa_header prev = idx? ReadHeaderInFile(file, FrameIndexOffset(idx, frame - 1))
+                                 : GetPreviousHeader(file, &hdr);
+            if (!prev.valid) break;
+            hdr = prev;
+            frame--;
+            size_t size = GetMainDataSize(&hdr);
+            reservoir = (size < reservoir)? reservoir - size : 0;
+        }
+    }
+
+    uint64_t samplesPerFrame = PackedSamplesPerFrame(PackMPAHeader(&hdr));
+    uint64_t within = (result->sample > result->frameSample)? result->sample - result->frameSample : 0;
+    if (within > samplesPerFrame) within = samplesPerFrame;
+    result->decodeFrame    = frame;
+    result->decodeOffset   = hdr.location - file->mem;
+    result->discardSamples = (result->frame - frame) * samplesPerFrame + within;
+}
+
+// Convert a time in seconds to a sample position, for the stream of the given frame header. Times
+// too far on for a 64-bit position give the last one.
+uint64_t TimeToSample (double seconds, mpa_packed_header hdr) {
+    if (seconds <= 0.0) return 0;
+    double sample = seconds * PackedSamplerate(hdr);
+    return (sample < 18446744073709551615.0)? (uint64_t) sample : UINT64_MAX;
+}
+
+// Command: seek FILE SECONDS...
+// Print where each of the given times starts in FILE, using its sidecar index when it has an
+// up-to-date one and its Xing header otherwise.
+int SeekCommand (int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        char*  end;
+        double seconds = strtod(argv[i], &end);
+        if (end == argv[i] || *end != '\0' || !(seconds >= 0.0)) {
+            fprintf(stderr, "seek: expected a time of at least 0 s, got %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    char*      indexName = GetIndexFileName(argv[0]);
+    index_file index;
+    bool       indexed   = OpenIndexFile(indexName, &index) && IndexFileMatches(&index, argv[0]);
+    free(indexName);
+
+    // The file is needed even with an index, for the side information of the pre-roll frames.
+    mem_file file = MapFileIntoMemory(argv[0]);
+    uint64_t streamStart;
+    mpa_header audio = (file.mem == NULL)? INVALID_HEADER : GetFirstAudioHeader(&file, &streamStart);
+    if (!audio.valid) {
+        fprintf(stderr, "seek: no MPEG audio found in %s\n", argv[0]);
+        CloseIndexFile(&index);
+        UnmapFile(&file);
+        return 1;
+    }
+    mpa_packed_header hdr = PackMPAHeader(&audio);
+
+    for (int i = 1; i < argc; i++) {
+        double   seconds = strtod(argv[i], NULL);
+        uint64_t sample  = TimeToSample(seconds, hdr);
+        double   start   = GetTimeSeconds();
+        seek_result result = indexed? SeekFrameIndex(&index.frames, sample) : SeekXingTOC(&file, sample);
+        AddPreRoll(&result, &file, indexed? &index.frames : NULL);
+        double   elapsed = GetTimeSeconds() - start;
+
+        if (!result.valid) {
+            printf("%.3f s: not found\n", seconds);
+            continue;
+        }
+        printf("%.3f s: frame %llu at %08llx, starting at sample %llu (%s, %.1f us)\n", seconds,
+            (unsigned long long) result.frame, (unsigned long long) result.offset,
+            (unsigned long long) result.frameSample, result.exact? "index" : "estimate",
+            elapsed * 1e6);
+        if (result.sample < sample) {
+            printf("    past the end of the stream: clamped to sample %llu\n", (unsigned long long) result.sample);
+        }
+        printf("    decode from frame %llu at %08llx, discarding %llu samples\n",
+            (unsigned long long) result.decodeFrame, (unsigned long long) result.decodeOffset,
+            (unsigned long long) result.discardSamples);
+    }
+
+    CloseIndexFile(&index);
+    UnmapFile(&file);
+    return 0;
+}
+
+// Get the next number from a xorshift64* pseudo-random generator. The state must not be 0.
+uint64_t NextRandom (uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Statistical estimate of a stream's duration.
+typedef struct duration_estimate_s {
+    bool   valid;                       // whether the estimate succeeded
+    double seconds;                     // estimated duration in seconds
+    double low;                         // lower bound of the 95% confidence interval, in seconds
+    double high;                        // upper bound of the 95% confidence interval, in seconds
+    double frames;                      // estimated number of audio frames
+    double bytesPerFrame;               // estimated mean frame size in bytes
+    int    probes;                      // number of probes that found frames
+} duration_estimate;
+
+#define INVALID_DURATION_ESTIMATE ((duration_estimate) {0})
+
+// Estimate the duration of a stream without walking it: probe it at the given number of random
+// offsets (one in each of as many equal slices of the stream), find a confirmed frame at each, and
+// measure the mean size of the framesPerProbe frames from there. The stream's size divided by the
+// overall mean frame size gives its frame count. The probes' means vary around the overall mean
+// with a standard error of their standard deviation / sqrt(probes), which gives the 95% confidence
+// interval. Only the probed frames are read, however big the file is.
+duration_estimate EstimateDuration (mem_file* file, int probes, int framesPerProbe, uint64_t seed) {
+    uint64_t streamStart;
+    mpa_header audio = GetFirstAudioHeader(file, &streamStart);
+    if (!FrameFitsInFile(&audio, file) || probes < 2) return INVALID_DURATION_ESTIMATE;
+
+    // The stream ends where the tags at the end of the file start.
+    uint64_t audioStart = audio.location - file->mem;
+    uint64_t audioEnd   = GetAPEv2TagOffset(file);
+    if (audioEnd == 0) audioEnd = GetID3v1TagOffset(file);
+    if (audioEnd == 0) audioEnd = file->size;
+    if (audioEnd <= audioStart) return INVALID_DURATION_ESTIMATE;
+    uint64_t audioBytes = audioEnd - audioStart;
+
+    mpa_packed_header packed = PackMPAHeader(&audio);
+    uint8_t* lastLoc = file->mem + file->size - 4;
+    uint64_t state   = seed? seed : 0x9E3779B97F4A7C15ULL;
+    double   sum = 0.0, sumSquares = 0.0;
+    int      found = 0;
+
+    for (int i = 0; i < probes; i++) {
+        double   slice  = (double) audioBytes / probes;
+        double   u      = (NextRandom(&state) >> 11) / 9007199254740992.0;
+        uint64_t offset = audioStart + (uint64_t) ((i + u) * slice);
+
+        mpa_header header = GetConfirmedHeader(file, file->mem + offset, 3);
+        if (!header.valid || !PackedSameStream(PackMPAHeader(&header), packed)) continue;
+
+        uint64_t bytes  = 0;
+        int      frames = 0;
+        while (frames < framesPerProbe && FrameFitsInFile(&header, file) &&
+                (uint64_t) (header.location - file->mem) < audioEnd) {
+            bytes += header.frameSize;
+            frames++;
+            header = GetNextHeader(&header, lastLoc);
+        }
+        if (frames == 0) continue;
+
+        double mean = (double) bytes / frames;
+        sum        += mean;
+        sumSquares += mean * mean;
+        found++;
+    }
+    if (found < 2) return INVALID_DURATION_ESTIMATE;
+
+    duration_estimate est = { true };
+    double mean      = sum / found;
+    double variance  = (sumSquares - sum * sum / found) / (found - 1);
+    double error     = 1.96 * sqrt((variance > 0.0)? variance : 0.0) / sqrt((double) found);
+    double secondsPerFrame = (double) PackedSamplesPerFrame(packed) / PackedSamplerate(packed);
+
+    est.probes        = found;
+    est.bytesPerFrame = mean;
+    est.frames        = audioBytes / mean;
+    est.seconds       = est.frames * secondsPerFrame;
+    est.low           = audioBytes / (mean + error) * secondsPerFrame;
+    est.high          = (mean > error)? audioBytes / (mean - error) * secondsPerFrame : INFINITY;
+    return est;
+}
+
+// Most probes the estimate command takes: far more than its confidence interval needs, and as
+// many frames as short files have.
+const long ESTIMATE_MAX_PROBES = 65536;
+
+// Command: estimate FILE [PROBES]
+// Estimate the duration of FILE from PROBES (default 64, at least 2) random probes, and compare
+// the estimate with what its Xing header says, if it has one.
+int EstimateCommand (int argc, char** argv) {
+    long probes = 64;
+    if (argc >= 2) {
+        char* end;
+        probes = strtol(argv[1], &end, 10);
+        if (end == argv[1] || *end != '\0' || probes < 2) {
+            fprintf(stderr, "estimate: expected a number of probes of at least 2, got %s\n", argv[1]);
+            return 1;
+        }
+        if (probes > ESTIMATE_MAX_PROBES) probes = ESTIMATE_MAX_PROBES;
+    }
+
+    mem_file file = MapFileIntoMemory(argv[0]);
+    if (file.mem == NULL) {
+        fprintf(stderr, "estimate: failed to open %s\n", argv[0]);
+        return 1;
+    }
+
+    double start = GetTimeSeconds();
+    duration_estimate est = EstimateDuration(&file, (int) probes, 16, 1);
+    double elapsed = GetTimeSeconds() - start;
+    if (!est.valid) {
+        fprintf(stderr, "estimate: no MPEG audio found in %s\n", argv[0]);
+        UnmapFile(&file);
+        return 1;
+    }
+
+    printf("%s: %.2f s (95%% confidence: %.2f - %.2f s)\n", argv[0], est.seconds, est.low, est.high);
+    printf("    %.0f frames of %.1f bytes on average, from %d probes in %.2f ms\n",
+        est.frames, est.bytesPerFrame, est.probes, elapsed * 1e3);
+
+    mpa_header first = GetFirstStreamHeader(&file);
+    xing_header xing = FrameFitsInFile(&first, &file)? ReadXingHeader(&first) : INVALID_XING_HEADER;
+    if (xing.valid && (xing.flags & XING_FLAG_FRAMES)) {
+        mpa_packed_header packed = PackMPAHeader(&first);
+        printf("    Xing header: %.2f s\n",
+            (double) xing.frameCount * PackedSamplesPerFrame(packed) / PackedSamplerate(packed));
+    }
+    UnmapFile(&file);
+    return 0;
+}
+
+// Append size bytes, starting at the given offset of the file in, to the file out. On Linux this
+// uses copy_file_range(), which lets the kernel (or the filesystem, by sharing extents) copy the
+// data without it going through user space. Elsewhere, or when the two files don't support it, the
+// data is copied through a buffer. Returns false on failure.
+bool CopyFileRange (FILE* in, uint64_t offset, FILE* out, uint64_t size) {
+    if (fflush(out) != 0 || fseek(out, 0, SEEK_END) != 0) return false;
+#ifdef __linux__
+    // copy_file_range() writes at out's file descriptor offset, which is where the stream is now
+    // that it's flushed.
+    off_t inOffset = (off_t) offset;
+    while (size > 0) {
+        ssize_t copied = copy_file_range(fileno(in), &inOffset, fileno(out), NULL, size, 0);
+        if (copied <= 0) break;
+        size -= copied;
+    }
+    offset = (uint64_t) inOffset;
+    if (size == 0) return fseek(out, 0, SEEK_END) == 0;
+#endif
+
+    static uint8_t buffer[65536];
+    if (SeekFile(in, offset) != 0) return false;
+    while (size > 0) {
+        size_t chunk = (size < sizeof(buffer))? size : sizeof(buffer);
+        if (fread(buffer, 1, chunk, in) != chunk || fwrite(buffer, 1, chunk, out) != chunk) return false;
+        size -= chunk;
+    }
+    return true;
+}
+
+// Fill in a Xing TOC for count frames of an index, starting at frame first: entry i is the
+// position of the frame where i% of the playback time starts, as a fraction of byteCount out of
+// 256. Positions are counted from the Xing frame, which is xingSize bytes long and sits right
+// before frame first.
+void BuildXingTOC (frame_index* idx, size_t first, size_t count, size_t xingSize, uint64_t byteCount,
+        uint8_t* toc) {
+    uint64_t audioStart = FrameIndexOffset(idx, first);
+    for (int i = 0; i < 100; i++) {
+        size_t   k        = first + (size_t) ((uint64_t) i * count / 100);
+        uint64_t position = xingSize + FrameIndexOffset(idx, k) - audioStart;
+        uint64_t entry    = position * 256 / byteCount;
+        toc[i] = (entry > 255)? 255 : (uint8_t) entry;
+    }
+}
+
+// Choose the header of a new Xing frame for a stream starting with the given audio header: the
+// same stream, unpadded and without CRC protection, at the audio's bitrate if the stream is CBR
+// and otherwise at the lowest bitrate whose frames have room for the Xing header (and LAME tag).
+// Returns a header with a word of 0 if no bitrate is big enough.
+mpa_packed_header ChooseXingFrameHeader (mpa_packed_header audio, bool cbr, bool withLAMETag) {
+    mpa_packed_header hdr = { (audio.word & ~0b00000000000000000000001000110000) |
+                                             0b00000000000000010000000000000000 };
+    size_t minSize = GetXingFrameMinSize(hdr, withLAMETag);
+    if (cbr && PackedFrameSize(hdr) >= minSize) return hdr;
+
+    for (uint32_t bitrateBits = 1; bitrateBits < 15; bitrateBits++) {
+        hdr.word = (hdr.word & ~0b00000000000000001111000000000000) | (bitrateBits << 12);
+        if (PackedFrameSize(hdr) >= minSize) return hdr;
+    }
+    return (mpa_packed_header) { 0 };
+}
+
+// Rebuild a file's Xing/Info header from a scan of its frames: an exact frame and byte count and
+// a 100-point TOC, tagged "Info" if the stream turns out to be CBR and "Xing" otherwise, whatever
+// the old header said. Any LAME tag is kept, with its music length and CRCs updated. If the file
+// already starts with a Xing frame big enough for the new header, it is overwritten in place;
+// otherwise the file is rewritten with a new Xing frame in place of the old one (if any), the rest
+// of it being copied with CopyFileRange. Returns false on failure.
+bool RepairXingHeader (char* filename) {
+    mem_file file = MapFileIntoMemory(filename);
+    if (file.mem == NULL) {
+        fprintf(stderr, "xing: failed to open %s\n", filename);
+        return false;
+    }
+    frame_index idx = BuildFrameIndex(&file);
+    if (idx.frameCount == 0 || PackedMPEGLayer(FrameIndexHeader(&idx, 0)) != 3) {
+        fprintf(stderr, "xing: no Layer3 stream found in %s\n", filename);
+        FreeFrameIndex(&idx);
+        UnmapFile(&file);
+        return false;
+    }
+
+    uint64_t audioStart = FrameIndexOffset(&idx, 0);
+    uint64_t audioEnd   = FrameIndexOffset(&idx, idx.frameCount - 1) +
+                          FrameIndexSize(&idx, idx.frameCount - 1);
+    mpa_packed_header audio = FrameIndexHeader(&idx, 0);
+    bool cbr = true;
+    for (size_t k = 1; k < idx.frameCount && cbr; k++) {
+        cbr = PackedBitrate(FrameIndexHeader(&idx, k)) == PackedBitrate(audio);
+    }
+
+    // Keep what can be kept from the old Xing frame, if any.
+    mpa_header  first   = GetFirstStreamHeader(&file);
+    xing_header oldXing = (idx.streamStart < audioStart)? ReadXingHeader(&first) : INVALID_XING_HEADER;
+    lame_tag    lame    = ReadLAMETag(&first, &oldXing);
+    uint8_t     lameTag[LAME_TAG_SIZE];
+    if (lame.valid) memcpy(lameTag, lame.location, LAME_TAG_SIZE);
+
+    mpa_packed_header xingHdr = { ReadBE32(first.location) };
+    bool inPlace = oldXing.valid &&
+                   (size_t) first.frameSize >= GetXingFrameMinSize(xingHdr, lame.valid);
+    if (!inPlace) xingHdr = ChooseXingFrameHeader(audio, cbr, lame.valid);
+
+    xing_header xing = { true };
+    size_t xingSize  = PackedFrameSize(xingHdr);
+    xing.isInfo      = cbr;
+    xing.frameCount  = (uint32_t) idx.frameCount;
+    xing.byteCount   = (uint32_t) (xingSize + audioEnd - audioStart);
+    xing.quality     = (oldXing.flags & XING_FLAG_QUALITY)? oldXing.quality : 0;
+    BuildXingTOC(&idx, 0, idx.frameCount, xingSize, xing.byteCount, xing.toc);
+    if (lame.valid) {
+        SetLAMETagMusic(lameTag, xing.byteCount, CRC16LAME(file.mem + audioStart, audioEnd - audioStart, 0));
+    }
+
+    uint8_t* frame = (uint8_t*) malloc(xingSize? xingSize : 1);
+    if (frame == NULL) {
+        fprintf(stderr, "RepairXingHeader: allocation failed\n");
+        exit(1);
+    }
+    bool ok = WriteXingFrame(frame, xingHdr, &xing, lame.valid? lameTag : NULL) == xingSize && xingSize > 0;
+    uint64_t fileSize    = file.size;
+    uint64_t streamStart = idx.streamStart;
+    FreeFrameIndex(&idx);
+    UnmapFile(&file);
+
+    if (ok && inPlace) {
+        FILE* stream = fopen(filename, "r+b");
+        ok = stream != NULL && SeekFile(stream, streamStart) == 0 &&
+             fwrite(frame, 1, xingSize, stream) == xingSize;
+        if (stream != NULL) ok = (fclose(stream) == 0) && ok;
+    } else if (ok) {
+        // Everything before the stream and from its first audio frame on is copied as it is.
+        FILE* in = fopen(filename, "rb");
+        char* tmpName;
+        FILE* out = (in != NULL)? StartAtomicWrite(filename, &tmpName) : NULL;
+        ok = out != NULL;
+        if (ok) {
+#ifndef _WIN32
+            struct stat st;
+            if (fstat(fileno(in), &st) == 0) fchmod(fileno(out), st.st_mode & 07777);
+#endif
+            ok = CopyFileRange(in, 0, out, streamStart) &&
+                 fwrite(frame, 1, xingSize, out) == xingSize &&
+                 CopyFileRange(in, audioStart, out, fileSize - audioStart);
+            ok = FinishAtomicWrite(out, tmpName, filename, ok);
+        }
+        if (in != NULL) fclose(in);
+    }
+    free(frame);
+
+    if (!ok) {
+        fprintf(stderr, "xing: failed to write %s\n", filename);
+        return false;
+    }
+    printf("%s: %s %s header (%u frames, %u bytes%s)%s\n", filename,
+        inPlace? "updated" : "wrote new", xing.isInfo? "Info" : "Xing", xing.frameCount,
+        xing.byteCount, lame.valid? ", LAME tag kept" : "", inPlace? "" : ", file rewritten");
+    return true;
+}
+
+// Command: xing FILE...
+// Regenerate the Xing/Info header of each FILE from a scan of its frames.
+int XingCommand (int argc, char** argv) {
+    int failures = 0;
+    for (int i = 0; i < argc; i++) {
+        if (!RepairXingHeader(argv[i])) failures++;
+    }
+    return failures? 1 : 0;
+}
+
+// Follow a file that's being written, like "tail -f": print a record for each audio frame as soon
+// as all of its bytes are in the file, until it's deleted, renamed or hasn't grown for idleTimeout
+// seconds (never, if idleTimeout is 0). Only the bytes appended since the last frame are read; the
+// buffer holds nothing but a partial frame between reads. On Linux, inotify wakes the walk up as
+// soon as the file is written to; elsewhere the file is polled every millisecond.
+// Latency is measured from the file's modification time to when a frame's record is printed. The
+// kernel stamps files with a coarse clock (ticks of up to 10 ms), so this overestimates it.
+bool FollowFile (char* filename, double idleTimeout) {
+#ifdef _WIN32
+    fprintf(stderr, "follow: not supported on this platform\n");
+    return false;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "follow: failed to open %s\n", filename);
+        return false;
+    }
+    int watch = -1;
+#ifdef __linux__
+    watch = inotify_init1(IN_CLOEXEC);
+    if (watch >= 0 && inotify_add_watch(watch, filename,
+            IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        close(watch);
+        watch = -1;
+    }
+#endif
+    fprintf(stderr, "Following %s (%s)\n", filename, (watch >= 0)? "inotify" : "polling");
+
+    mem_file buffer    = { 0 };             // unconsumed bytes, starting at file offset bufferPos
+    size_t   capacity  = 65536;
+    uint64_t bufferPos = 0;
+    uint64_t skip      = 0;                 // bytes still to drop, for the ID3v2 tag
+    bool     started   = false;             // whether the ID3v2 tag and Xing frame were handled
+    uint64_t frames    = 0;
+    double   seconds   = 0.0;
+    double   latencySum = 0.0, latencyMax = 0.0;
+    double   lastGrowth = GetTimeSeconds();
+    bool     done       = false;
+    buffer.mem = (uint8_t*) malloc(capacity);
+    if (buffer.mem == NULL) {
+        fprintf(stderr, "FollowFile: allocation failed\n");
+        exit(1);
+    }
+
+    while (!done) {
+        // Read whatever has been appended.
+        bool grew = false;
+        for (;;) {
+            if (buffer.size == capacity) {
+                capacity *= 2;
+                buffer.mem = (uint8_t*) realloc(buffer.mem, capacity);
+                if (buffer.mem == NULL) {
+                    fprintf(stderr, "FollowFile: allocation failed\n");
+                    exit(1);
+                }
+            }
+            ssize_t got = read(fd, buffer.mem + buffer.size, capacity - buffer.size);
+            if (got <= 0) break;
+            buffer.size += got;
+            grew = true;
+        }
+
+        if (grew) {
+            double now = GetTimeSeconds();
+            lastGrowth = now;
+            file_identity id;
+            ReadFileIdentity(filename, &id, false);
+            double written = id.mtime / 1e9;
+
+            // Drop the ID3v2 tag at the start of the file, once its header is in.
+            if (!started && skip == 0 && bufferPos == 0 && buffer.size >= 10) {
+                skip = GetID3v2TagSize(buffer.mem);
+            }
+            size_t dropped = (skip < buffer.size)? (size_t) skip : buffer.size;
+            skip -= dropped;
+
+            // Walk the complete frames, exactly like a GetFirstHeader/GetNextHeader walk would.
+            uint8_t*   consumed = buffer.mem + dropped;
+            mpa_header header   = INVALID_HEADER;
+            if (buffer.size >= dropped + 4 && (started || buffer.size >= 10 || bufferPos > 0)) {
+                header = GetFirstHeader(consumed, buffer.mem + buffer.size - 4);
+            }
+            size_t emitted = 0;
+            while (FrameFitsInFile(&header, &buffer)) {
+                // The Xing frame, if any, holds no audio.
+                if (started || !ReadXingHeader(&header).valid) {
+                    mpa_packed_header packed = PackMPAHeader(&header);
+                    printf("frame %llu at %08llx: %4d bytes, %3d kbps, %.3f s\n",
+                        (unsigned long long) frames,
+                        (unsigned long long) (bufferPos + (header.location - buffer.mem)),
+                        (int) header.frameSize, header.bitrate, seconds);
+                    frames++;
+                    emitted++;
+                    seconds += (double) PackedSamplesPerFrame(packed) / PackedSamplerate(packed);
+                }
+                started  = true;
+                consumed = header.location + header.frameSize;
+                header   = GetNextHeader(&header, buffer.mem + buffer.size - 4);
+            }
+            // Keep the partial frame, or the last 3 bytes if there's no header in sight yet.
+            if (header.valid)                                   consumed = header.location;
+            else if (consumed + 3 < buffer.mem + buffer.size)   consumed = buffer.mem + buffer.size - 3;
+
+            if (emitted > 0) {
+                fflush(stdout);
+                double latency = GetTimeSeconds() - written;
+                latencySum += latency * emitted;
+                if (latency > latencyMax) latencyMax = latency;
+            }
+            size_t kept = buffer.mem + buffer.size - consumed;
+            memmove(buffer.mem, consumed, kept);
+            bufferPos  += buffer.size - kept;
+            buffer.size = kept;
+        }
+
+        // Wait for the next write.
+        double remaining = (idleTimeout > 0.0)? lastGrowth + idleTimeout - GetTimeSeconds() : 1.0;
+        if (remaining <= 0.0) break;
+        int timeout = (int) (remaining * 1000) + 1;
+        if (watch >= 0) {
+            struct pollfd pfd = { watch, POLLIN, 0 };
+            if (poll(&pfd, 1, timeout) > 0) {
+                char events[4096];
+                ssize_t got = read(watch, events, sizeof(events));
+                for (ssize_t i = 0; i < got; ) {
+                    struct inotify_event* event = (struct inotify_event*) (events + i);
+                    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) done = true;
+                    i += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        } else {
+            poll(NULL, 0, 1);
+        }
+    }
+
+    fprintf(stderr, "%llu frames, %.2f s; write-to-emit latency: %.2f ms mean, %.2f ms max\n",
+        (unsigned long long) frames, seconds,
+        frames? latencySum / frames * 1e3 : 0.0, latencyMax * 1e3);
+    free(buffer.mem);
+    if (watch >= 0) close(watch);
+    close(fd);
+    return true;
+#endif
+}
+
+// Command: follow FILE [IDLE_SECONDS]
+// Print each audio frame of FILE as soon as it's written, stopping after IDLE_SECONDS without any
+// (never, if it's 0 or not given).
+int FollowCommand (int argc, char** argv) {
+    double idleTimeout = 0.0;
+    if (argc >= 2) {
+        char* end;
+        idleTimeout = strtod(argv[1], &end);
+        if (end == argv[1] || *end != '\0' || !(idleTimeout >= 0.0)) {
+            fprintf(stderr, "follow: expected an idle time of at least 0 s, got %s\n", argv[1]);
+            return 1;
+        }
+    }
+    return FollowFile(argv[0], idleTimeout)? 0 : 1;
+}
+
+// Command: sideinfo FILE
+// Read the side information of every frame of FILE, as part of a frame walk, and print statistics
+// about it, along with how much the side information costs over walking the headers alone. Also
+// checks that every frame's main data fits in its frame and the bit reservoir.
+int SideInfoCommand (int argc, char** argv) {
+    mem_file file = MapFileIntoMemory(argv[0]);
+    if (file.mem == NULL) {
+        fprintf(stderr, "sideinfo: failed to open %s\n", argv[0]);
+        return 1;
+    }
+    uint64_t streamStart;
+    mpa_header first   = GetFirstAudioHeader(&file, &streamStart);
+    uint8_t*   lastLoc = file.mem + file.size - 4;
+    if (!FrameFitsInFile(&first, &file) || first.mpegLayer != 3) {
+        fprintf(stderr, "sideinfo: no Layer3 stream found in %s\n", argv[0]);
+        UnmapFile(&file);
+        return 1;
+    }
+
+    // Time both walks over several rounds, keeping the best of each.
+    const int rounds = 5;
+    double    headerTime = 1e9, sideInfoTime = 1e9;
+    uint64_t  frames = 0, bytes = 0, checksum = 0;
+    for (int round = 0; round < rounds; round++) {
+        double start = GetTimeSeconds();
+        frames = bytes = 0;
+        for (mpa_header hdr = first; FrameFitsInFile(&hdr, &file); hdr = GetNextHeader(&hdr, lastLoc)) {
+            frames++;
+            bytes += hdr.frameSize;
+        }
+        double middle = GetTimeSeconds();
+        for (mpa_header hdr = first; FrameFitsInFile(&hdr, &file); hdr = GetNextHeader(&hdr, lastLoc)) {
+            side_info si = ReadSideInfo(&hdr);
+            checksum += si.mainDataBegin + si.gr[0][0].part23Length + si.gr[si.granules - 1][0].globalGain;
+        }
+        double end = GetTimeSeconds();
+        if (middle - start < headerTime)   headerTime   = middle - start;
+        if (end - middle   < sideInfoTime) sideInfoTime = end - middle;
+    }
+
+    // Gather the statistics.
+    uint64_t blockTypes[4] = { 0 }, mixedBlocks = 0, granules = 0, overflows = 0;
+    uint64_t gainSum = 0, part23Sum = 0, reservoirSum = 0;
+    size_t   reservoir = 0;
+    for (mpa_header hdr = first; FrameFitsInFile(&hdr, &file); hdr = GetNextHeader(&hdr, lastLoc)) {
+        side_info si = ReadSideInfo(&hdr);
+        if (!si.valid) continue;
+        size_t bits = 0;
+        for (int gr = 0; gr < si.granules; gr++) {
+            for (int ch = 0; ch < si.channels; ch++) {
+                granule_info* g = &si.gr[gr][ch];
+                blockTypes[g->windowSwitching? g->blockType : 0]++;
+                mixedBlocks += g->mixedBlock;
+                gainSum     += g->globalGain;
+                bits        += g->part23Length;
+                granules++;
+            }
+        }
+        // The main data starts mainDataBegin bytes back, and must end within this frame.
+        size_t size = GetMainDataSize(&hdr);
+        if (si.mainDataBegin > reservoir || bits > (si.mainDataBegin + size) * 8) overflows++;
+        part23Sum    += bits;
+        reservoirSum += si.mainDataBegin;
+        // What this frame doesn't use is left for the next ones, up to what main_data_begin can
+        // reach back.
+        size_t used  = (bits + 7) / 8;
+        reservoir    = (si.mainDataBegin + size > used)? si.mainDataBegin + size - used : 0;
+        size_t maxReservoir = (hdr.mpegVersion == MPEG_V1)? 511 : 255;
+        if (reservoir > maxReservoir) reservoir = maxReservoir;
+    }
+
+    printf("%s: %llu frames, %llu granule channels\n", argv[0],
+        (unsigned long long) frames, (unsigned long long) granules);
+    printf("    Block types: %llu normal, %llu start, %llu short (%llu mixed), %llu stop\n",
+        (unsigned long long) blockTypes[0], (unsigned long long) blockTypes[1],
+        (unsigned long long) blockTypes[2], (unsigned long long) mixedBlocks,
+        (unsigned long long) blockTypes[3]);
+    printf("    Mean global gain %.1f, %.0f main data bits per granule channel, %.0f reservoir bytes used per frame\n",
+        (double) gainSum / granules, (double) part23Sum / granules, (double) reservoirSum / frames);
+    printf("    Frames whose main data doesn't fit: %llu\n", (unsigned long long) overflows);
+    printf("    Header walk: %.0f MB/s; with side information: %.0f MB/s, %.1f ns per frame (checksum %llu)\n",
+        bytes / headerTime / 1e6, bytes / sideInfoTime / 1e6, sideInfoTime / frames * 1e9,
+        (unsigned long long) checksum);
+    UnmapFile(&file);
+    return 0;
+}
+
+// Command: huffman FILE
+// Decode the Huffman data of every granule of FILE, timing it over several rounds, and print how
+// fast it goes in Mbit/s of Huffman data, along with how many granules don't end where their
+// part2_3_length says, which only happens in broken streams.
+int HuffmanCommand (int argc, char** argv) {
+    mem_file file = MapFileIntoMemory(argv[0]);
+    if (file.mem == NULL) {
+        fprintf(stderr, "huffman: failed to open %s\n", argv[0]);
+        return 1;
+    }
+    uint64_t   streamStart;
+    mpa_header first   = GetFirstAudioHeader(&file, &streamStart);
+    uint8_t*   lastLoc = file.mem + file.size - 4;
+    if (!FrameFitsInFile(&first, &file) || first.mpegLayer != 3) {
+        fprintf(stderr, "huffman: no Layer3 stream found in %s\n", argv[0]);
+        UnmapFile(&file);
+        return 1;
+    }
+
+    const int rounds = 5;
+    double    bestTime = 1e9;
+    uint64_t  granules = 0, huffmanBits = 0, mismatches = 0, overruns = 0, skipped = 0, checksum = 0;
+    main_data md;
+    int16_t   values[576];
+    GetHuffmanLookup(0);
+    for (int round = 0; round < rounds; round++) {
+        granules = huffmanBits = mismatches = overruns = skipped = checksum = 0;
+        md.size = 0;
+        scalefactors sf[2] = { 0 };
+        double start = GetTimeSeconds();
+        for (mpa_header hdr = first; FrameFitsInFile(&hdr, &file); hdr = GetNextHeader(&hdr, lastLoc)) {
+            side_info  si = ReadSideInfo(&hdr);
+            bit_reader br;
+            if (!si.valid || !LoadMainData(&md, &hdr, &si, &br)) {
+                skipped++;
+                continue;
+            }
+            for (int gr = 0; gr < si.granules; gr++) {
+                for (int ch = 0; ch < si.channels; ch++) {
+                    size_t part23End = br.pos + si.gr[gr][ch].part23Length;
+                    ReadScalefactors(&br, &hdr, &si, gr, ch, &sf[ch]);
+                    huffmanBits += part23End - br.pos;
+                    int count = DecodeHuffman(&br, part23End, &hdr, &si.gr[gr][ch], values);
+                    if (count < 0)               overruns++;
+                    else if (br.pos != part23End) mismatches++;
+                    checksum += values[0] + values[count > 1? count - 1 : 0];
+                    br.pos = part23End;
+                    granules++;
+                }
+            }
+        }
+        double elapsed = GetTimeSeconds() - start;
+        if (elapsed < bestTime) bestTime = elapsed;
+    }
+
+    printf("%s: %llu granule channels, %llu frames skipped\n", argv[0],
+        (unsigned long long) granules, (unsigned long long) skipped);
+    printf("    Granules whose big values overrun their data: %llu; ending elsewhere than their data: %llu\n",
+        (unsigned long long) overruns, (unsigned long long) mismatches);
+    printf("    Huffman decoding: %.1f Mbit/s, %.0f ns per granule channel (checksum %llu)\n",
+        huffmanBits / bestTime / 1e6, bestTime / granules * 1e9, (unsigned long long) checksum);
+    UnmapFile(&file);
+    return 0;
+}
+
+// Granule the filterbank benchmarks run on: its Huffman decoded values scaled by global_gain alone,
+// which gives the kernels realistic block types and magnitudes without a full decoder.
+typedef struct rough_granule_s {
+    float   xr[2][576];                 // spectral values of each channel
+    uint8_t blockTypes[SUBBAND_LANES];  // block type of each lane, from GetIMDCTBlockTypes
+    int     channels;
+} rough_granule;
+
+// Fill up to capacity rough granules from the frames of file from *hdr on, and move it to the
+// first frame left. Returns how many there are, adding the frames read or skipped to the counts.
+int LoadRoughGranules (mem_file* file, mpa_header* hdr, main_data* md, rough_granule* granules,
+        int capacity, uint64_t* frames, uint64_t* skipped) {
+    uint8_t* lastLoc = file->mem + file->size - 4;
+    int16_t  values[576];
+    int      count = 0;
+    for (; count + 2 <= capacity && FrameFitsInFile(hdr, file); *hdr = GetNextHeader(hdr, lastLoc)) {
+        side_info  si = ReadSideInfo(hdr);
+        bit_reader br;
+        if (!si.valid || !LoadMainData(md, hdr, &si, &br)) {
+            (*skipped)++;
+            continue;
+        }
+        scalefactors sf;
+        for (int gr = 0; gr < si.granules; gr++) {
+            rough_granule* g = &granules[count++];
+            g->channels = si.channels;
+            GetIMDCTBlockTypes(hdr, &si, gr, g->blockTypes);
+            for (int ch = 0; ch < si.channels; ch++) {
+                size_t part23End = br.pos + si.gr[gr][ch].part23Length;
+                ReadScalefactors(&br, hdr, &si, gr, ch, &sf);
+                DecodeHuffman(&br, part23End, hdr, &si.gr[gr][ch], values);
+                br.pos = part23End;
+                float scale = (float) pow(2, (si.gr[gr][ch].globalGain - 210) / 4.0);
+                for (int i = 0; i < 576; i++) {
+                    float magnitude = (float) pow(abs(values[i]), 4.0 / 3) * scale;
+                    g->xr[ch][i] = (values[i] < 0)? -magnitude : magnitude;
+                }
+            }
+        }
+        (*frames)++;
+    }
+    return count;
+}
+
+// Number of granules the filterbank benchmarks load at a time, to then time each kernel on.
+#define ROUGH_GRANULE_BATCH 256
+
+// Command: imdct FILE
+// Run the hybrid filterbank of every granule of FILE through both InverseMDCT and
+// InverseMDCTReference, and print how fast each goes and how far apart their outputs are.
+int ImdctCommand (int argc, char** argv) {
+    mem_file file = MapFileIntoMemory(argv[0]);
+    if (file.mem == NULL) {
+        fprintf(stderr, "imdct: failed to open %s\n", argv[0]);
+        return 1;
+    }
+    uint64_t   streamStart;
+    mpa_header hdr = GetFirstAudioHeader(&file, &streamStart);
+    if (!FrameFitsInFile(&hdr, &file) || hdr.mpegLayer != 3) {
+        fprintf(stderr, "imdct: no Layer3 stream found in %s\n", argv[0]);
+        UnmapFile(&file);
+        return 1;
+    }
+
+    // Each kernel runs on a batch from the same state, the overlap of each channel count.
+    rough_granule* batch = (rough_granule*) malloc(ROUGH_GRANULE_BATCH * sizeof(rough_granule));
+    float (*outputs)[2][18][SUBBAND_LANES] = malloc(ROUGH_GRANULE_BATCH * sizeof(*outputs));
+    float overlaps[2][18][SUBBAND_LANES] = { 0 }, states[2][18][SUBBAND_LANES];
+
+    uint64_t  frames = 0, granules = 0, skipped = 0;
+    double    times[2] = { 0 }, maxError = 0, maxValue = 0;
+    uint32_t  samplerate = hdr.samplerate;
+    main_data md = { .size = 0 };
+    int count;
+    while ((count = LoadRoughGranules(&file, &hdr, &md, batch, ROUGH_GRANULE_BATCH, &frames, &skipped)) > 0) {
+        for (int kernel = 0; kernel < 2; kernel++) {
+            memcpy(states, overlaps, sizeof(states));
+            double start = GetTimeSeconds();
+            for (int i = 0; i < count; i++) {
+                rough_granule* g = &batch[i];
+                if (kernel == 0) InverseMDCTReference(g->xr, g->channels, g->blockTypes, states[g->channels - 1], outputs[i][0]);
+                else             InverseMDCT(g->xr, g->channels, g->blockTypes, states[g->channels - 1], outputs[i][1]);
+            }
+            times[kernel] += GetTimeSeconds() - start;
+        }
+        memcpy(overlaps, states, sizeof(states));
+        for (int i = 0; i < count; i++) {
+            for (int n = 0; n < 18; n++) {
+                for (int lane = 0; lane < batch[i].channels * 32; lane++) {
+                    double value = fabs(outputs[i][0][n][lane]);
+                    double error = fabs(outputs[i][1][n][lane] - outputs[i][0][n][lane]);
+                    if (value > maxValue) maxValue = value;
+                    if (error > maxError) maxError = error;
+                }
+            }
+        }
+        granules += count;
+    }
+
+    double seconds = granules * 576.0 / samplerate;
+    printf("%s: %llu frames, %llu granules, %llu frames skipped\n", argv[0],
+        (unsigned long long) frames, (unsigned long long) granules, (unsigned long long) skipped);
+    printf("    Reference: %.0f frames/s, %.0fx real time\n", frames / times[0], seconds / times[0]);
+    printf("    Vector:    %.0f frames/s, %.0fx real time, %.1fx the reference\n",
+        frames / times[1], seconds / times[1], times[0] / times[1]);
+    printf("    Largest difference: %g, against outputs up to %g\n", maxError, maxValue);
+    free(batch);
+    free(outputs);
+    UnmapFile(&file);
+    return 0;
+}
+
+// Command: synthesis FILE
+// Run the polyphase filterbank on the subband samples of every granule of FILE through both
+// Synthesize and SynthesizeReference, and print how fast each goes, how far apart their outputs
+// are, and how fast those convert to 16-bit PCM.
+int SynthesisCommand (int argc, char** argv) {
+    mem_file file = MapFileIntoMemory(argv[0]);
+    if (file.mem == NULL) {
+        fprintf(stderr, "synthesis: failed to open %s\n", argv[0]);
+        return 1;
+    }
+    uint64_t   streamStart;
+    mpa_header hdr = GetFirstAudioHeader(&file, &streamStart);
+    if (!FrameFitsInFile(&hdr, &file) || hdr.mpegLayer != 3) {
+        fprintf(stderr, "synthesis: no Layer3 stream found in %s\n", argv[0]);
+        UnmapFile(&file);
+        return 1;
+    }
+
+    // The subband samples of a batch come out of the hybrid filterbank; each synthesis kernel then
+    // runs on them from the same state. Mono and stereo granules would each need their own, so
+    // only granules with as many channels as the first are used.
+    rough_granule* batch = (rough_granule*) malloc(ROUGH_GRANULE_BATCH * sizeof(rough_granule));
+    float (*subbands)[18][SUBBAND_LANES] = malloc(ROUGH_GRANULE_BATCH * sizeof(*subbands));
+    float (*pcm)[ROUGH_GRANULE_BATCH * 576 * 2] = malloc(2 * sizeof(*pcm));
+    int16_t* pcm16 = (int16_t*) malloc(ROUGH_GRANULE_BATCH * 576 * 2 * sizeof(int16_t));
+    float    overlap[18][SUBBAND_LANES] = { 0 };
+    synthesis_state states[2] = { 0 };
+
+    uint64_t  frames = 0, granules = 0, skipped = 0;
+    double    times[3] = { 0 }, maxError = 0, maxValue = 0;
+    uint32_t  samplerate = hdr.samplerate;
+    int       channels = (hdr.channelMode == CHANNEL_MODE_MONO)? 1 : 2;
+    int       frameGranules = (hdr.mpegVersion == MPEG_V1)? 2 : 1;
+    main_data md = { .size = 0 };
+    int count;
+    while ((count = LoadRoughGranules(&file, &hdr, &md, batch, ROUGH_GRANULE_BATCH, &frames, &skipped)) > 0) {
+        int used = 0;
+        for (int i = 0; i < count; i++) {
+            if (batch[i].channels != channels) continue;
+            InverseMDCT(batch[i].xr, channels, batch[i].blockTypes, overlap, subbands[used++]);
+        }
+        for (int kernel = 0; kernel < 2; kernel++) {
+            double startTime = GetTimeSeconds();
+            for (int i = 0; i < used; i++) {
+                if (kernel == 0) SynthesizeReference(&states[0], subbands[i], 18, channels, pcm[0] + i * 576 * channels);
+                else             Synthesize(&states[1], subbands[i], 18, channels, pcm[1] + i * 576 * channels);
+            }
+            times[kernel] += GetTimeSeconds() - startTime;
+        }
+        double startTime = GetTimeSeconds();
+        ConvertToInt16(pcm[1], (size_t) used * 576 * channels, pcm16);
+        times[2] += GetTimeSeconds() - startTime;
+
+        for (size_t i = 0; i < (size_t) used * 576 * channels; i++) {
+            double value = fabs(pcm[0][i]);
+            double error = fabs(pcm[1][i] - pcm[0][i]);
+            if (value > maxValue) maxValue = value;
+            if (error > maxError) maxError = error;
+        }
+        granules += used;
+    }
+
+    double seconds = granules * 576.0 / samplerate;
+    printf("%s: %llu granules of %d channels, %llu frames skipped\n", argv[0],
+        (unsigned long long) granules, channels, (unsigned long long) skipped);
+    printf("    Reference: %.0f frames/s, %.0fx real time\n", (double) granules / frameGranules / times[0], seconds / times[0]);
+    printf("    Vector:    %.0f frames/s, %.0fx real time, %.1fx the reference\n",
+        (double) granules / frameGranules / times[1], seconds / times[1], times[0] / times[1]);
+    printf("    Conversion to 16-bit: %.0fx real time\n", seconds / times[2]);
+    printf("    Largest difference: %g, against outputs up to %g\n", maxError, maxValue);
+    free(batch);
+    free(subbands);
+    free(pcm);
+    free(pcm16);
+    UnmapFile(&file);
+    return 0;
+}
+
+// Number of samples a Layer 3 decoder's filterbanks delay its output by. Gapless players skip it
+// on top of the LAME tag's encoder delay, and keep it at the end, where the encoder padding covers
+// it.
+const uint32_t LAYER3_DECODER_DELAY = 529;
+
+// Largest value of the LAME tag's 12-bit encoder delay and padding fields.
+const uint32_t LAME_MAX_DELAY = 4095;
+
+// Size in bytes of the header of a 16-bit PCM WAV file.
+#define WAV_HEADER_SIZE 44
+
+// Fill in the header of a 16-bit PCM WAV file holding samples samples of each of channels
+// channels.
+void FillWAVHeader (uint8_t header[WAV_HEADER_SIZE], uint32_t samplerate, int channels, uint64_t samples) {
+    uint32_t dataSize = (uint32_t) (samples * channels * 2);
+    memcpy(header, "RIFF", 4);
+    WriteLE32(header + 4, 36 + dataSize);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    WriteLE32(header + 16, 16);
+    WriteLE32(header + 20, 1 | (channels << 16));              // PCM format, channel count
+    WriteLE32(header + 24, samplerate);
+    WriteLE32(header + 28, samplerate * channels * 2);         // bytes per second
+    WriteLE32(header + 32, (channels * 2) | (16 << 16));       // bytes per sample frame, bits per sample
+    memcpy(header + 36, "data", 4);
+    WriteLE32(header + 40, dataSize);
+}
+
+// Command: decode FILE [OUTPUT]
+// Decode the MPEG audio stream of FILE, of any layer, and print how fast that goes and the sample
+// peak. With OUTPUT given, the decoded audio goes there as a 16-bit WAV file, without the encoder delay and
+// padding the LAME tag of a Layer 3 stream tells, or its decoder delay.
+int DecodeCommand (int argc, char** argv) {
+    mem_file file = MapFileIntoMemory(argv[0]);
+    if (file.mem == NULL) {
+        fprintf(stderr, "decode: failed to open %s\n", argv[0]);
+        return 1;
+    }
+    uint64_t   streamStart;
+    mpa_header first   = GetFirstAudioHeader(&file, &streamStart);
+    uint8_t*   lastLoc = file.mem + file.size - 4;
+    if (!FrameFitsInFile(&first, &file)) {
+        fprintf(stderr, "decode: no MPEG audio stream found in %s\n", argv[0]);
+        UnmapFile(&file);
+        return 1;
+    }
+    FILE* out = NULL;
+    if (argc >= 2 && (out = fopen(argv[1], "wb")) == NULL) {
+        fprintf(stderr, "decode: failed to create %s\n", argv[1]);
+        UnmapFile(&file);
+        return 1;
+    }
+
+    // The samples to keep, as GetStreamSampleRange has them, but for the padding being short of the
+    // decoder delay, which would need samples past the last frame. Layer 1 and 2 streams have no
+    // LAME tag to say what their encoder delay is, so they're kept whole.
+    uint64_t frames = 0, samples = 0;
+    for (mpa_header hdr = first; FrameFitsInFile(&hdr, &file); hdr = GetNextHeader(&hdr, lastLoc)) frames++;
+    uint64_t keepStart = 0;
+    uint64_t keepEnd   = frames * PackedSamplesPerFrame(PackMPAHeader(&first));
+    if (first.mpegLayer == 3) {
+        mpa_header  streamHdr = GetFirstStreamHeader(&file);
+        xing_header xing = (streamStart < (uint64_t) (first.location - file.mem))? ReadXingHeader(&streamHdr) : INVALID_XING_HEADER;
+        lame_tag    lame = ReadLAMETag(&streamHdr, &xing);
+        keepStart = (lame.valid? lame.encoderDelay : 0) + LAYER3_DECODER_DELAY;
+        if (lame.valid && lame.encoderPadding > LAYER3_DECODER_DELAY) keepEnd -= lame.encoderPadding - LAYER3_DECODER_DELAY;
+        if (keepEnd < keepStart) keepEnd = keepStart;
+    }
+
+    int      channels = (first.channelMode == CHANNEL_MODE_MONO)? 1 : 2;
+    uint8_t  header[WAV_HEADER_SIZE];
+    float    pcm[MAX_FRAME_SAMPLES];
+    int16_t  pcm16[MAX_FRAME_SAMPLES];
+    double   seconds = 0, peak = 0;
+    bool     ok = true;
+    mpa_decoder* decoder = calloc(1, sizeof(mpa_decoder));
+    if (decoder == NULL) {
+        fprintf(stderr, "decode: failed to allocate memory\n");
+        exit(1);
+    }
+    if (out != NULL) {
+        FillWAVHeader(header, first.samplerate, channels, keepEnd - keepStart);
+        ok = fwrite(header, 1, WAV_HEADER_SIZE, out) == WAV_HEADER_SIZE;
+    }
+    for (mpa_header hdr = first; FrameFitsInFile(&hdr, &file) && ok; hdr = GetNextHeader(&hdr, lastLoc)) {
+        double start = GetTimeSeconds();
+        int    count = DecodeFrame(decoder, &hdr, pcm);
+        seconds += GetTimeSeconds() - start;
+        if (count == 0 || (hdr.channelMode == CHANNEL_MODE_MONO) != (channels == 1)) {
+            // Keep the timing of broken frames, and the channel count of the first.
+            memset(pcm, 0, sizeof(pcm));
+            count = PackedSamplesPerFrame(PackMPAHeader(&hdr));
+        }
+        for (int i = 0; i < count * channels; i++) {
+            if (fabs(pcm[i]) > peak) peak = fabs(pcm[i]);
+        }
+        if (out != NULL) {
+            uint64_t first = (samples < keepStart)? keepStart - samples : 0;
+            uint64_t last  = (samples + count > keepEnd)? ((keepEnd > samples)? keepEnd - samples : 0) : count;
+            if (first < last) {
+                ConvertToInt16(pcm + first * channels, (last - first) * channels, pcm16);
+                ok = fwrite(pcm16, 2 * channels, last - first, out) == last - first;
+            }
+        }
+        samples += count;
+    }
+    if (out != NULL && fclose(out) != 0) ok = false;
+    free(decoder);
+    UnmapFile(&file);
+    if (!ok) {
+        fprintf(stderr, "decode: failed to write %s\n", argv[1]);
+        return 1;
+    }
+
+    double duration = (double) samples / first.samplerate;
+    printf("%s: Layer%d, %llu frames, %.1f s, %d channels, peak %.1f dB (relative to full scale)\n", argv[0],
+        first.mpegLayer, (unsigned long long) frames, duration, channels, 20 * log10(peak + 1e-30));
+    printf("    Decoding: %.0f frames/s, %.0fx real time\n", frames / seconds, duration / seconds);
+    if (out != NULL) {
+        printf("    Wrote %llu samples to %s\n", (unsigned long long) (keepEnd - keepStart), argv[1]);
+    }
+    return 0;
+}
+
+// Decode a test file and compare the result, sample by sample, with the 16-bit WAV file
+// referenceName, which holds what it should decode to, from its first sample: for Layer 1 and 2,
+// the audio the file was encoded from after the encoder's own pass through the synthesis
+// filterbank, and for Layer 3, the quantized spectra the file was encoded from taken through the
+// standard's decoding steps one by one, straight from their formulas. Rounding may differ from the
+// reference by 1. Prints the largest difference found and returns whether the decoding matches.
+bool CheckDecoding (char* filename, char* referenceName) {
+    mem_file file      = MapFileIntoMemory(filename);
+    mem_file reference = MapFileIntoMemory(referenceName);
+    bool     ok = file.mem != NULL && reference.mem != NULL && reference.size >= WAV_HEADER_SIZE;
+    uint64_t streamStart, frames = 0, samples = 0;
+    int      maxDiff = 0;
+    if (ok) {
+        mpa_header first    = GetFirstAudioHeader(&file, &streamStart);
+        uint8_t*   lastLoc  = file.mem + file.size - 4;
+        uint8_t*   expected = reference.mem + WAV_HEADER_SIZE;
+        uint64_t   expectedCount = (reference.size - WAV_HEADER_SIZE) / 2;
+        float      pcm[MAX_FRAME_SAMPLES];
+        int16_t    pcm16[MAX_FRAME_SAMPLES];
+        mpa_decoder* decoder = calloc(1, sizeof(mpa_decoder));
+        if (decoder == NULL) {
+            fprintf(stderr, "CheckDecoding: failed to allocate memory\n");
+            exit(1);
+        }
+        ok = FrameFitsInFile(&first, &file);
+        for (mpa_header hdr = first; FrameFitsInFile(&hdr, &file) && ok; hdr = GetNextHeader(&hdr, lastLoc)) {
+            int count = DecodeFrame(decoder, &hdr, pcm) * ((hdr.channelMode == CHANNEL_MODE_MONO)? 1 : 2);
+            ok = count > 0 && samples + count <= expectedCount;
+            ConvertToInt16(pcm, ok? count : 0, pcm16);
+            for (int i = 0; i < count && ok; i++) {
+                uint8_t* loc  = expected + 2 * (samples + i);
+                int      diff = abs(pcm16[i] - (int16_t) (loc[0] | (loc[1] << 8)));
+                if (diff > maxDiff) maxDiff = diff;
+            }
+            samples += count;
+            frames++;
+        }
+        ok = ok && samples == expectedCount && maxDiff <= 1;
+        free(decoder);
+    }
+    printf("Decoded %llu frames of %s: largest difference from %s %d (%s)\n", (unsigned long long) frames,
+        filename, referenceName, maxDiff, ok? "ok" : "FAILED");
+    UnmapFile(&file);
+    UnmapFile(&reference);
+    return ok;
+}
+
+// Write frames first to last of an index, which are in file, to a new file. With withXing set,
+// a Xing frame with a LAME tag goes first, whose encoder delay and padding tell gapless players to
+// skip delay samples at the start and keep all but padding samples at the end. The LAME tag is a
+// copy of lameTag if it isn't NULL. With withTags set, the file's ID3v2 tag and its APEv2 and
+// ID3v1 tags are copied too, before and after the frames. Returns false on failure.
+bool WriteSegment (char* segmentName, FILE* in, mem_file* file, frame_index* idx, size_t first,
+        size_t last, bool withXing, uint8_t* lameTag, uint16_t delay, uint16_t padding, bool withTags) {
+    uint64_t start = FrameIndexOffset(idx, first);
+    uint64_t end   = FrameIndexOffset(idx, last) + FrameIndexSize(idx, last);
+
+    uint8_t frame[2048];
+    size_t  xingSize = 0;
+    if (withXing) {
+        mpa_packed_header audio = FrameIndexHeader(idx, first);
+        bool cbr = true;
+        for (size_t k = first + 1; k <= last && cbr; k++) {
+            cbr = PackedBitrate(FrameIndexHeader(idx, k)) == PackedBitrate(audio);
+        }
+        mpa_packed_header xingHdr = ChooseXingFrameHeader(audio, cbr, true);
+        if (xingHdr.word == 0 || PackedFrameSize(xingHdr) > sizeof(frame)) return false;
+
+        xing_header xing = { true };
+        xingSize        = PackedFrameSize(xingHdr);
+        xing.isInfo     = cbr;
+        xing.frameCount = (uint32_t) (last - first + 1);
+        xing.byteCount  = (uint32_t) (xingSize + end - start);
+        BuildXingTOC(idx, first, last - first + 1, xingSize, xing.byteCount, xing.toc);
+
+        uint8_t tag[LAME_TAG_SIZE] = { 'L', 'A', 'M', 'E' };
+        if (lameTag != NULL) memcpy(tag, lameTag, LAME_TAG_SIZE);
+        SetLAMETagDelays(tag, delay, padding);
+        SetLAMETagMusic(tag, xing.byteCount, CRC16LAME(file->mem + start, end - start, 0));
+        if (WriteXingFrame(frame, xingHdr, &xing, tag) != xingSize) return false;
+    }
+
+    char* tmpName;
+    FILE* out = StartAtomicWrite(segmentName, &tmpName);
+    if (out == NULL) return false;
+    uint64_t headSize = 0, tags = file->size;
+    if (withTags) {
+        headSize = GetID3v2TagSize(file->mem);
+        tags     = GetAPEv2TagOffset(file);
+        if (tags == 0) tags = GetID3v1TagOffset(file);
+        if (tags < idx->scanEnd) tags = file->size;
+    }
+    bool ok = CopyFileRange(in, 0, out, headSize) && fwrite(frame, 1, xingSize, out) == xingSize &&
+              CopyFileRange(in, start, out, end - start) && CopyFileRange(in, tags, out, file->size - tags);
+    return FinishAtomicWrite(out, tmpName, segmentName, ok);
+}
+
+// Get the range of decoder output samples that holds the audio of a stream, as AddPreRoll counts
+// them: from the encoder and decoder delays on, and up to the encoder padding, as far as its LAME
+// tag (stored into lame) tells.
+void GetStreamSampleRange (mem_file* file, frame_index* idx, lame_tag* lame, uint64_t* start, uint64_t* end) {
+    mpa_packed_header audio = FrameIndexHeader(idx, 0);
+    uint64_t    samples = idx->frameCount * PackedSamplesPerFrame(audio);
+    mpa_header  first   = GetFirstStreamHeader(file);
+    xing_header xing    = (idx->streamStart < FrameIndexOffset(idx, 0))? ReadXingHeader(&first) : INVALID_XING_HEADER;
+    *lame = ReadLAMETag(&first, &xing);
+
+    uint64_t decoderDelay = (PackedMPEGLayer(audio) == 3)? LAYER3_DECODER_DELAY : 0;
+    *start = (lame->valid? lame->encoderDelay : 0) + decoderDelay;
+    *end   = samples + decoderDelay - ((lame->valid && lame->encoderPadding < samples)? lame->encoderPadding : 0);
+}
+
+// Plan a segment of a Layer 3 stream for gapless playback of the decoder output samples from start
+// to end: the first and last frames to copy, the first ones being the pre-roll frames a decoder
+// needs (see AddPreRoll), and the encoder delay and padding for its LAME tag. toEnd tells that the
+// segment goes on to the end of the stream.
+void PlanGaplessSegment (mem_file* file, frame_index* idx, uint64_t start, uint64_t end, bool toEnd,
+        size_t* firstFrame, size_t* lastFrame, uint64_t* delay, uint64_t* padding) {
+    uint64_t samplesPerFrame = PackedSamplesPerFrame(FrameIndexHeader(idx, 0));
+    *firstFrame = start / samplesPerFrame;
+    *lastFrame  = toEnd? idx->frameCount - 1 : (end - 1) / samplesPerFrame;
+    if (*lastFrame >= idx->frameCount) *lastFrame = idx->frameCount - 1;
+    if (*firstFrame > 0) {
+        seek_result result = SeekFrameIndex(idx, start);
+        AddPreRoll(&result, file, idx);
+        *firstFrame = result.decodeFrame;
+    }
+
+    // The delay field only goes so far: give up some pre-roll if needed.
+    *delay = start - *firstFrame * samplesPerFrame - LAYER3_DECODER_DELAY;
+    while (*delay > LAME_MAX_DELAY) {
+        (*firstFrame)++;
+        *delay -= samplesPerFrame;
+    }
+    *padding = (*lastFrame + 1) * samplesPerFrame + LAYER3_DECODER_DELAY - end;
+    if (*padding > LAME_MAX_DELAY) *padding = LAME_MAX_DELAY;
+}
+
+// Split a file into segments at the given times (in seconds, in increasing order), or every
+// interval seconds if interval isn't 0, without decoding: each segment is a copy of whole frames,
+// made with CopyFileRange, named after prefix with its number and ".mp3" appended. An interval
+// must be at least a frame long.
+// Without withXing, the segments are the frames from the one holding each cut on, so that they
+// add up to the original stream exactly. A segment whose first frame takes main data from the bit
+// reservoir of the one before starts with a glitch, though, and is reported.
+// With withXing, each segment (of a Layer 3 stream) gets a Xing frame with a LAME tag, and also
+// includes the pre-roll frames a decoder needs to decode its first frame properly (see
+// AddPreRoll). The tag's encoder delay and padding are set for gapless players to play exactly
+// the samples between the cuts, honouring the original LAME tag's own delay and padding.
+bool SplitFile (char* filename, char* prefix, double* cuts, int cutCount, double interval, bool withXing) {
+    mem_file    file = MapFileIntoMemory(filename);
+    FILE*       in   = fopen(filename, "rb");
+    file_frames ff   = { 0 };
+    if (file.mem != NULL) LoadFileFrames(filename, &file, &ff);
+    frame_index* idx = ff.frames;
+    if (file.mem == NULL || in == NULL || idx->frameCount == 0 ||
+            (withXing && PackedMPEGLayer(FrameIndexHeader(idx, 0)) != 3)) {
+        fprintf(stderr, "split: no %sstream found in %s\n", withXing? "Layer3 " : "", filename);
+        if (in != NULL) fclose(in);
+        ReleaseFileFrames(&ff);
+        UnmapFile(&file);
+        return false;
+    }
+
+    // Work in samples of decoder output, like AddPreRoll, where the cut at time t falls at
+    // t * samplerate plus the original encoder delay and the decoder delay.
+    mpa_packed_header audio = FrameIndexHeader(idx, 0);
+    uint64_t samplesPerFrame = PackedSamplesPerFrame(audio);
+    if (interval > 0.0 && interval * PackedSamplerate(audio) < samplesPerFrame) {
+        fprintf(stderr, "split: an interval of %g s is shorter than a frame of %s (%.2f ms)\n", interval,
+            filename, 1e3 * samplesPerFrame / PackedSamplerate(audio));
+        fclose(in);
+        ReleaseFileFrames(&ff);
+        UnmapFile(&file);
+        return false;
+    }
+    lame_tag lame;
+    uint64_t offset, endSample;
+    GetStreamSampleRange(&file, idx, &lame, &offset, &endSample);
+
+    double   start = GetTimeSeconds();
+    uint64_t written = 0;
+    int      segments = 0, glitches = 0;
+    bool     ok = true;
+    uint64_t segmentStart = offset;
+    for (size_t i = 0; segmentStart < endSample && ok; i++) {
+        uint64_t segmentEnd = endSample;
+        if (interval > 0.0 || i < (size_t) cutCount) {
+            uint64_t cut = TimeToSample((interval > 0.0)? (i + 1) * interval : cuts[i], audio);
+            if (cut < endSample - offset) segmentEnd = cut + offset;
+        }
+        if (segmentEnd <= segmentStart) continue;
+
+        size_t   firstFrame = segmentStart / samplesPerFrame;
+        size_t   lastFrame;
+        uint64_t delay = 0, padding = 0;
+        if (!withXing) {
+            lastFrame = (segmentEnd == endSample)? idx->frameCount - 1 : segmentEnd / samplesPerFrame - 1;
+            if (lastFrame < firstFrame) continue;
+            mpa_header hdr = ReadMPAHeader(file.mem + FrameIndexOffset(idx, firstFrame));
+            if (firstFrame > 0 && GetMainDataBegin(&hdr) > 0) glitches++;
+        } else {
+            PlanGaplessSegment(&file, idx, segmentStart, segmentEnd, segmentEnd == endSample,
+                &firstFrame, &lastFrame, &delay, &padding);
+        }
+
+        size_t nameLength  = strlen(prefix) + 16;
+        char*  segmentName = (char*) malloc(nameLength);
+        if (segmentName == NULL) {
+            fprintf(stderr, "SplitFile: allocation failed\n");
+            exit(1);
+        }
+        snprintf(segmentName, nameLength, "%s%03d.mp3", prefix, segments + 1);
+        ok = WriteSegment(segmentName, in, &file, idx, firstFrame, lastFrame, withXing,
+                lame.valid? lame.location : NULL, (uint16_t) delay, (uint16_t) padding, false);
+        if (ok) {
+            printf("%s: frames %llu-%llu, %.3f s", segmentName, (unsigned long long) firstFrame,
+                (unsigned long long) lastFrame, (double) (segmentEnd - segmentStart) / PackedSamplerate(audio));
+            if (withXing) printf(" (delay %llu, padding %llu)", (unsigned long long) delay, (unsigned long long) padding);
+            printf("\n");
+            written += FrameIndexOffset(idx, lastFrame) + FrameIndexSize(idx, lastFrame) - FrameIndexOffset(idx, firstFrame);
+            segments++;
+        } else {
+            fprintf(stderr, "split: failed to write %s\n", segmentName);
+        }
+        free(segmentName);
+        segmentStart = segmentEnd;
+    }
+
+    double elapsed = GetTimeSeconds() - start;
+    printf("%d segments, %.1f MB in %.1f ms (%.0f MB/s)\n", segments, written / 1e6, elapsed * 1e3,
+        written / 1e6 / elapsed);
+    if (glitches > 0) {
+        printf("%d segments start with a frame that needs the bit reservoir of the previous one; "
+               "split with -x to include pre-roll frames instead\n", glitches);
+    }
+    fclose(in);
+    ReleaseFileFrames(&ff);
+    UnmapFile(&file);
+    return ok;
+}
+
+// Command: split [-x] FILE PREFIX SECONDS...
+// Split FILE at the given times into PREFIX001.mp3, PREFIX002.mp3 and so on. A single time of the
+// form +SECONDS cuts every SECONDS instead. With -x, every segment gets a Xing frame and LAME tag
+// for gapless, sample-accurate playback.
+int SplitCommand (int argc, char** argv) {
+    bool withXing = strcmp(argv[0], "-x") == 0;
+    if (withXing) {
+        argc--;
+        argv++;
+    }
+    if (argc < 3) {
+        fprintf(stderr, "split: no cut times given\n");
+        return 1;
+    }
+
+    int     cutCount = argc - 2;
+    double  interval = 0.0;
+    double* cuts     = (double*) malloc(cutCount * sizeof(double));
+    if (cuts == NULL) {
+        fprintf(stderr, "SplitCommand: allocation failed\n");
+        exit(1);
+    }
+    if (argc == 3 && argv[2][0] == '+') {
+        char* end;
+        interval = strtod(argv[2] + 1, &end);
+        if (end == argv[2] + 1 || *end != '\0' || !(interval > 0.0)) {
+            fprintf(stderr, "split: expected an interval of more than 0 s, got %s\n", argv[2]);
+            free(cuts);
+            return 1;
+        }
+        cutCount = 0;
+    } else {
+        for (int i = 0; i < cutCount; i++) {
+            char* end;
+            cuts[i] = strtod(argv[i + 2], &end);
+            if (end == argv[i + 2] || *end != '\0' || !(cuts[i] >= 0.0)) {
+                fprintf(stderr, "split: expected a cut time of at least 0 s, got %s\n", argv[i + 2]);
+                free(cuts);
+                return 1;
+            }
+            if (i > 0 && cuts[i] < cuts[i - 1]) {
+                fprintf(stderr, "split: cut times must be in increasing order\n");
+                free(cuts);
+                return 1;
+            }
+        }
+    }
+    bool ok = SplitFile(argv[0], argv[1], cuts, cutCount, interval, withXing);
+    free(cuts);
+    return ok? 0 : 1;
+}
+
+// Join files into one, without decoding. The streams must match in MPEG version, layer, sample
+// rate and channel mode. The output keeps the first file's ID3v2 tag and the last file's ID3v1 and
+// APEv2 tags, and otherwise holds nothing but the audio frames of every file, copied with
+// CopyFileRange: the other tags and the Xing frames are left out. For Layer 3 streams, a new Xing
+// frame covering the whole output goes first; it gets the first file's LAME tag, if any, with the
+// first file's encoder delay and the last file's padding. Files whose first frame takes main data
+// from the bit reservoir will decode with a glitch at the splice, as what it refers to now comes
+// from the end of the previous file; they are warned about. Returns false on failure.
+bool JoinFiles (char* outputName, char** filenames, int fileCount) {
+    mem_file*    files  = (mem_file*)    calloc(fileCount, sizeof(mem_file));
+    file_frames* frames = (file_frames*) calloc(fileCount, sizeof(file_frames));
+    FILE**       ins    = (FILE**)       calloc(fileCount, sizeof(FILE*));
+    if (files == NULL || frames == NULL || ins == NULL) {
+        fprintf(stderr, "JoinFiles: allocation failed\n");
+        exit(1);
+    }
+
+    // Index every file, and list the frames of the output in an index of their own.
+    frame_index joined = { 0 };
+    mpa_header  audio  = INVALID_HEADER;
+    bool        ok     = true;
+    for (int i = 0; i < fileCount && ok; i++) {
+        files[i] = MapFileIntoMemory(filenames[i]);
+        ins[i]   = fopen(filenames[i], "rb");
+        if (files[i].mem == NULL || ins[i] == NULL) {
+            fprintf(stderr, "join: failed to open %s\n", filenames[i]);
+            ok = false;
+            break;
+        }
+        LoadFileFrames(filenames[i], &files[i], &frames[i]);
+        frame_index* idx = frames[i].frames;
+        if (idx->frameCount == 0) {
+            fprintf(stderr, "join: no MPEG audio found in %s\n", filenames[i]);
+            ok = false;
+            break;
+        }
+
+        mpa_header hdr = ReadMPAHeader(files[i].mem + FrameIndexOffset(idx, 0));
+        if (i == 0) {
+            audio = hdr;
+        } else if (hdr.mpegVersion != audio.mpegVersion || hdr.mpegLayer != audio.mpegLayer ||
+                   hdr.samplerate != audio.samplerate || hdr.channelMode != audio.channelMode) {
+            fprintf(stderr, "join: %s doesn't match %s (MPEG version, layer, sample rate or channel mode)\n",
+                filenames[i], filenames[0]);
+            ok = false;
+            break;
+        } else if (hdr.mpegLayer == 3 && GetMainDataBegin(&hdr) > 0) {
+            fprintf(stderr, "join: warning: the first frame of %s takes %d bytes from the bit reservoir, "
+                "which now come from %s: expect a glitch at the splice\n", filenames[i],
+                GetMainDataBegin(&hdr), filenames[i - 1]);
+        }
+
+        // Only the bitrates of the frames matter here, beyond the stream's own fields, and the first
+        // frame's whole header, which the Xing frame is made from. Keeping the other bits would let
+        // files that differ in CRC protection or the copyright bits add up to more distinct
+        // header words than an index can hold.
+        uint64_t base = joined.scanEnd;
+        uint64_t start = FrameIndexOffset(idx, 0);
+        for (size_t k = 0; k < idx->frameCount && ok; k++) {
+            uint32_t word = FrameIndexHeader(idx, k).word;
+            if (joined.frameCount > 0) word &= MPA_STREAM_BITS_MASK | 0b00000000000000001111000000000000;
+            ok = AppendFrameToIndex(&joined, base + FrameIndexOffset(idx, k) - start, word, FrameIndexSize(idx, k));
+            if (!ok) {
+                fprintf(stderr, "join: too many distinct frame headers, at frame %llu of %s\n",
+                    (unsigned long long) k, filenames[i]);
+            }
+        }
+    }
+
+    // Make the Xing frame, from the LAME tags of the first and last files.
+    uint8_t frame[2048];
+    size_t  xingSize = 0;
+    if (ok && audio.mpegLayer == 3) {
+        mpa_header  first     = GetFirstStreamHeader(&files[0]);
+        xing_header firstXing = ReadXingHeader(&first);
+        lame_tag    firstTag  = ReadLAMETag(&first, &firstXing);
+        mpa_header  last      = GetFirstStreamHeader(&files[fileCount - 1]);
+        xing_header lastXing  = ReadXingHeader(&last);
+        lame_tag    lastTag   = ReadLAMETag(&last, &lastXing);
+
+        mpa_packed_header packed = FrameIndexHeader(&joined, 0);
+        bool cbr = true;
+        for (size_t k = 1; k < joined.frameCount && cbr; k++) {
+            cbr = PackedBitrate(FrameIndexHeader(&joined, k)) == PackedBitrate(packed);
+        }
+        mpa_packed_header xingHdr = ChooseXingFrameHeader(packed, cbr, firstTag.valid);
+        xingSize = PackedFrameSize(xingHdr);
+
+        xing_header xing = { true };
+        xing.isInfo     = cbr;
+        xing.frameCount = (uint32_t) joined.frameCount;
+        xing.byteCount  = (uint32_t) (xingSize + joined.scanEnd);
+        xing.quality    = (firstXing.flags & XING_FLAG_QUALITY)? firstXing.quality : 0;
+        BuildXingTOC(&joined, 0, joined.frameCount, xingSize, xing.byteCount, xing.toc);
+
+        uint8_t tag[LAME_TAG_SIZE];
+        if (firstTag.valid) {
+            memcpy(tag, firstTag.location, LAME_TAG_SIZE);
+            SetLAMETagDelays(tag, firstTag.encoderDelay, lastTag.valid? lastTag.encoderPadding : 0);
+            uint16_t crc = 0;
+            for (int i = 0; i < fileCount; i++) {
+                frame_index* idx   = frames[i].frames;
+                uint64_t     start = FrameIndexOffset(idx, 0);
+                uint64_t     end   = idx->scanEnd;
+                crc = CRC16LAME(files[i].mem + start, end - start, crc);
+            }
+            SetLAMETagMusic(tag, xing.byteCount, crc);
+        }
+        ok = xingHdr.word != 0 && xingSize <= sizeof(frame) &&
+             WriteXingFrame(frame, xingHdr, &xing, firstTag.valid? tag : NULL) == xingSize;
+        if (!ok) fprintf(stderr, "join: failed to make a Xing frame\n");
+    }
+
+    // Write the output: the first file's ID3v2 tag, the Xing frame, the audio of every file, and
+    // the last file's end tags.
+    double start = GetTimeSeconds();
+    if (ok) {
+        char* tmpName;
+        FILE* out = StartAtomicWrite(outputName, &tmpName);
+        ok = out != NULL;
+        if (ok) {
+            mem_file* last    = &files[fileCount - 1];
+            uint64_t  tagsEnd = last->size;
+            uint64_t  tags    = GetAPEv2TagOffset(last);
+            if (tags == 0) tags = GetID3v1TagOffset(last);
+            if (tags < frames[fileCount - 1].frames->scanEnd) tags = tagsEnd;
+
+            ok = CopyFileRange(ins[0], 0, out, GetID3v2TagSize(files[0].mem)) &&
+                 fwrite(frame, 1, xingSize, out) == xingSize;
+            for (int i = 0; i < fileCount && ok; i++) {
+                frame_index* idx   = frames[i].frames;
+                uint64_t     first = FrameIndexOffset(idx, 0);
+                ok = CopyFileRange(ins[i], first, out, idx->scanEnd - first);
+            }
+            ok = ok && CopyFileRange(ins[fileCount - 1], tags, out, tagsEnd - tags);
+            ok = FinishAtomicWrite(out, tmpName, outputName, ok);
+        }
+        if (ok) {
+            printf("%s: %d files, %llu frames, %.2f s, %.1f MB written in %.1f ms\n", outputName,
+                fileCount, (unsigned long long) joined.frameCount, FrameIndexDuration(&joined),
+                joined.scanEnd / 1e6, (GetTimeSeconds() - start) * 1e3);
+        } else {
+            fprintf(stderr, "join: failed to write %s\n", outputName);
+        }
+    }
+
+    for (int i = 0; i < fileCount; i++) {
+        if (ins[i] != NULL) fclose(ins[i]);
+        ReleaseFileFrames(&frames[i]);
+        UnmapFile(&files[i]);
+    }
+    FreeFrameIndex(&joined);
+    free(ins);
+    free(frames);
+    free(files);
+    return ok;
+}
+
+// Command: join OUTPUT FILE...
+// Join the given files into OUTPUT, without decoding.
+int JoinCommand (int argc, char** argv) {
+    return JoinFiles(argv[0], argv + 1, argc - 1)? 0 : 1;
+}
+
+// Trim the leading and trailing near-silence of a Layer 3 file into a new file, without decoding.
+// A frame is near-silent when the peak bound its side information gives (see GetFramePeakBound)
+// is below thresholdDB (in dB relative to full scale), so only the frames at either end are read,
+// and nothing is decoded. The output keeps the frames from the first loud one to the last, plus
+// the pre-roll frames the first needs for its bit reservoir and filterbank (see PlanGaplessSegment),
+// and its LAME tag's delay and padding are set for gapless players to play exactly the loud part.
+// Tags are kept. Returns false on failure.
+bool TrimFile (char* filename, char* outputName, double thresholdDB) {
+    mem_file    file = MapFileIntoMemory(filename);
+    FILE*       in   = fopen(filename, "rb");
+    file_frames ff   = { 0 };
+    if (file.mem != NULL) LoadFileFrames(filename, &file, &ff);
+    frame_index* idx = ff.frames;
+    if (file.mem == NULL || in == NULL || idx->frameCount == 0 || PackedMPEGLayer(FrameIndexHeader(idx, 0)) != 3) {
+        fprintf(stderr, "trim: no Layer3 stream found in %s\n", filename);
+        if (in != NULL) fclose(in);
+        ReleaseFileFrames(&ff);
+        UnmapFile(&file);
+        return false;
+    }
+
+    double start     = GetTimeSeconds();
+    double threshold = pow(10.0, thresholdDB / 20.0);
+    size_t loudFirst = 0, loudLast = idx->frameCount;
+    for (size_t k = 0; k < idx->frameCount && loudFirst == 0; k++) {
+        mpa_header hdr = ReadMPAHeader(file.mem + FrameIndexOffset(idx, k));
+        side_info  si  = ReadSideInfo(&hdr);
+        if (si.valid && GetFramePeakBound(&hdr, &si) > threshold) loudFirst = k + 1;
+    }
+    for (size_t k = idx->frameCount; k > 0 && loudLast == idx->frameCount && loudFirst > 0; k--) {
+        mpa_header hdr = ReadMPAHeader(file.mem + FrameIndexOffset(idx, k - 1));
+        side_info  si  = ReadSideInfo(&hdr);
+        if (si.valid && GetFramePeakBound(&hdr, &si) > threshold) loudLast = k - 1;
+    }
+    if (loudFirst == 0) {
+        fprintf(stderr, "trim: %s is silent throughout\n", filename);
+        fclose(in);
+        ReleaseFileFrames(&ff);
+        UnmapFile(&file);
+        return false;
+    }
+    loudFirst--;
+
+    // Keep the decoder output of the loud frames, within what the original plays.
+    mpa_packed_header audio = FrameIndexHeader(idx, 0);
+    uint64_t samplesPerFrame = PackedSamplesPerFrame(audio);
+    lame_tag lame;
+    uint64_t streamStart, streamEnd;
+    GetStreamSampleRange(&file, idx, &lame, &streamStart, &streamEnd);
+    uint64_t keepStart = loudFirst * samplesPerFrame + LAYER3_DECODER_DELAY;
+    uint64_t keepEnd   = (loudLast + 1) * samplesPerFrame + LAYER3_DECODER_DELAY;
+    if (keepStart < streamStart) keepStart = streamStart;
+    if (keepEnd > streamEnd)     keepEnd   = streamEnd;
+
+    size_t   firstFrame, lastFrame;
+    uint64_t delay, padding;
+    PlanGaplessSegment(&file, idx, keepStart, keepEnd, keepEnd == streamEnd, &firstFrame, &lastFrame,
+        &delay, &padding);
+    double scanned = GetTimeSeconds() - start;
+    bool ok = WriteSegment(outputName, in, &file, idx, firstFrame, lastFrame, true,
+        lame.valid? lame.location : NULL, (uint16_t) delay, (uint16_t) padding, true);
+
+    if (ok) {
+        double samplerate = PackedSamplerate(audio);
+        printf("%s: trimmed %.3f s at the start and %.3f s at the end, kept %.3f s "
+               "(frames %llu-%llu, delay %llu, padding %llu; %llu frames read in %.2f ms)\n",
+            outputName, (keepStart - streamStart) / samplerate, (streamEnd - keepEnd) / samplerate,
+            (keepEnd - keepStart) / samplerate, (unsigned long long) firstFrame,
+            (unsigned long long) lastFrame, (unsigned long long) delay, (unsigned long long) padding,
+            (unsigned long long) (loudFirst + 1 + idx->frameCount - loudLast), scanned * 1e3);
+    } else {
+        fprintf(stderr, "trim: failed to write %s\n", outputName);
+    }
+    fclose(in);
+    ReleaseFileFrames(&ff);
+    UnmapFile(&file);
+    return ok;
+}
+
+// Command: trim FILE OUTPUT [THRESHOLD_DB]
+// Trim the leading and trailing silence of FILE into OUTPUT, frames whose peak bound is below
+// THRESHOLD_DB (default -60, at most 0) counting as silent.
+int TrimCommand (int argc, char** argv) {
+    double threshold = -60.0;
+    if (argc >= 3) {
+        char* end;
+        threshold = strtod(argv[2], &end);
+        if (end == argv[2] || *end != '\0' || !(threshold <= 0.0)) {
+            fprintf(stderr, "trim: expected a threshold of at most 0 dB, got %s\n", argv[2]);
+            return 1;
+        }
+    }
+    return TrimFile(argv[0], argv[1], threshold)? 0 : 1;
+}
+
+// The three constants below were fitted against MeasureLoudness on a single file, test.mp3 (a
+// 7 minute LAME encoded song), cut into 30 s segments. That's an in-sample fit: the segments aren't
+// independent of each other, and no other file was held out to check them against, so the errors
+// quoted are what the fit reached on test.mp3, not what to expect of other music or encoders. The
+// MeasureLoudness it was fitted against relies on the Layer 3 decoder, checked separately.
+
+// Offset in dB from the mean square of a granule's spectral values, over its 576 values, to the
+// mean square of the samples it decodes to: about the power gain of the hybrid filterbank, 24 dB,
+// less the bias of EstimateGranuleEnergy. On the segments of test.mp3, the estimate then lands
+// within about 2 dB of the decoded loudness.
+const double LOUDNESS_SPECTRAL_OFFSET_DB = 24.2;
+
+// Offset in dB from the estimated RMS level of the loudest 50 ms block to the sample peak. The
+// loudest block of test.mp3 is one EstimateGranuleEnergy overestimates by about as much as its crest
+// factor, so the fit came out at 0: the "peak" EstimateLoudness reports is then just the estimated
+// RMS level of its loudest block, not an estimate of any sample, and only tracks the sample peak on
+// material like test.mp3.
+const double LOUDNESS_CREST_DB = 0.0;
+
+// Most Huffman bits a big value is taken to cost, beyond which a granule's bits are put down to its
+// count1 region. Fitted on test.mp3 along with LOUDNESS_SPECTRAL_OFFSET_DB: higher values let side
+// information of busy granules overestimate them badly.
+const double LOUDNESS_MAX_BITS_PER_VALUE = 2.5;
+
+// Estimate the energy (sum of squares, 1.0 being full scale) of the spectral values of one channel
+// of a granule, from its side information and scale factors, without decoding its Huffman data.
+// The big values are taken to follow a Laplacian distribution whose entropy matches the Huffman
+// bits spent on each, which gives their mean |value|^(8/3); each band then scales it by its step
+// size, 2^((global_gain - 210) / 4), attenuated by its scale factor and subblock gain. Big values
+// are taken to cost at most LOUDNESS_MAX_BITS_PER_VALUE bits, the rest going to count1 quadruples
+// (values of at most 1), about a third of which are non-zero.
+double EstimateGranuleEnergy (mpa_header* hdr, granule_info* g, scalefactors* sf, int huffmanBits) {
+    if (g->part23Length == 0 || huffmanBits <= 0) return 0.0;
+    double gain        = pow(2.0, (g->globalGain - 210) / 2.0);
+    int    values      = 2 * g->bigValues;
+    double bigBits     = (huffmanBits < values * LOUDNESS_MAX_BITS_PER_VALUE)? huffmanBits : values * LOUDNESS_MAX_BITS_PER_VALUE;
+    double count1Bits  = huffmanBits - bigBits;
+    if (values == 0) return count1Bits / 3.0 * gain;
+
+    // A Laplacian of mean |value| m has an entropy of about log2(2e * m) bits, and a mean
+    // |value|^(8/3) of about 4 * m^(8/3). The Huffman tables code small values in fewer bits than
+    // that, so the entropy is taken as 1 bit rather than log2(2e) = 2.44 bits above log2(m).
+    double m      = pow(2.0, bigBits / values - 1.0);
+    double power  = 4.0 * pow(m, 8.0 / 3.0);
+    int    scale  = g->scalefacScale? 2 : 1;
+    int    index  = GetSamplerateIndex(hdr);
+    bool   shortBlock = g->windowSwitching && g->blockType == 2;
+    double energy = 0.0;
+
+    // Long block bands, or the long bands of a mixed block (see GetMixedBlockLongEnd).
+    int firstShort = 0;
+    if (!shortBlock || g->mixedBlock) {
+        int longEnd = GetMixedBlockLongEnd(hdr);
+        for (int sfb = 0; sfb < 22; sfb++) {
+            int start = SFB_LONG_BOUNDS[index][sfb];
+            int end   = SFB_LONG_BOUNDS[index][sfb + 1];
+            if (start >= values || (shortBlock && start >= longEnd)) break;
+            if (end > values) end = values;
+            int factor = sf->l[sfb] + (g->preflag? SFB_PRETAB[sfb] : 0);
+            energy += ldexp(end - start, -scale * factor);
+        }
+        firstShort = 3;
+    }
+    if (shortBlock) {
+        for (int sfb = firstShort; sfb < 13; sfb++) {
+            int width = SFB_SHORT_BOUNDS[index][sfb + 1] - SFB_SHORT_BOUNDS[index][sfb];
+            for (int w = 0; w < 3; w++) {
+                int start = 3 * SFB_SHORT_BOUNDS[index][sfb] + w * width;
+                int end   = (start + width < values)? start + width : values;
+                if (end <= start) continue;
+                energy += ldexp(end - start, -4 * g->subblockGain[w] - scale * sf->s[sfb][w]);
+            }
+        }
+    }
+    return (energy * power + count1Bits / 3.0) * gain;
+}
+
+// Loudness and peak of a Layer 3 stream (see EstimateLoudness and MeasureLoudness), in dB
+// relative to full scale.
+typedef struct loudness_estimate_s {
+    bool     valid;                     // whether the estimate was made
+    double   loudness;                  // 95th percentile of the RMS level of 50 ms blocks
+    double   meanLevel;                 // RMS level of the whole stream
+    double   peak;                      // sample peak (estimated: see LOUDNESS_CREST_DB)
+    uint64_t frames;                    // number of frames walked
+    uint64_t skipped;                   // frames left out, their main data being unavailable
+} loudness_estimate;
+
+#define INVALID_LOUDNESS_ESTIMATE ((loudness_estimate) {0})
+
+// Number of histogram bins per dB, and range of the histogram, in dB relative to full scale.
+#define LOUDNESS_BINS_PER_DB 100
+const double LOUDNESS_FLOOR_DB   = -120.0;
+const double LOUDNESS_CEILING_DB = 20.0;
+
+// Accumulator of the levels of the granules of a stream, in order, into its loudness and mean
+// level.
+typedef struct loudness_meter_s {
+    uint32_t* histogram;                // levels of 50 ms blocks, from LOUDNESS_FLOOR_DB up
+    size_t    binCount;                 // bins of the histogram
+    int       granulesPerBlock;         // granules in a 50 ms block
+    int       blockGranules;            // granules of the current block so far
+    double    blockSum;                 // sum of their mean squares
+    double    totalSum;                 // sum of the mean squares of all granules
+    double    loudestBlock;             // highest mean square of a block
+    uint64_t  granules;                 // granules added
+    uint64_t  blocks;                   // blocks completed
+} loudness_meter;
+
+loudness_meter CreateLoudnessMeter (uint32_t samplerate) {
+    loudness_meter meter = { 0 };
+    meter.binCount  = (size_t) ((LOUDNESS_CEILING_DB - LOUDNESS_FLOOR_DB) * LOUDNESS_BINS_PER_DB);
+    meter.histogram = calloc(meter.binCount, sizeof(uint32_t));
+    if (meter.histogram == NULL) {
+        fprintf(stderr, "CreateLoudnessMeter: failed to allocate memory\n");
+        exit(1);
+    }
+    meter.granulesPerBlock = (int) (0.05 * samplerate / 576 + 0.5);
+    if (meter.granulesPerBlock < 1) meter.granulesPerBlock = 1;
+    return meter;
+}
+
+// Add the next granule of the stream, by the mean square of its samples (1.0 being full scale),
+// averaged over its channels.
+void AddGranuleLevel (loudness_meter* meter, double meanSquare) {
+    meter->totalSum += meanSquare;
+    meter->granules++;
+    meter->blockSum += meanSquare;
+    if (++meter->blockGranules < meter->granulesPerBlock) return;
+
+    double blockSquare = meter->blockSum / meter->blockGranules;
+    if (blockSquare > meter->loudestBlock) meter->loudestBlock = blockSquare;
+    double level = 10.0 * log10(blockSquare + 1e-30);
+    double bin   = (level - LOUDNESS_FLOOR_DB) * LOUDNESS_BINS_PER_DB;
+    meter->histogram[(bin < 0)? 0 : (bin >= meter->binCount)? meter->binCount - 1 : (size_t) bin]++;
+    meter->blocks++;
+    meter->blockSum = 0.0;
+    meter->blockGranules = 0;
+}
+
+// Store the loudness and mean level of the granules added to a meter into result, and free the
+// meter.
+void FinishLoudness (loudness_meter* meter, loudness_estimate* result) {
+    // Find the level 5% of the blocks are above.
+    uint64_t above = 0, wanted = (meter->blocks + 19) / 20;
+    size_t   bin   = meter->binCount;
+    while (bin > 0 && above < wanted) above += meter->histogram[--bin];
+    result->loudness  = LOUDNESS_FLOOR_DB + (double) bin / LOUDNESS_BINS_PER_DB;
+    result->meanLevel = 10.0 * log10(meter->totalSum / (meter->granules? meter->granules : 1) + 1e-30);
+    free(meter->histogram);
+    meter->histogram = NULL;
+}
+
+// Estimate the loudness and peak of the Layer 3 stream of a file without decoding it, from the
+// global gain, scale factors and main data size of each granule (see EstimateGranuleEnergy), in a
+// single walk of its frames. The loudness is computed like ReplayGain's, as the 95th percentile of
+// the RMS level of 50 ms blocks, but without its equal loudness filter.
+loudness_estimate EstimateLoudness (mem_file* file) {
+    uint64_t   streamStart;
+    mpa_header first   = GetFirstAudioHeader(file, &streamStart);
+    uint8_t*   lastLoc = file->mem + file->size - 4;
+    if (!FrameFitsInFile(&first, file) || first.mpegLayer != 3) return INVALID_LOUDNESS_ESTIMATE;
+
+    main_data* md = malloc(sizeof(main_data));
+    if (md == NULL) {
+        fprintf(stderr, "EstimateLoudness: failed to allocate memory\n");
+        exit(1);
+    }
+    md->size = 0;
+
+    loudness_estimate result = { true };
+    loudness_meter    meter  = CreateLoudnessMeter(first.samplerate);
+    scalefactors sf[2] = { 0 };
+    for (mpa_header hdr = first; FrameFitsInFile(&hdr, file); hdr = GetNextHeader(&hdr, lastLoc)) {
+        result.frames++;
+        side_info  si = ReadSideInfo(&hdr);
+        bit_reader br;
+        if (!si.valid || !LoadMainData(md, &hdr, &si, &br)) {
+            result.skipped++;
+            continue;
+        }
+        for (int gr = 0; gr < si.granules; gr++) {
+            double square = 0.0;
+            for (int ch = 0; ch < si.channels; ch++) {
+                granule_info* g = &si.gr[gr][ch];
+                size_t start = br.pos;
+                ReadScalefactors(&br, &hdr, &si, gr, ch, &sf[ch]);
+                int huffmanBits = g->part23Length - (int) (br.pos - start);
+                br.pos = start + g->part23Length;
+
+                square += EstimateGranuleEnergy(&hdr, g, &sf[ch], huffmanBits) / 576 / si.channels;
+            }
+            AddGranuleLevel(&meter, square);
+        }
+    }
+
+    FinishLoudness(&meter, &result);
+    result.loudness  += LOUDNESS_SPECTRAL_OFFSET_DB;
+    result.meanLevel += LOUDNESS_SPECTRAL_OFFSET_DB;
+    result.peak       = LOUDNESS_SPECTRAL_OFFSET_DB + LOUDNESS_CREST_DB + 10.0 * log10(meter.loudestBlock + 1e-30);
+    free(md);
+    return result;
+}
+
+// Measure the loudness and peak of the MPEG audio stream of a file, of any layer, like
+// EstimateLoudness, but from its decoded samples, in granules of 576 samples whatever the layer.
+loudness_estimate MeasureLoudness (mem_file* file) {
+    uint64_t   streamStart;
+    mpa_header first   = GetFirstAudioHeader(file, &streamStart);
+    uint8_t*   lastLoc = file->mem + file->size - 4;
+    if (!FrameFitsInFile(&first, file)) return INVALID_LOUDNESS_ESTIMATE;
+
+    mpa_decoder* decoder = calloc(1, sizeof(mpa_decoder));
+    if (decoder == NULL) {
+        fprintf(stderr, "MeasureLoudness: failed to allocate memory\n");
+        exit(1);
+    }
+    loudness_estimate result = { true };
+    loudness_meter    meter  = CreateLoudnessMeter(first.samplerate);
+    float  pcm[MAX_FRAME_SAMPLES];
+    double peak = 0.0, square = 0.0;
+    int    granuleSamples = 0;
+    for (mpa_header hdr = first; FrameFitsInFile(&hdr, file); hdr = GetNextHeader(&hdr, lastLoc)) {
+        result.frames++;
+        int count    = DecodeFrame(decoder, &hdr, pcm);
+        int channels = (hdr.channelMode == CHANNEL_MODE_MONO)? 1 : 2;
+        if (count == 0) {
+            result.skipped++;
+            continue;
+        }
+        for (int n = 0; n < count; n++) {
+            for (int ch = 0; ch < channels; ch++) {
+                float sample = pcm[n * channels + ch];
+                square += (double) sample * sample / channels;
+                if (fabs(sample) > peak) peak = fabs(sample);
+            }
+            if (++granuleSamples == 576) {
+                AddGranuleLevel(&meter, square / 576);
+                square = 0.0;
+                granuleSamples = 0;
+            }
+        }
+    }
+    FinishLoudness(&meter, &result);
+    result.peak = 20.0 * log10(peak + 1e-30);
+    free(decoder);
+    return result;
+}
+
+// Command: loudness [-d] FILE...
+// Estimate the loudness and peak of each FILE without decoding it (see EstimateLoudness), or with
+// -d, measure them by decoding it, along with the ReplayGain adjustment they suggest.
+int LoudnessCommand (int argc, char** argv) {
+    bool decode = argc >= 1 && strcmp(argv[0], "-d") == 0;
+    int  failures = 0;
+    for (int i = decode? 1 : 0; i < argc; i++) {
+        mem_file file = MapFileIntoMemory(argv[i]);
+        double   start = GetTimeSeconds();
+        loudness_estimate le = (file.mem == NULL)? INVALID_LOUDNESS_ESTIMATE :
+                               decode? MeasureLoudness(&file) : EstimateLoudness(&file);
+        double   elapsed = GetTimeSeconds() - start;
+        if (!le.valid) {
+            fprintf(stderr, "loudness: no %s stream found in %s\n", decode? "MPEG audio" : "Layer3", argv[i]);
+            UnmapFile(&file);
+            failures++;
+            continue;
+        }
+        // ReplayGain targets 64.82 dB on its 16-bit sample scale, where full scale is at 90.31 dB:
+        // that's -25.49 dB relative to full scale.
+        printf("%s: loudness %.1f dB, mean level %.1f dB, peak %.1f dB (relative to full scale), "
+               "track gain %s%+.1f dB\n", argv[i], le.loudness, le.meanLevel, le.peak,
+               decode? "" : "about ", -25.49 - le.loudness);
+        printf("    %llu frames (%llu skipped) in %.1f ms, %.0f MB/s\n", (unsigned long long) le.frames,
+            (unsigned long long) le.skipped, elapsed * 1e3, file.size / elapsed / 1e6);
+        UnmapFile(&file);
+    }
+    return (failures == 0)? 0 : 1;
+}
+
+// Size in bytes of the pages ChangeGain counts the writes to a file in.
+const size_t GAIN_PAGE_SIZE = 4096;
+
+// Change the volume of a Layer 3 file in place without re-encoding it, as mp3gain does, by adding
+// steps to the global_gain of every granule of every frame. Each step is 1.5 dB. Granules without
+// main data are left alone, as they're silent whatever their gain (some encoders give them a gain
+// of 255, which couldn't go up). The APEv2 tag is written first, so that the file never has its
+// gains changed without the items that undo the change; it's put back as it was if the file then
+// can't be mapped for writing. The file is mapped for writing, so only the bytes of global_gain fields (and
+// of CRCs) are written, besides the tag:
+// - frames whose CRC was right get it recomputed; those whose CRC was wrong keep a wrong one
+// - the LAME tag's MP3Gain field adds steps up, and its music CRC is recomputed if it was right
+// - the APEv2 items MP3GAIN_UNDO (the steps that undo all changes so far, for both channels) and
+//   MP3GAIN_MINMAX (the lowest and highest global_gain) are set as mp3gain sets them, and removed
+//   once the changes add up to nothing
+// Nothing is changed if a global_gain would leave 0-255. Returns false on failure.
+bool ChangeGain (char* filename, int steps) {
+    mem_file file = MapFileIntoMemory(filename);
+    if (file.mem == NULL) {
+        fprintf(stderr, "gain: failed to open %s\n", filename);
+        return false;
+    }
+    uint64_t   streamStart;
+    mpa_header first   = GetFirstAudioHeader(&file, &streamStart);
+    uint8_t*   lastLoc = file.mem + file.size - 4;
+    if (!FrameFitsInFile(&first, &file) || first.mpegLayer != 3) {
+        fprintf(stderr, "gain: no Layer3 stream found in %s\n", filename);
+        UnmapFile(&file);
+        return false;
+    }
+
+    // Check that the change fits every granule, and find where the audio ends.
+    double   start = GetTimeSeconds();
+    int      minGain = 255, maxGain = 0;
+    uint8_t* audioEnd = first.location;
+    for (mpa_header hdr = first; FrameFitsInFile(&hdr, &file); hdr = GetNextHeader(&hdr, lastLoc)) {
+        side_info si = ReadSideInfo(&hdr);
+        for (int gr = 0; gr < si.granules; gr++) {
+            for (int ch = 0; ch < si.channels; ch++) {
+                if (si.gr[gr][ch].part23Length == 0) continue;
+                if (si.gr[gr][ch].globalGain < minGain) minGain = si.gr[gr][ch].globalGain;
+                if (si.gr[gr][ch].globalGain > maxGain) maxGain = si.gr[gr][ch].globalGain;
+            }
+        }
+        audioEnd = hdr.location + hdr.frameSize;
+    }
+    if (minGain + steps < 0 || maxGain + steps > 255) {
+        fprintf(stderr, "gain: %s has global gains from %d to %d, which can't change by %+d\n",
+            filename, minGain, maxGain, steps);
+        UnmapFile(&file);
+        return false;
+    }
+
+    // Add up the undo steps of earlier changes, keeping the old items in case they must be put back.
+    char  oldUndo[64], oldMinMax[64], undo[64], minMax[64];
+    char* keys[2]      = { "MP3GAIN_UNDO", "MP3GAIN_MINMAX" };
+    char* oldValues[2] = { oldUndo, oldMinMax };
+    char* values[2]    = { undo, minMax };
+    int   undoSteps    = 0;
+    if (!ReadAPEv2Item(&file, keys[0], oldUndo, sizeof(oldUndo)))     oldValues[0] = NULL;
+    if (!ReadAPEv2Item(&file, keys[1], oldMinMax, sizeof(oldMinMax))) oldValues[1] = NULL;
+    if (oldValues[0] != NULL) undoSteps = (int) strtol(oldUndo, NULL, 10);
+    undoSteps -= steps;
+    snprintf(undo, sizeof(undo), "%+04d,%+04d,N", undoSteps, undoSteps);
+    snprintf(minMax, sizeof(minMax), "%03d,%03d", minGain + steps, maxGain + steps);
+    if (undoSteps == 0) values[0] = values[1] = NULL;
+
+    // Record the change, then map the file again for writing, the tag at its end being rewritten.
+    uint64_t audioStart = first.location - file.mem, audioSize = audioEnd - first.location;
+    UnmapFile(&file);
+    if (!SetAPEv2Items(filename, keys, values, 2)) {
+        fprintf(stderr, "gain: failed to write %s\n", filename);
+        return false;
+    }
+    file    = MapFileForWriting(filename);
+    first   = (file.mem == NULL)? INVALID_HEADER : GetFirstAudioHeader(&file, &streamStart);
+    lastLoc = file.mem + file.size - 4;
+    if (!FrameFitsInFile(&first, &file) || (uint64_t) (first.location - file.mem) != audioStart ||
+            file.size - audioStart < audioSize) {
+        fprintf(stderr, "gain: failed to open %s for writing\n", filename);
+        if (file.mem != NULL) UnmapWritableFile(&file, filename);
+        SetAPEv2Items(filename, keys, oldValues, 2);
+        return false;
+    }
+    audioEnd = first.location + audioSize;
+
+    // The LAME tag's music CRC covers all the audio, so check it before it changes.
+    mpa_header  xingHdr = GetFirstStreamHeader(&file);
+    xing_header xing    = (xingHdr.valid && xingHdr.location < first.location)? ReadXingHeader(&xingHdr) : INVALID_XING_HEADER;
+    lame_tag    lame    = ReadLAMETag(&xingHdr, &xing);
+    bool musicCRCValid  = lame.valid && CRC16LAME(first.location, audioEnd - first.location, 0) == lame.musicCRC;
+
+    uint64_t frames = 0, granules = 0, crcs = 0, pages = 0;
+    size_t   lastPage = SIZE_MAX;
+    for (mpa_header hdr = first; FrameFitsInFile(&hdr, &file); hdr = GetNextHeader(&hdr, lastLoc)) {
+        side_info si = ReadSideInfo(&hdr);
+        if (!si.valid) continue;
+        uint8_t* sideInfo = hdr.location + 4 + (hdr.crcEnabled? 2 : 0);
+        bool     crcValid = hdr.crcEnabled && GetLayer3FrameCRC(&hdr) == ((hdr.location[4] << 8) | hdr.location[5]);
+        for (int gr = 0; gr < si.granules; gr++) {
+            for (int ch = 0; ch < si.channels; ch++) {
+                if (si.gr[gr][ch].part23Length == 0) continue;
+                WriteBits(sideInfo, si.gr[gr][ch].globalGainPos, 8, si.gr[gr][ch].globalGain + steps);
+                granules++;
+            }
+        }
+        if (crcValid) {
+            uint16_t crc = GetLayer3FrameCRC(&hdr);
+            WriteBits(hdr.location + 4, 0, 16, crc);
+            crcs++;
+        }
+        frames++;
+        size_t firstPage = (hdr.location - file.mem) / GAIN_PAGE_SIZE;
+        size_t endPage   = (sideInfo + GetSideInfoSize(&hdr) - 1 - file.mem) / GAIN_PAGE_SIZE;
+        for (size_t page = firstPage; page <= endPage; page++) {
+            if (page != lastPage) pages++;
+            lastPage = page;
+        }
+    }
+
+    if (lame.valid) {
+        uint8_t* tag  = lame.location;
+        int      gain = lame.mp3Gain + steps;
+        tag[25] = (uint8_t) (int8_t) ((gain < -128)? -128 : (gain > 127)? 127 : gain);
+        if (musicCRCValid) {
+            uint16_t crc = CRC16LAME(first.location, audioEnd - first.location, 0);
+            tag[32] = crc >> 8;
+            tag[33] = crc & 0xFF;
+        }
+        if (lame.tagCRCValid) {
+            uint16_t crc = CRC16LAME(xingHdr.location, tag + 34 - xingHdr.location, 0);
+            tag[34] = crc >> 8;
+            tag[35] = crc & 0xFF;
+        }
+    }
+
+    double elapsed = GetTimeSeconds() - start;
+    if (!UnmapWritableFile(&file, filename)) {
+        // The gains were changed in memory, so they may well reach the disk yet: the undo items stay.
+        fprintf(stderr, "gain: failed to write %s\n", filename);
+        return false;
+    }
+    printf("%s: gain changed by %+.1f dB: %llu granules in %llu frames, %llu CRCs recomputed, "
+           "%llu pages written, LAME music CRC %s (%.1f ms)\n", filename, steps * 1.5,
+        (unsigned long long) granules, (unsigned long long) frames, (unsigned long long) crcs,
+        (unsigned long long) pages, !lame.valid? "absent" : musicCRCValid? "updated" : "left as it was",
+        elapsed * 1e3);
+    return true;
+}
+
+// Command: gain STEPS FILE...
+//          gain undo FILE...
+// Change the volume of each FILE in place by STEPS steps of 1.5 dB (see ChangeGain), or undo all
+// the changes made to it so far, as recorded in its APEv2 tag.
+int GainCommand (int argc, char** argv) {
+    bool  undo  = strcmp(argv[0], "undo") == 0;
+    char* end;
+    long  steps = undo? 0 : strtol(argv[0], &end, 10);
+    if (!undo && (end == argv[0] || *end != '\0' || steps < -255 || steps > 255)) {
+        fprintf(stderr, "gain: expected a number of steps from -255 to 255 or \"undo\", got %s\n", argv[0]);
+        return 1;
+    }
+    if (!undo && steps == 0) {
+        printf("gain: 0 steps, nothing to do\n");
+        return 0;
+    }
+    int failures = 0;
+    for (int i = 1; i < argc; i++) {
+        if (undo) {
+            // The value mp3gain writes is "+NNN,+NNN,N": the steps for the left and right channels.
+            mem_file file = MapFileIntoMemory(argv[i]);
+            char     value[64];
+            bool     found = file.mem != NULL && ReadAPEv2Item(&file, "MP3GAIN_UNDO", value, sizeof(value));
+            UnmapFile(&file);
+            steps = found? strtol(value, &end, 10) : 0;
+            if (found && (end == value || *end != ',' || steps < -255 || steps > 255)) {
+                fprintf(stderr, "gain: %s has an MP3GAIN_UNDO item of %s, which isn't a number of steps\n",
+                    argv[i], value);
+                failures++;
+                continue;
+            }
+            if (steps == 0) {
+                printf("%s: nothing to undo\n", argv[i]);
+                continue;
+            }
+        }
+        if (!ChangeGain(argv[i], (int) steps)) failures++;
+    }
+    return (failures == 0)? 0 : 1;
+}
+
+// Print the list of commands.
+void PrintUsage (char* program) {
+    fprintf(stderr, "Usage: %s                   print details of test.mp3's headers\n", program);
+    fprintf(stderr, "       %s index [-v] FILE...\n", program);
+    fprintf(stderr, "                                  build or check sidecar index files (-v: verify them)\n");
+    fprintf(stderr, "       %s cache DIR MAXMB FILE...\n", program);
+    fprintf(stderr, "                                  same, using an analysis cache directory\n");
+    fprintf(stderr, "       %s seek FILE SECONDS...\n", program);
+    fprintf(stderr, "                                  find the frames where the given times start\n");
+    fprintf(stderr, "       %s estimate FILE [PROBES]\n", program);
+    fprintf(stderr, "                                  estimate the duration from random probes\n");
+    fprintf(stderr, "       %s xing FILE...      regenerate Xing/Info headers and their TOC\n", program);
+    fprintf(stderr, "       %s sideinfo FILE     print Layer3 side information statistics\n", program);
+    fprintf(stderr, "       %s huffman FILE      benchmark Layer3 Huffman decoding\n", program);
+    fprintf(stderr, "       %s imdct FILE        benchmark the Layer3 IMDCT against its reference\n", program);
+    fprintf(stderr, "       %s synthesis FILE    benchmark the polyphase synthesis against its reference\n", program);
+    fprintf(stderr, "       %s decode FILE [OUTPUT]\n", program);
+    fprintf(stderr, "                                  decode to a WAV file, or just time it\n");
+    fprintf(stderr, "       %s split [-x] FILE PREFIX SECONDS...\n", program);
+    fprintf(stderr, "                                  split FILE at the given times, or every +SECONDS\n");
+    fprintf(stderr, "       %s loudness [-d] FILE...\n", program);
+    fprintf(stderr, "                                  estimate loudness and peak without decoding (-d: decode)\n");
+    fprintf(stderr, "       %s gain STEPS|undo FILE...\n", program);
+    fprintf(stderr, "                                  change the volume in place by 1.5 dB steps\n");
+    fprintf(stderr, "       %s trim FILE OUTPUT [THRESHOLD_DB]\n", program);
+    fprintf(stderr, "                                  trim leading and trailing silence into OUTPUT\n");
+    fprintf(stderr, "       %s join OUTPUT FILE...\n", program);
+    fprintf(stderr, "                                  join files of the same format into OUTPUT\n");
+    fprintf(stderr, "       %s follow FILE [IDLE_SECONDS]\n", program);
+    fprintf(stderr, "                                  print frames as they're written to FILE\n");
+}
+
+int main(int argc, char** argv) {
+    // With arguments, run one of the commands instead of the demo below.
+    if (argc >= 2) {
+        if (strcmp(argv[1], "index") == 0 && argc >= 3) return IndexCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "cache") == 0 && argc >= 5) return CacheCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "seek")  == 0 && argc >= 4) return SeekCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "estimate") == 0 && argc >= 3) return EstimateCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "xing")  == 0 && argc >= 3) return XingCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "follow") == 0 && argc >= 3) return FollowCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "sideinfo") == 0 && argc >= 3) return SideInfoCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "huffman") == 0 && argc >= 3) return HuffmanCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "imdct") == 0 && argc >= 3) return ImdctCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "synthesis") == 0 && argc >= 3) return SynthesisCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "decode") == 0 && argc >= 3) return DecodeCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "split") == 0 && argc >= 5) return SplitCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "join")  == 0 && argc >= 4) return JoinCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "trim")  == 0 && argc >= 4) return TrimCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "loudness") == 0 && argc >= 3) return LoudnessCommand(argc - 2, argv + 2);
+        if (strcmp(argv[1], "gain")  == 0 && argc >= 4) return GainCommand(argc - 2, argv + 2);
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    // Read the test file into memory and get a pointer to its contents:
+    mem_file testFileObj = ReadFileIntoMemory("test.mp3");
+    size_t fileStart  = (size_t) testFileObj.mem;
+    
+    // Get pointers to the first and last memory locations of the actual MPEG data:
+    uint8_t* firstLoc = testFileObj.mem + GetID3v2TagSize(testFileObj.mem);
+    uint8_t* lastLoc  = testFileObj.mem + testFileObj.size;
+
+    
+    // Locate and print the first MPEG header's details:
+    printf("Starting MPEG header search at %08llx...\n", (uint64_t) (firstLoc - fileStart));
+    
+    mpa_header firstHeader = GetFirstHeader(firstLoc, lastLoc);
+    if (firstHeader.valid) {
+        printf("First valid header at %08llx:\n", (uint64_t) (firstHeader.location - fileStart));
+        printf("  MPEG%s Layer %d\n",
+            ((firstHeader.mpegVersion == MPEG_V1)? "1" :
+                (firstHeader.mpegVersion == MPEG_V2)? "2": "2.5"),
+            firstHeader.mpegLayer);
+        printf("  Bit rate:    %d kbps\n", firstHeader.bitrate);
+        printf("  Sample rate: %d Hz\n", firstHeader.samplerate);
+        printf("  Copyright: %s\n", firstHeader.copyrightFlag? "yes" : "no");
+        printf("  Original:  %s\n", firstHeader.originalFlag?  "yes" : "no");
+
+        // The first frame may hold a Xing/Info header instead of audio, possibly with a LAME tag.
+        xing_header xing = ReadXingHeader(&firstHeader);
+        if (xing.valid) {
+            printf("  %s header:\n", xing.isInfo? "Info" : "Xing");
+            if (xing.flags & XING_FLAG_FRAMES)  printf("    Frames:  %u\n", xing.frameCount);
+            if (xing.flags & XING_FLAG_BYTES)   printf("    Bytes:   %u\n", xing.byteCount);
+            if (xing.flags & XING_FLAG_QUALITY) printf("    Quality: %u\n", xing.quality);
+        }
+        lame_tag lame = ReadLAMETag(&firstHeader, &xing);
+        if (lame.valid) {
+            printf("  LAME tag:\n");
+            printf("    Encoder:      %s\n", lame.encoder);
+            printf("    Lowpass:      %d Hz\n", lame.lowpass);
+            printf("    Peak:         %f\n", lame.peak);
+            if (lame.radioGainSet)      printf("    Radio gain:   %+.1f dB\n", lame.radioGain);
+            if (lame.audiophileGainSet) printf("    Album gain:   %+.1f dB\n", lame.audiophileGain);
+            printf("    Delay:        %d samples\n", lame.encoderDelay);
+            printf("    Padding:      %d samples\n", lame.encoderPadding);
+            printf("    Music length: %u bytes\n", lame.musicLength);
+            printf("    Music CRC:    %04x\n", lame.musicCRC);
+            printf("    Tag CRC:      %04x (%s)\n", lame.tagCRC, lame.tagCRCValid? "valid" : "invalid");
+        }
+    } else {
+        printf("No valid MPEG audio headers found.\n");
+    }
+    printf("\n");
+
+    
+    // Index every frame of the file and show how much memory that takes:
+    frame_index index = BuildFrameIndex(&testFileObj);
+    size_t indexBytes = FrameIndexMemoryUsage(&index);
+    printf("Indexed %llu audio frames in %llu bytes (%.2f bytes per frame).\n",
+        (unsigned long long) index.frameCount, (unsigned long long) indexBytes,
+        index.frameCount? (double) indexBytes / index.frameCount : 0.0);
+
+    // Do the same with a run-length index, which collapses runs of frames sharing a header:
+    run_index runIndex = BuildRunIndex(&testFileObj);
+    size_t runIndexBytes = RunIndexMemoryUsage(&runIndex);
+    printf("Run-length indexed %llu audio frames as %llu runs in %llu bytes.\n",
+        (unsigned long long) runIndex.frameCount, (unsigned long long) runIndex.runCount,
+        (unsigned long long) runIndexBytes);
+
+    // And with an Elias-Fano encoding of the frame offsets, which suits VBR streams best:
+    elias_fano offsets = BuildEliasFanoOffsets(&testFileObj);
+    size_t offsetsBytes = EliasFanoMemoryUsage(&offsets);
+    printf("Elias-Fano encoded %llu frame offsets in %llu bytes (%.2f bits per frame).\n\n",
+        (unsigned long long) offsets.count, (unsigned long long) offsetsBytes,
+        offsets.count? 8.0 * offsetsBytes / offsets.count : 0.0);
+
+    // Check seeks through the index, the last one past the end of the stream: the frame found must
+    // hold the sample sought, clamped to the end, and the samples to discard must not run past it.
+    // Any failed check, here or against the decoder fixtures below, fails the demo run.
+    bool checksOk = true;
+    if (index.frameCount > 0) {
+        uint64_t samplesPerFrame = PackedSamplesPerFrame(FrameIndexHeader(&index, 0));
+        uint64_t endSample       = index.frameCount * samplesPerFrame;
+        uint64_t seekSamples[4]  = { 0, endSample / 3, endSample - 1, endSample + 1000000 };
+        for (int k = 0; k < 4; k++) {
+            seek_result result = SeekFrameIndex(&index, seekSamples[k]);
+            AddPreRoll(&result, &testFileObj, &index);
+            bool ok = result.valid && result.frame < index.frameCount && result.sample <= endSample &&
+                      result.frameSample <= result.sample && result.sample <= result.frameSample + samplesPerFrame &&
+                      result.decodeFrame <= result.frame &&
+                      result.discardSamples <= (result.frame - result.decodeFrame + 1) * samplesPerFrame;
+            printf("Seek to sample %llu: frame %llu, decoding from frame %llu and discarding %llu samples (%s)\n",
+                (unsigned long long) seekSamples[k], (unsigned long long) result.frame,
+                (unsigned long long) result.decodeFrame, (unsigned long long) result.discardSamples,
+                ok? "ok" : "FAILED");
+            checksOk = ok && checksOk;
+        }
+        printf("\n");
+    }
+
+    // Check the decoders against what their test files should decode to. The Layer 3 ones are
+    // joint stereo, with MS and intensity stereo, and all block types, mixed blocks included, in
+    // MPEG1 at 44100 Hz, MPEG2 at 22050 Hz and MPEG2.5 at 8000 Hz:
+    checksOk = CheckDecoding("test.mp1", "test.mp1.wav") && checksOk;
+    checksOk = CheckDecoding("test.mp2", "test.mp2.wav") && checksOk;
+    checksOk = CheckDecoding("test-mpeg1.mp3", "test-mpeg1.mp3.wav") && checksOk;
+    checksOk = CheckDecoding("test-mpeg2.mp3", "test-mpeg2.mp3.wav") && checksOk;
+    checksOk = CheckDecoding("test-mpeg25.mp3", "test-mpeg25.mp3.wav") && checksOk;
+    printf("\n");
+
+    
+    // Print a table containing details for the first n MPEG headers:
+    int nHeaders = 50;           // how many headers to process
+    bool printAllHeaders = true; // if false, skip headers with different MPEG versions or layers
+
+    if (printAllHeaders) {
+        printf("Printing first %d MPEG headers found.\n\n", nHeaders);
+    } else {
+        printf("Printing first %d MPEG%s Layer %d headers found.\n\n", nHeaders,
+            (firstHeader.mpegVersion == MPEG_V1)? "1" :
+                (firstHeader.mpegVersion == MPEG_V2)? "2" : "2.5",
+            firstHeader.mpegLayer);
+    }
+
+    printf(" Location | MPEG | L | Kbps | Hz    | E | C | O | Frame \n");
+    printf("----------|------|---|------|-------|---|---|---|-------\n");
+
+    // Loop over each header starting with the previously obtained one.
+    mpa_header header = firstHeader;
+    while (header.valid && nHeaders > 0) {
+        // If printAllHeaders is false, check to see if this header's version and layer are correct:
+        if (printAllHeaders || (
+                header.mpegVersion == firstHeader.mpegVersion || 
+                header.mpegLayer   == firstHeader.mpegLayer))
+        {
+            // Print a row for the current header, containing:
+            // - location in memory
+            // - MPEG version
+            // - MPEG layer
+            // - bitrate (kbps)
+            // - sample rate (Hz)
+            // - whether error checking is enabled for this header
+            // - whether the "copyright" flag is set
+            // - whether the "original" flag is set
+            // - frame size
+            
+            printf(" %08llx | V%s | %d | %4d | %5d | %s | %s | %s | %5lld \n",
+                (uint64_t) (header.location - fileStart),
+                (header.mpegVersion == MPEG_V1)? "1  " :
+                    (header.mpegVersion == MPEG_V2)? "2  " : "2.5",
+                header.mpegLayer,
+                header.bitrate,
+                header.samplerate,
+                header.crcEnabled?    "Y" : " ",
+                header.copyrightFlag? "Y" : " ",
+                header.originalFlag?  "Y" : " ",
+                (uint64_t) header.frameSize);
+                
+            // Get the next header and decrement the nHeaders counter:
+            header = GetNextHeader(&header, lastLoc);
+            nHeaders--;
+        }
+    }
+
+    return checksOk? 0 : 1;
 }
\ No newline at end of file